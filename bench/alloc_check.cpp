@@ -0,0 +1,263 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Fails if the receive path allocates once it's warmed up. A Client sends
+// progressive passes of a 2K image with a long AOV name to a Server whose
+// handler prepares the tiles and blits the buckets through a BlitPool like
+// the FBWriter does. The first passes fill the buffers and, with the blits
+// held back, every job the pool can hold, then every call to operator new
+// in the process is counted while the next passes are sent.
+//
+// Only the render side of the Client is counted, not the SendQueue the
+// Arnold driver puts in front of it, which queues a copy of every bucket.
+
+#include "aton_blit_pool.h"
+#include "aton_client.h"
+#include "aton_framebuffer.h"
+#include "aton_server.h"
+#include "aton_bench.h"
+#include "alloc_count.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+    const int kXres = 2048;
+    const int kYres = 1080;
+    const int kBucketSize = 64;
+    const int kWarmupPasses = 2;
+    const int kPasses = 8;
+
+    // Small enough for the queues to fill up quickly while the blits
+    // are held back
+    const size_t kPoolMemory = 16 * 1048576;
+
+    struct CheckAov
+    {
+        const char* name;
+        int spp;
+    };
+
+    const CheckAov kAovs[] = {{"RGBA", 4},
+                              {"diffuse_indirect_albedo", 3},
+                              {"Z", 1}};
+    const int kNumAovs = 3;
+
+    // Copies the buckets into the frame buffer once it's let through
+    class CheckBlitter: public BlitHandler
+    {
+    public:
+        CheckBlitter(RenderBuffer& rb): mRb(rb), mHeld(false) {}
+
+        void onBlit(const BlitJob& job)
+        {
+            {
+                boost::mutex::scoped_lock lock(mMutex);
+                while (mHeld)
+                    mReleased.wait(lock);
+            }
+            mRb.copyBucket(job.b, job.x, job.y, job.width, job.height, job.spp, job.samples());
+        }
+
+        void hold(const bool& held)
+        {
+            {
+                boost::mutex::scoped_lock lock(mMutex);
+                mHeld = held;
+            }
+            mReleased.notify_all();
+        }
+
+    private:
+        RenderBuffer& mRb;
+        bool mHeld;
+        boost::mutex mMutex;
+        boost::condition_variable mReleased;
+    };
+
+    // The steps of FBWriterHandler::onPixels on a single frame
+    class CheckWriter: public ServerHandler
+    {
+    public:
+        CheckWriter(RenderBuffer& rb, BlitPool& pool): received(0), mRb(rb), mPool(pool) {}
+
+        void onOpenImage(const int& client, DataHeader& header) {}
+
+        void onPixels(const int& client, DataPixels& dp)
+        {
+            const char* aov = dp.aovName();
+            if (!mRb.isBufferExist(aov))
+            {
+                mPool.drain();
+                mRb.addBuffer(aov, dp.spp());
+            }
+
+            const int b = mRb.getBufferIndex(aov);
+            const int w = dp.bucket_size_x(), h = dp.bucket_size_y(), spp = dp.spp();
+            mRb.prepareBucket(b, dp.bucket_xo(), dp.bucket_yo(), w, h, spp);
+
+            BlitJob* job = mPool.acquire();
+            job->target = &mRb;
+            job->b = b;
+            job->x = dp.bucket_xo();
+            job->y = dp.bucket_yo();
+            job->width = w;
+            job->height = h;
+            job->spp = spp;
+            if (dp.isShared())
+            {
+                job->pixels = dp.data();
+                job->lease = dp.takeLease();
+            }
+            else
+                job->data.assign(dp.data(), dp.data() + w * h * spp);
+            job->update = false;
+            mPool.push(job);
+
+            boost::mutex::scoped_lock lock(mMutex);
+            received++;
+            mReceived.notify_all();
+        }
+
+        // Copy the buckets lent from the ring before it's closed
+        void onRelease(const int& client) { mPool.drain(); }
+
+        void onCloseImage(const int& client) {}
+
+        // Wait for the given number of buckets
+        void receive(const long long& buckets)
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            while (received < buckets)
+                mReceived.wait(lock);
+        }
+
+        // Wait for the given number of buckets and for their blits
+        void wait(const long long& buckets)
+        {
+            receive(buckets);
+            mPool.drain();
+        }
+
+        long long received;
+
+    private:
+        RenderBuffer& mRb;
+        BlitPool& mPool;
+        boost::mutex mMutex;
+        boost::condition_variable mReceived;
+    };
+
+    void run_server(Server* server, CheckWriter* handler)
+    {
+        server->run(*handler);
+    }
+
+    // Send the passes of the image, the samples change with every pass
+    long long send_passes(Client& client, std::vector<float>& pixels, const int& passes)
+    {
+        long long buckets = 0;
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            for (size_t i = 0; i < pixels.size(); ++i)
+                pixels[i] += 0.001f;
+
+            for (int y = 0; y < kYres; y += kBucketSize)
+            {
+                for (int x = 0; x < kXres; x += kBucketSize)
+                {
+                    const int w = std::min(kBucketSize, kXres - x);
+                    const int h = std::min(kBucketSize, kYres - y);
+                    for (int a = 0; a < kNumAovs; ++a)
+                    {
+                        DataPixels dp(kXres, kYres, x, y, w, h, kAovs[a].spp,
+                                      0, 0, kAovs[a].name, &pixels[0]);
+                        client.sendPixels(dp);
+                        buckets++;
+                    }
+                }
+            }
+        }
+        return buckets;
+    }
+
+    // Returns the number of allocations once warmed up
+    long long run(const char* name, const bool& shm, const bool& compression, const size_t& delta)
+    {
+        RenderBuffer rb(0, kXres, kYres);
+        CheckBlitter blitter(rb);
+        BlitPool pool(&blitter, 0, kPoolMemory);
+        CheckWriter handler(rb, pool);
+
+        Server server;
+        server.connect(9310, true);
+        boost::thread thread(boost::bind(run_server, &server, &handler));
+
+        std::vector<float> pixels(kBucketSize * kBucketSize * 4, 0.5f);
+        long long allocations = 0, buckets = 0;
+        double seconds = 0;
+        {
+            Client client("127.0.0.1", server.getPort());
+            client.useSharedMemory(shm);
+            client.useCompression(compression);
+            client.useDelta(delta);
+            DataHeader dh(1, kXres, kYres, kXres * kYres);
+            client.openImage(dh);
+
+            // Fill the receive buffers, the frame buffer and the pools
+            long long sent = send_passes(client, pixels, kWarmupPasses);
+            handler.wait(sent);
+
+            // Send one more with the blits held back until the queues are
+            // full, so the pool makes every job it can hold
+            const size_t job_size = kBucketSize * kBucketSize * 4 * sizeof(float);
+            blitter.hold(true);
+            boost::thread filling(boost::bind(send_passes, boost::ref(client),
+                                              boost::ref(pixels), 1));
+            handler.receive(sent + kPoolMemory / job_size);
+            blitter.hold(false);
+            filling.join();
+
+            sent += sent / kWarmupPasses;
+            handler.wait(sent);
+
+            const long long before = allocation_count();
+            BenchTimer timer;
+            buckets = send_passes(client, pixels, kPasses);
+            handler.wait(sent + buckets);
+            seconds = timer.elapsed();
+            allocations = allocation_count() - before;
+
+            client.closeImage();
+        }
+
+        server.quit();
+        thread.join();
+
+        char extra[64];
+        sprintf(extra, "%lld allocations, %.3f per bucket",
+                allocations, static_cast<double>(allocations) / buckets);
+        bench_report(name, seconds, buckets, "buckets", extra);
+        return allocations;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    long long allocations = 0;
+    allocations += run("alloc/tcp", false, false, 0);
+    allocations += run("alloc/tcp_compressed", false, true, 0);
+    allocations += run("alloc/tcp_delta", false, true, 64 * 1048576);
+    allocations += run("alloc/shm", true, false, 0);
+
+    if (allocations > 0)
+    {
+        fprintf(stderr, "aton_alloc_check: %lld allocations once warmed up\n", allocations);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Kept apart from the code that allocates, so that the compiler never
+// sees new and delete inlined down to malloc and free on one side only
+
+#include "alloc_count.h"
+
+#include <cstdlib>
+#include <new>
+#include <boost/atomic.hpp>
+
+namespace
+{
+    boost::atomic<long long> g_allocations(0);
+}
+
+long long allocation_count()
+{
+    return g_allocations.load(boost::memory_order_relaxed);
+}
+
+// Every form is replaced, so that new and delete always pair up
+void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+    g_allocations.fetch_add(1, boost::memory_order_relaxed);
+    void* ptr = malloc(size > 0 ? size : 1);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](std::size_t size) throw(std::bad_alloc)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) throw()
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr) throw()
+{
+    operator delete(ptr);
+}
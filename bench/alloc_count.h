@@ -0,0 +1,14 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ALLOC_COUNT_H_
+#define ALLOC_COUNT_H_
+
+// Number of calls to operator new in the process so far. Linking
+// alloc_count.cpp replaces the global operators new and delete
+long long allocation_count();
+
+#endif // ALLOC_COUNT_H_
@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Runs the benchmark suites linked in, every one of them or the ones
+// named on the command line: aton_bench [--list] [suite ...]
+
+#include "aton_bench.h"
+
+#include <algorithm>
+#include <cstring>
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::pair<std::string, BenchSuite> > suites = BenchRegistrar::suites();
+    std::sort(suites.begin(), suites.end());
+
+    std::vector<std::string> names;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--list") == 0)
+        {
+            for (size_t s = 0; s < suites.size(); ++s)
+                printf("%s\n", suites[s].first.c_str());
+            return 0;
+        }
+        names.push_back(argv[i]);
+    }
+
+    // Unknown names are an error rather than an empty run
+    for (size_t n = 0; n < names.size(); ++n)
+    {
+        bool found = false;
+        for (size_t s = 0; s < suites.size() && !found; ++s)
+            found = suites[s].first == names[n];
+        if (!found)
+        {
+            fprintf(stderr, "aton_bench: unknown suite %s, see --list\n", names[n].c_str());
+            return 1;
+        }
+    }
+
+    for (size_t s = 0; s < suites.size(); ++s)
+    {
+        if (names.empty() || std::find(names.begin(), names.end(), suites[s].first) != names.end())
+            suites[s].second();
+    }
+    return 0;
+}
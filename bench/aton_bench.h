@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_BENCH_H_
+#define ATON_BENCH_H_
+
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+// Wall clock timer used by the benchmarks
+class BenchTimer
+{
+public:
+    BenchTimer() { reset(); }
+
+    // Restart the timer
+    void reset() { mStart = boost::posix_time::microsec_clock::universal_time(); }
+
+    // Seconds passed since construction or the last reset
+    double elapsed() const
+    {
+        using namespace boost::posix_time;
+        const time_duration d = microsec_clock::universal_time() - mStart;
+        return d.total_microseconds() / 1000000.0;
+    }
+
+private:
+    boost::posix_time::ptime mStart;
+};
+
+// Print one result line: name, seconds, items per second and extra text
+inline void bench_report(const char* name,
+                         const double& seconds,
+                         const long long& items,
+                         const char* unit,
+                         const char* extra = "")
+{
+    const double rate = seconds > 0 ? items / seconds : 0;
+    printf("%-36s %10.3f s %14.0f %s/s  %s\n", name, seconds, rate, unit, extra);
+}
+
+// Suite of benchmarks run by aton_bench
+typedef void (*BenchSuite)();
+
+// Registers a suite at static initialization, see ATON_BENCH
+class BenchRegistrar
+{
+public:
+    BenchRegistrar(const char* name, BenchSuite suite)
+    {
+        suites().push_back(std::make_pair(std::string(name), suite));
+    }
+
+    // Every registered suite with its name
+    static std::vector<std::pair<std::string, BenchSuite> >& suites()
+    {
+        static std::vector<std::pair<std::string, BenchSuite> > registered;
+        return registered;
+    }
+};
+
+// Register the suite function under the given name, once per file
+#define ATON_BENCH(name, suite) static BenchRegistrar bench_registrar(name, suite)
+
+#endif // ATON_BENCH_H_
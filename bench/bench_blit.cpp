@@ -0,0 +1,177 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Writing 64x64 buckets into a 4K RenderBuffer, sample by sample with
+// setBufferPix against whole rows with writeBucket, reading every
+// channel of every row back the way Aton::engine does, the same in half
+// precision, and seeding a new frame from a full 2K 15 AOVs one like the
+// FBWriter does.
+
+#include "aton_framebuffer.h"
+#include "aton_bench.h"
+
+#include <vector>
+
+namespace
+{
+    const int kXres = 3840;
+    const int kYres = 2160;
+    const int kBucketSize = 64;
+    const int kFrames = 3;
+
+    // The loop the FBWriter used before writeBucket
+    void write_samples(RenderBuffer& rb, const int& b, const int& _x, const int& _y,
+                       const int& _width, const int& _height, const int& _spp,
+                       const float* data)
+    {
+        int x, y, c, xpos, ypos, offset;
+        for (x = 0; x < _width; ++x)
+        {
+            for (y = 0; y < _height; ++y)
+            {
+                offset = (_width * y * _spp) + (x * _spp);
+                for (c = 0; c < _spp; ++c)
+                {
+                    xpos = x + _x;
+                    ypos = kYres - (y + _y + 1);
+                    rb.setBufferPix(b, xpos, ypos, _spp, c, data[offset + c]);
+                }
+            }
+        }
+    }
+
+    void run(const int& spp, const bool& bulk, const bool& half = false)
+    {
+        RenderBuffer rb(0, kXres, kYres);
+        rb.addBuffer("bench", spp, half);
+
+        std::vector<float> pixels(kBucketSize * kBucketSize * spp, 0.5f);
+
+        long long buckets = 0;
+        BenchTimer timer;
+        for (int f = 0; f < kFrames; ++f)
+        {
+            for (int y = 0; y < kYres; y += kBucketSize)
+            {
+                for (int x = 0; x < kXres; x += kBucketSize)
+                {
+                    const int w = std::min(kBucketSize, kXres - x);
+                    const int h = std::min(kBucketSize, kYres - y);
+                    if (bulk)
+                        rb.writeBucket(0, x, y, w, h, spp, &pixels[0]);
+                    else
+                        write_samples(rb, 0, x, y, w, h, spp, &pixels[0]);
+                    buckets++;
+                }
+            }
+        }
+        const double seconds = timer.elapsed();
+
+        char name[64], extra[64];
+        sprintf(name, "blit/%s_%dspp_64x64%s", bulk ? "write_bucket" : "set_pix", spp, half ? "_half" : "");
+        sprintf(extra, "%.0f Mpix/s", buckets * kBucketSize * kBucketSize / seconds / 1e6);
+        bench_report(name, seconds, buckets, "buckets", extra);
+    }
+
+    void read(const int& spp, const bool& bulk, const bool& half = false)
+    {
+        RenderBuffer rb(0, kXres, kYres);
+        rb.addBuffer("bench", spp, half);
+
+        // Render the whole frame first
+        std::vector<float> pixels(kBucketSize * kBucketSize * spp, 0.5f);
+        for (int y = 0; y < kYres; y += kBucketSize)
+            for (int x = 0; x < kXres; x += kBucketSize)
+                rb.writeBucket(0, x, y, kBucketSize, kBucketSize, spp, &pixels[0]);
+
+        std::vector<float> out(kXres);
+        // Printed so the reads can't be optimised away
+        double checksum = 0;
+        long long rows = 0;
+        BenchTimer timer;
+        for (int f = 0; f < kFrames; ++f)
+        {
+            for (int c = 0; c < spp; ++c)
+            {
+                for (int y = 0; y < kYres; ++y)
+                {
+                    if (bulk)
+                        rb.readRow(0, y, c, 0, kXres, &out[0]);
+                    else
+                        for (int x = 0; x < kXres; ++x)
+                            out[x] = rb.getBufferPix(0, x, y, c);
+                    checksum += out[y % kXres];
+                    rows++;
+                }
+            }
+        }
+        const double seconds = timer.elapsed();
+
+        char name[64], extra[64];
+        sprintf(name, "read/%s_%dspp_4k%s", bulk ? "read_row" : "get_pix", spp, half ? "_half" : "");
+        sprintf(extra, "%.0f Mpix/s  checksum %.0f", rows * kXres / seconds / 1e6, checksum);
+        bench_report(name, seconds, rows, "rows", extra);
+    }
+
+    void clone()
+    {
+        const int xres = 2048, yres = 1080;
+        RenderBuffer rb(0, xres, yres);
+        std::vector<float> pixels(kBucketSize * kBucketSize * 4, 0.5f);
+        for (int a = 0; a < 15; ++a)
+        {
+            char name[16];
+            sprintf(name, "aov_%d", a);
+            const int spp = a == 0 ? 4 : 3;
+            rb.addBuffer(name, spp);
+            for (int y = 0; y < yres; y += kBucketSize)
+                for (int x = 0; x < xres; x += kBucketSize)
+                    rb.writeBucket(a, x, y, kBucketSize, kBucketSize, spp, &pixels[0]);
+        }
+
+        // Seed a frame from the last one and render one bucket in it
+        const int kClones = 8;
+        std::vector<RenderBuffer> frames;
+        frames.reserve(kClones);
+        BenchTimer timer;
+        for (int i = 0; i < kClones; ++i)
+        {
+            RenderBuffer fB(i, xres, yres);
+            fB = i == 0 ? rb : frames.back();
+            frames.push_back(fB);
+            frames.back().writeBucket(0, 0, 0, kBucketSize, kBucketSize, 4, &pixels[0]);
+        }
+        const double seconds = timer.elapsed();
+
+        size_t usage = 0;
+        for (size_t i = 0; i < frames.size(); ++i)
+            usage += frames[i].memoryUsage();
+
+        char extra[64];
+        sprintf(extra, "%.0f MB for the clones", usage / 1048576.0);
+        bench_report("clone/frame_2k_15aovs", seconds, kClones, "frames", extra);
+    }
+}
+
+static void blit_suite()
+{
+    const int spp[] = {1, 3, 4};
+    for (int i = 0; i < 3; ++i)
+    {
+        run(spp[i], false);
+        run(spp[i], true);
+        run(spp[i], true, true);
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        read(spp[i], false);
+        read(spp[i], true);
+        read(spp[i], true, true);
+    }
+    clone();
+}
+
+ATON_BENCH("blit", blit_suite);
@@ -0,0 +1,109 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Encoding, decoding, compressing and decompressing 64x64 buckets in
+// memory, the work the Client and the Server do for every bucket on top
+// of the socket.
+
+#include "aton_codec.h"
+#include "aton_half.h"
+#include "aton_bench.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+    const int kBucketSize = 64;
+    const int kBuckets = 4000;
+
+    // Noisy gradient, like a beauty pass at low AA
+    std::vector<float> noisy_bucket(const int& spp)
+    {
+        std::vector<float> pixels(kBucketSize * kBucketSize * spp);
+        for (size_t i = 0; i < pixels.size(); ++i)
+            pixels[i] = (i % 256) / 256.0f + (rand() % 1000) / 20000.0f;
+        return pixels;
+    }
+
+    // Object ids in a small range, as the bits of the floats
+    std::vector<float> id_bucket()
+    {
+        std::vector<float> pixels(kBucketSize * kBucketSize);
+        for (size_t i = 0; i < pixels.size(); ++i)
+        {
+            const unsigned int id = 1000 + (i / 700);
+            memcpy(&pixels[i], &id, sizeof(id));
+        }
+        return pixels;
+    }
+
+    // Half floats are converted with F16C if the CPU has it
+    void report(const char* name, const double& seconds, const int& bytes,
+                const int& encoding = ENCODING_FLOAT32)
+    {
+        char extra[64];
+        sprintf(extra, "%.0f MB/s of floats%s", static_cast<double>(bytes) * kBuckets / seconds / 1048576.0,
+                encoding != ENCODING_FLOAT16 ? "" : half_f16c() ? ", f16c" : ", scalar");
+        bench_report(name, seconds, kBuckets, "buckets", extra);
+    }
+
+    void run(const char* label, const int& encoding, const std::vector<float>& pixels)
+    {
+        const int num_samples = static_cast<int>(pixels.size());
+        const int bytes = num_samples * sizeof(float);
+        std::vector<char> encoded, packed, scratch;
+        std::vector<float> decoded(num_samples + 1);
+        char name[64];
+
+        // Floats are sent as they are
+        BenchTimer timer;
+        int used = ENCODING_FLOAT32;
+        if (encoding != ENCODING_FLOAT32)
+        {
+            for (int i = 0; i < kBuckets; ++i)
+                used = encode_pixels(encoding, &pixels[0], num_samples, encoded);
+            sprintf(name, "codec/encode_%s", label);
+            report(name, timer.elapsed(), bytes, used);
+        }
+
+        const char* payload = used == ENCODING_FLOAT32 ? reinterpret_cast<const char*>(&pixels[0]) : &encoded[0];
+        const int size = encoded_size(used, num_samples);
+
+        timer.reset();
+        for (int i = 0; i < kBuckets; ++i)
+            decode_pixels(used, payload, num_samples, &decoded[0]);
+        sprintf(name, "codec/decode_%s", label);
+        report(name, timer.elapsed(), bytes, used);
+
+        timer.reset();
+        bool compressed = false;
+        for (int i = 0; i < kBuckets; ++i)
+            compressed = compress_pixels(used, payload, size, packed, scratch);
+        sprintf(name, "codec/compress_%s", label);
+        report(name, timer.elapsed(), bytes);
+
+        if (!compressed)
+            return;
+
+        std::vector<char> unpacked(size + sizeof(float));
+        timer.reset();
+        for (int i = 0; i < kBuckets; ++i)
+            decompress_pixels(used, &packed[0], static_cast<int>(packed.size()), size, &unpacked[0], scratch);
+        sprintf(name, "codec/decompress_%s", label);
+        report(name, timer.elapsed(), bytes);
+    }
+}
+
+static void codec_suite()
+{
+    const std::vector<float> rgba = noisy_bucket(4);
+    run("float32_rgba", ENCODING_FLOAT32, rgba);
+    run("float16_rgba", ENCODING_FLOAT16, rgba);
+    run("int_id", ENCODING_INT16, id_bucket());
+}
+
+ATON_BENCH("codec", codec_suite);
@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Fetching every row of a 4K RenderBuffer with 10 AOVs (31 channels) the
+// way Aton::engine does, outside of Nuke. The per pixel path takes the
+// lock for each channel and checks the bounds for each pixel, the row
+// path takes it once per row and copies with readRow.
+
+#include "aton_framebuffer.h"
+#include "aton_bench.h"
+
+#include <vector>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+namespace
+{
+    const int kXres = 3840;
+    const int kYres = 2160;
+    const int kFrames = 3;
+
+    const int kAovs = 10;
+    const char* kAovNames[kAovs] = {"RGBA", "diffuse", "specular", "sss",
+                                    "transmission", "emission", "coat",
+                                    "direct", "indirect", "albedo"};
+
+    struct Fetch
+    {
+        int b, c;
+    };
+
+    void run(const bool& bulk)
+    {
+        RenderBuffer rb(0, kXres, kYres);
+        std::vector<Fetch> channels;
+        for (int a = 0; a < kAovs; ++a)
+        {
+            const int spp = a == 0 ? 4 : 3;
+            rb.addBuffer(kAovNames[a], spp);
+
+            // Render the whole frame first
+            std::vector<float> pixels(64 * 64 * spp, 0.5f);
+            for (int y = 0; y < kYres; y += 64)
+                for (int x = 0; x < kXres; x += 64)
+                    rb.writeBucket(a, x, y, 64, 64, spp, &pixels[0]);
+            for (int c = 0; c < spp; ++c)
+            {
+                Fetch fetch = {a, c};
+                channels.push_back(fetch);
+            }
+        }
+        rb.ready(true);
+
+        boost::shared_mutex mutex;
+        std::vector<float> out(kXres);
+        // Printed so the reads can't be optimised away
+        double checksum = 0;
+        long long rows = 0;
+
+        // Nuke asks for a bit more than the format on the right side
+        const int x = 0, r = kXres + 8;
+        out.resize(r - x);
+
+        BenchTimer timer;
+        for (int f = 0; f < kFrames; ++f)
+        {
+            for (int y = 0; y < kYres; ++y)
+            {
+                if (bulk)
+                {
+                    boost::shared_lock<boost::shared_mutex> lock(mutex);
+                    for (size_t i = 0; i < channels.size(); ++i)
+                    {
+                        const int b = rb.getBufferIndex(kAovNames[channels[i].b]);
+                        rb.readRow(b, y, channels[i].c, x, r, &out[0]);
+                        checksum += out[y % kXres];
+                    }
+                }
+                else
+                {
+                    for (size_t i = 0; i < channels.size(); ++i)
+                    {
+                        boost::shared_lock<boost::shared_mutex> lock(mutex);
+                        const int b = rb.getBufferIndex(kAovNames[channels[i].b]);
+                        float* cOut = &out[0];
+                        const float* END = cOut + (r - x);
+                        int xx = x;
+                        while (cOut < END)
+                        {
+                            if (!rb.isReady() || xx >= rb.getWidth() || y >= rb.getHeight())
+                                *cOut = 0.0f;
+                            else
+                                *cOut = rb.getBufferPix(b, xx, y, channels[i].c);
+                            ++cOut;
+                            ++xx;
+                        }
+                        checksum += out[y % kXres];
+                    }
+                }
+                rows++;
+            }
+        }
+        const double seconds = timer.elapsed();
+
+        char extra[96];
+        sprintf(extra, "%.0f Mpix/s  %d channels  checksum %.0f",
+                rows * kXres * channels.size() / seconds / 1e6,
+                static_cast<int>(channels.size()), checksum);
+        bench_report(bulk ? "engine/read_row_4k_10aovs" : "engine/per_pixel_4k_10aovs",
+                     seconds, rows, "rows", extra);
+    }
+}
+
+static void engine_suite()
+{
+    run(false);
+    run(true);
+}
+
+ATON_BENCH("engine", engine_suite);
@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Looking up the RenderBuffer of a frame with FrameIndex, the way
+// Aton::findFrameIndex does for every _validate and engine call, against
+// scanning the frames like it used to, with sequences of 10 to 1000 frames.
+
+#include "aton_framebuffer.h"
+#include "aton_bench.h"
+
+#include <cstdlib>
+
+namespace
+{
+    const int kLookups = 2000000;
+
+    // Nearest lower frame by scanning every frame
+    int scan(const std::vector<double>& frames, const double& frame)
+    {
+        int found = -1;
+        for (size_t i = 0; i < frames.size(); ++i)
+        {
+            if (frames[i] <= frame && (found < 0 || frames[i] > frames[found]))
+                found = static_cast<int>(i);
+        }
+        return found < 0 ? 0 : found;
+    }
+
+    void run(const int& count, const bool& indexed)
+    {
+        // Frames rendered out of order, like an IPR session jumping around
+        FrameIndex index;
+        for (int i = 0; i < count; ++i)
+            index.push_back((i * 7919) % count);
+
+        std::vector<double> queries(1024);
+        for (size_t i = 0; i < queries.size(); ++i)
+            queries[i] = (rand() % (count * 10)) / 10.0;
+
+        // Printed so the lookups can't be optimised away
+        long long checksum = 0;
+        BenchTimer timer;
+        for (int i = 0; i < kLookups; ++i)
+        {
+            const double& frame = queries[i & 1023];
+            checksum += indexed ? index.find(frame) : scan(index.frames(), frame);
+        }
+        const double seconds = timer.elapsed();
+
+        char name[64], extra[64];
+        sprintf(name, "frames/%s_%d", indexed ? "frame_index" : "scan", count);
+        sprintf(extra, "checksum %lld", checksum);
+        bench_report(name, seconds, kLookups, "lookups", extra);
+    }
+}
+
+static void frames_suite()
+{
+    const int counts[] = {10, 100, 1000};
+    for (int i = 0; i < 3; ++i)
+    {
+        run(counts[i], false);
+        run(counts[i], true);
+    }
+}
+
+ATON_BENCH("frames", frames_suite);
@@ -0,0 +1,447 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Compares the legacy field-by-field pixels protocol against the framed
+// message sent by Client::sendPixels over loopback TCP, counting the
+// socket calls both ends make per bucket.
+// Then sends a 4K frame with every wire encoding, with and without
+// compression, with the time the same frame would take on a 1 GbE link.
+// Then sends progressive passes of a 4K frame as deltas of the last pass.
+// Last times short IPR iterations over a new connection per iteration
+// against a single persistent connection.
+
+#include "aton_client.h"
+#include "aton_codec.h"
+#include "aton_server.h"
+#include "aton_bench.h"
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace boost::asio;
+using boost::asio::ip::tcp;
+
+namespace
+{
+    // Socket calls made by the process, asio sends and receives
+    // through send/recv for one buffer, sendmsg/recvmsg for several
+    boost::atomic<long long> g_writes(0), g_reads(0);
+}
+
+#ifdef __linux__
+extern "C" ssize_t send(int fd, const void* buf, size_t len, int flags)
+{
+    g_writes.fetch_add(1, boost::memory_order_relaxed);
+    return syscall(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+extern "C" ssize_t recv(int fd, void* buf, size_t len, int flags)
+{
+    g_reads.fetch_add(1, boost::memory_order_relaxed);
+    return syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+}
+
+extern "C" ssize_t sendmsg(int fd, const struct msghdr* msg, int flags)
+{
+    g_writes.fetch_add(1, boost::memory_order_relaxed);
+    return syscall(SYS_sendmsg, fd, msg, flags);
+}
+
+extern "C" ssize_t recvmsg(int fd, struct msghdr* msg, int flags)
+{
+    g_reads.fetch_add(1, boost::memory_order_relaxed);
+    return syscall(SYS_recvmsg, fd, msg, flags);
+}
+#endif
+
+namespace
+{
+    const int kPort = 9290;
+    const int kBucketSize = 16;
+    const int kSpp = 4;
+    const int kBuckets = 20000;
+
+    template <typename T>
+    void legacy_write(tcp::socket& s, const T& value)
+    {
+        write(s, buffer(reinterpret_cast<const char*>(&value), sizeof(T)));
+    }
+
+    template <typename T>
+    void legacy_read(tcp::socket& s, T& value)
+    {
+        read(s, buffer(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+
+    // The pixels message as it was sent before the framed protocol
+    void legacy_send(tcp::socket& s, DataPixels& dp)
+    {
+        const int key = 1, image_id = 1;
+        const size_t aov_size = strlen(dp.aovName()) + 1;
+        const int num_samples = dp.bucket_size_x() * dp.bucket_size_y() * dp.spp();
+        legacy_write(s, key);
+        legacy_write(s, image_id);
+        legacy_write(s, dp.xres());
+        legacy_write(s, dp.yres());
+        legacy_write(s, dp.bucket_xo());
+        legacy_write(s, dp.bucket_yo());
+        legacy_write(s, dp.bucket_size_x());
+        legacy_write(s, dp.bucket_size_y());
+        legacy_write(s, dp.spp());
+        legacy_write(s, dp.ram());
+        legacy_write(s, dp.time());
+        legacy_write(s, aov_size);
+        write(s, buffer(dp.aovName(), aov_size));
+        write(s, buffer(dp.data(), sizeof(float) * num_samples));
+    }
+
+    void legacy_server(io_service* ios, tcp::acceptor* acceptor, long long* received)
+    {
+        tcp::socket s(*ios);
+        acceptor->accept(s);
+
+        int key, i;
+        long long l;
+        size_t aov_size;
+        std::vector<char> name;
+        std::vector<float> pixels;
+        while (true)
+        {
+            legacy_read(s, key);
+            if (key != 1)
+                break;
+            int xres, yres, xo, yo, sx, sy, spp;
+            legacy_read(s, i);
+            legacy_read(s, xres);
+            legacy_read(s, yres);
+            legacy_read(s, xo);
+            legacy_read(s, yo);
+            legacy_read(s, sx);
+            legacy_read(s, sy);
+            legacy_read(s, spp);
+            legacy_read(s, l);
+            legacy_read(s, i);
+            legacy_read(s, aov_size);
+            name.resize(aov_size);
+            read(s, buffer(&name[0], aov_size));
+            pixels.resize(sx * sy * spp);
+            read(s, buffer(&pixels[0], sizeof(float) * pixels.size()));
+            (*received)++;
+        }
+    }
+
+    // Socket calls per bucket since the given counts
+    void socket_calls(char* extra, const long long& writes, const long long& reads)
+    {
+#ifdef __linux__
+        sprintf(extra, "writes/bucket: %.2f  reads/bucket: %.2f",
+                static_cast<double>(g_writes - writes) / kBuckets,
+                static_cast<double>(g_reads - reads) / kBuckets);
+#else
+        sprintf(extra, "socket calls are only counted on Linux");
+#endif
+    }
+
+    // Counts the buckets received by the Server
+    class CountingHandler: public ServerHandler
+    {
+    public:
+        CountingHandler(Server* server): mServer(server), received(0) {}
+        void onOpenImage(const int& client, DataHeader& header) {}
+        void onPixels(const int& client, DataPixels& pixels) { received++; }
+        void onCloseImage(const int& client)
+        {
+            stats = mServer->codecStats(client);
+            mServer->quit();
+        }
+
+        Server* mServer;
+        long long received;
+        CodecStats stats;
+    };
+
+    void framed_server(Server* server, CountingHandler* handler)
+    {
+        server->run(*handler);
+    }
+
+    // Quits once the Clients have closed the given number of images
+    class IprHandler: public ServerHandler
+    {
+    public:
+        IprHandler(Server* server, const int& images): mServer(server), mImages(images) {}
+        void onOpenImage(const int& client, DataHeader& header) {}
+        void onPixels(const int& client, DataPixels& pixels) {}
+        void onCloseImage(const int& client)
+        {
+            if (--mImages == 0)
+                mServer->quit();
+        }
+
+        Server* mServer;
+        int mImages;
+    };
+
+    void ipr_server(Server* server, IprHandler* handler)
+    {
+        server->run(*handler);
+    }
+
+    // Send IPR iterations of one bucket each
+    void send_iterations(const char* name, const bool& persistent, DataPixels& dp)
+    {
+        const int iterations = 2000;
+
+        Server server;
+        server.connect(kPort, true);
+        IprHandler handler(&server, iterations);
+        boost::thread t(boost::bind(ipr_server, &server, &handler));
+
+        const float cam_matrix[16] = {0};
+        const int samples[6] = {0};
+        DataHeader dh(0, 3840, 2160, 3840 * 2160, 0, 1, 54, cam_matrix, samples);
+
+        Client* client = NULL;
+        BenchTimer timer;
+        for (int i = 0; i < iterations; ++i)
+        {
+            if (client == NULL)
+            {
+                client = new Client("127.0.0.1", server.getPort());
+                client->useSharedMemory(false);
+                client->useCompression(false);
+            }
+            client->openImage(dh);
+            client->sendPixels(dp);
+            client->closeImage();
+            if (!persistent)
+            {
+                delete client;
+                client = NULL;
+            }
+        }
+        t.join();
+        const double seconds = timer.elapsed();
+        delete client;
+
+        char extra[64];
+        sprintf(extra, "%.1f us/iteration", seconds / iterations * 1e6);
+        bench_report(name, seconds, iterations, "iterations", extra);
+    }
+
+    // Send a 4K frame in 64x64 buckets with the given encoding
+    void send_frame(const char* name, const int& encoding, const bool& compress,
+                    const int& spp, const std::vector<float>& pixels)
+    {
+        const int xres = 3840, yres = 2160, size = 64;
+
+        Server server;
+        server.connect(kPort, true);
+        CountingHandler handler(&server);
+        boost::thread t(boost::bind(framed_server, &server, &handler));
+
+        const float cam_matrix[16] = {0};
+        const int samples[6] = {0};
+        DataHeader dh(0, xres, yres, xres * yres, 0, 1, 54, cam_matrix, samples);
+
+        Client client("127.0.0.1", server.getPort());
+        client.useSharedMemory(false);
+        client.useCompression(compress);
+        client.openImage(dh);
+
+        // Every bucket holds the same samples
+        std::vector<char> encoded, packed, scratch;
+        const int used = encode_pixels(encoding, &pixels[0], size * size * spp, encoded);
+        long long bucket_bytes = encoded_size(used, size * size * spp);
+        const char* payload = used == ENCODING_FLOAT32 ? reinterpret_cast<const char*>(&pixels[0]) : &encoded[0];
+        if (compress && compress_pixels(used, payload, bucket_bytes, packed, scratch))
+            bucket_bytes = packed.size();
+
+        long long bytes = 0;
+        BenchTimer timer;
+        for (int y = 0; y < yres; y += size)
+        {
+            for (int x = 0; x < xres; x += size)
+            {
+                DataPixels bucket(xres, yres, x, y, size, size, spp, 0, 0, "bench", &pixels[0]);
+                bucket.setEncoding(encoding);
+                client.sendPixels(bucket);
+                bytes += bucket_bytes;
+            }
+        }
+        client.closeImage();
+        t.join();
+        const double seconds = timer.elapsed();
+
+        char extra[96];
+        sprintf(extra, "%.1f MB/frame, %.0f ms/frame at 1 Gb/s",
+                bytes / 1048576.0, bytes * 8 / 1e9 * 1000);
+        bench_report(name, seconds, handler.received, "buckets", extra);
+    }
+
+    // Send progressive passes of a 4K frame in 64x64 buckets, where every
+    // pass refines some of the samples of the last one
+    void send_passes(const char* name, const int& encoding, const size_t& delta_memory,
+                     const int& passes, std::vector<float> pixels)
+    {
+        const int xres = 3840, yres = 2160, size = 64, spp = 4;
+
+        Server server;
+        server.connect(kPort, true);
+        CountingHandler handler(&server);
+        boost::thread t(boost::bind(framed_server, &server, &handler));
+
+        const float cam_matrix[16] = {0};
+        const int samples[6] = {0};
+        DataHeader dh(0, xres, yres, xres * yres, 0, 1, 54, cam_matrix, samples);
+
+        Client client("127.0.0.1", server.getPort());
+        client.useSharedMemory(false);
+        client.useCompression(true);
+        client.useDelta(delta_memory);
+        client.openImage(dh);
+
+        BenchTimer timer;
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            // One sample in eight converges further
+            for (size_t i = pass % 8; i < pixels.size(); i += 8)
+                pixels[i] += (rand() % 1000) / 40000.0f;
+
+            for (int y = 0; y < yres; y += size)
+            {
+                for (int x = 0; x < xres; x += size)
+                {
+                    DataPixels bucket(xres, yres, x, y, size, size, spp, 0, 0, "bench", &pixels[0]);
+                    bucket.setEncoding(encoding);
+                    client.sendPixels(bucket);
+                }
+            }
+        }
+        client.closeImage();
+        t.join();
+        const double seconds = timer.elapsed();
+
+        const double bytes = static_cast<double>(handler.stats.received) / passes;
+        char extra[96];
+        sprintf(extra, "%.1f MB/pass, %.0f ms/pass at 1 Gb/s",
+                bytes / 1048576.0, bytes * 8 / 1e9 * 1000);
+        bench_report(name, seconds, handler.received, "buckets", extra);
+    }
+}
+
+static void protocol_suite()
+{
+    std::vector<float> pixels(kBucketSize * kBucketSize * kSpp, 0.5f);
+    DataPixels dp(3840, 2160, 0, 0, kBucketSize, kBucketSize, kSpp,
+                  0, 0, "RGBA", &pixels[0]);
+
+    char extra[64];
+
+    // Legacy protocol
+    {
+        io_service ios;
+        tcp::acceptor acceptor(ios, tcp::endpoint(ip::tcp::v4(), kPort));
+        long long received = 0;
+        boost::thread t(boost::bind(legacy_server, &ios, &acceptor, &received));
+
+        tcp::socket s(ios);
+        s.connect(tcp::endpoint(ip::address::from_string("127.0.0.1"), kPort));
+
+        const long long writes = g_writes, reads = g_reads;
+        BenchTimer timer;
+        for (int i = 0; i < kBuckets; ++i)
+            legacy_send(s, dp);
+        const int quit = 2;
+        write(s, buffer(reinterpret_cast<const char*>(&quit), sizeof(int)));
+        t.join();
+        const double seconds = timer.elapsed();
+
+        socket_calls(extra, writes, reads);
+        bench_report("protocol/legacy_16x16_rgba", seconds, received, "buckets", extra);
+    }
+
+    // Framed protocol
+    {
+        Server server;
+        server.connect(kPort, true);
+        CountingHandler handler(&server);
+        boost::thread t(boost::bind(framed_server, &server, &handler));
+
+        const float cam_matrix[16] = {0};
+        const int samples[6] = {0};
+        DataHeader dh(0, 3840, 2160, 3840 * 2160, 0, 1, 54, cam_matrix, samples);
+
+        Client client("127.0.0.1", server.getPort());
+        client.useSharedMemory(false);
+        client.useCompression(false);
+        client.openImage(dh);
+
+        const long long writes = g_writes, reads = g_reads;
+        BenchTimer timer;
+        for (int i = 0; i < kBuckets; ++i)
+            client.sendPixels(dp);
+        client.closeImage();
+        t.join();
+        const double seconds = timer.elapsed();
+
+        socket_calls(extra, writes, reads);
+        bench_report("protocol/framed_16x16_rgba", seconds, handler.received, "buckets", extra);
+    }
+
+    // Wire encodings
+    {
+        std::vector<float> rgba(64 * 64 * 4);
+        for (size_t i = 0; i < rgba.size(); ++i)
+            rgba[i] = (i % 97) / 97.0f;
+
+        // Object ids in a small range, as the bits of the floats
+        std::vector<float> ids(64 * 64);
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            const unsigned int id = 1000 + (i / 700);
+            memcpy(&ids[i], &id, sizeof(id));
+        }
+
+        // Noisy gradient, like a beauty pass at low AA
+        std::vector<float> noisy(64 * 64 * 4);
+        for (size_t i = 0; i < noisy.size(); ++i)
+            noisy[i] = (i % 256) / 256.0f + (rand() % 1000) / 20000.0f;
+
+        // Depth of an object in front of the background
+        std::vector<float> depth(64 * 64, 1e10f);
+        for (size_t i = 0; i < depth.size() / 3; ++i)
+            depth[i] = 10.0f + (i % 64) * 0.01f;
+
+        send_frame("encoding/float32_4k_rgba", ENCODING_FLOAT32, false, 4, rgba);
+        send_frame("encoding/float16_4k_rgba", ENCODING_FLOAT16, false, 4, rgba);
+        send_frame("encoding/float32_4k_id", ENCODING_FLOAT32, false, 1, ids);
+        send_frame("encoding/int_4k_id", ENCODING_INT16, false, 1, ids);
+
+        send_frame("compress/float32_4k_noisy", ENCODING_FLOAT32, true, 4, noisy);
+        send_frame("compress/float16_4k_noisy", ENCODING_FLOAT16, true, 4, noisy);
+        send_frame("compress/float32_4k_z", ENCODING_FLOAT32, true, 1, depth);
+        send_frame("compress/int_4k_id", ENCODING_INT16, true, 1, ids);
+
+        send_passes("delta/float32_4k_noisy_full", ENCODING_FLOAT32, 0, 4, noisy);
+        send_passes("delta/float32_4k_noisy_delta", ENCODING_FLOAT32, 512 * 1048576, 4, noisy);
+        send_passes("delta/float16_4k_noisy_full", ENCODING_FLOAT16, 0, 4, noisy);
+        send_passes("delta/float16_4k_noisy_delta", ENCODING_FLOAT16, 512 * 1048576, 4, noisy);
+    }
+
+    // Connection per IPR iteration
+    send_iterations("ipr/reconnect_16x16_rgba", false, dp);
+    send_iterations("ipr/persistent_16x16_rgba", true, dp);
+}
+
+ATON_BENCH("protocol", protocol_suite);
@@ -0,0 +1,99 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Aggregate bucket throughput of one Server with N Clients pushing
+// buckets at the same time over loopback TCP.
+
+#include "aton_client.h"
+#include "aton_server.h"
+#include "aton_bench.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+    const int kPort = 9290;
+    const int kBucketSize = 16;
+    const int kSpp = 4;
+    const int kBucketsPerClient = 20000;
+
+    // Counts buckets and stops the Server once every Client is done
+    class CountingHandler: public ServerHandler
+    {
+    public:
+        CountingHandler(Server* server, const int& clients): mServer(server),
+                                                             mClients(clients),
+                                                             received(0),
+                                                             images(0) {}
+
+        void onOpenImage(const int& client, DataHeader& header) { images++; }
+        void onPixels(const int& client, DataPixels& pixels) { received++; }
+        void onCloseImage(const int& client)
+        {
+            if (--mClients == 0)
+                mServer->quit();
+        }
+
+        Server* mServer;
+        int mClients;
+        long long received, images;
+    };
+
+    void run_server(Server* server, CountingHandler* handler)
+    {
+        server->run(*handler);
+    }
+
+    void run_client(const int& port, const int& index)
+    {
+        const float cam_matrix[16] = {0};
+        const int samples[6] = {0};
+        DataHeader dh(index, 3840, 2160, 3840 * 2160, 0, 1, 54, cam_matrix, samples);
+
+        std::vector<float> pixels(kBucketSize * kBucketSize * kSpp, 0.5f);
+        DataPixels dp(3840, 2160, 0, 0, kBucketSize, kBucketSize, kSpp,
+                      0, 0, "RGBA", &pixels[0]);
+
+        Client client("127.0.0.1", port);
+        client.useSharedMemory(false);
+        client.useCompression(false);
+        client.openImage(dh);
+        for (int i = 0; i < kBucketsPerClient; ++i)
+            client.sendPixels(dp);
+        client.closeImage();
+    }
+}
+
+static void server_suite()
+{
+    const int clients[] = {1, 2, 4, 8};
+
+    for (int i = 0; i < 4; ++i)
+    {
+        const int n = clients[i];
+
+        Server server;
+        server.connect(kPort, true);
+        CountingHandler handler(&server, n);
+        boost::thread st(boost::bind(run_server, &server, &handler));
+
+        BenchTimer timer;
+        boost::thread_group group;
+        for (int c = 0; c < n; ++c)
+            group.create_thread(boost::bind(run_client, server.getPort(), c));
+        group.join_all();
+        st.join();
+        const double seconds = timer.elapsed();
+
+        char name[64], extra[64];
+        sprintf(name, "server/%d_clients_16x16_rgba", n);
+        sprintf(extra, "images: %lld", handler.images);
+        bench_report(name, seconds, handler.received, "buckets", extra);
+    }
+}
+
+ATON_BENCH("server", server_suite);
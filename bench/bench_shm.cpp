@@ -0,0 +1,117 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Loopback TCP against the shared memory ring for 4K frames with 20 AOVs
+// sent as 64x64 buckets.
+
+#include "aton_client.h"
+#include "aton_server.h"
+#include "aton_bench.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+    const int kPort = 9290;
+    const int kXres = 3840;
+    const int kYres = 2160;
+    const int kBucketSize = 64;
+    const int kFrames = 3;
+
+    // Beauty, 15 colour layers, 4 float layers
+    const int kAovs = 20;
+    const char* kAovNames[kAovs] = {"RGBA", "diffuse", "specular", "sss",
+                                    "transmission", "volume", "emission",
+                                    "coat", "sheen", "direct", "indirect",
+                                    "albedo", "N", "P", "light_1", "light_2",
+                                    "Z", "ID", "AO", "mask"};
+    const int kAovSpp[kAovs] = {4, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+                                3, 3, 3, 3, 3, 3, 1, 1, 1, 1};
+
+    // Reads every pixel and stops the Server once the Client is done
+    class ReadingHandler: public ServerHandler
+    {
+    public:
+        ReadingHandler(Server* server): mServer(server), buckets(0), bytes(0), sum(0) {}
+
+        void onOpenImage(const int& client, DataHeader& header) {}
+        void onPixels(const int& client, DataPixels& dp)
+        {
+            const int n = dp.bucket_size_x() * dp.bucket_size_y() * dp.spp();
+            const float* data = dp.data();
+            for (int i = 0; i < n; ++i)
+                sum += data[i];
+            buckets++;
+            bytes += n * sizeof(float);
+        }
+        void onCloseImage(const int& client) { mServer->quit(); }
+
+        Server* mServer;
+        long long buckets, bytes;
+        double sum;
+    };
+
+    void run_server(Server* server, ReadingHandler* handler)
+    {
+        server->run(*handler);
+    }
+
+    void run(const bool& shm)
+    {
+        Server server;
+        server.connect(kPort, true);
+        ReadingHandler handler(&server);
+        boost::thread st(boost::bind(run_server, &server, &handler));
+
+        const float cam_matrix[16] = {0};
+        const int samples[6] = {0};
+        DataHeader dh(0, kXres, kYres, kXres * kYres, 0, 1, 54, cam_matrix, samples);
+
+        std::vector<float> pixels(kBucketSize * kBucketSize * 4, 0.5f);
+
+        Client client("127.0.0.1", server.getPort());
+        client.useSharedMemory(shm);
+        client.useCompression(false);
+
+        BenchTimer timer;
+        for (int f = 0; f < kFrames; ++f)
+        {
+            client.openImage(dh);
+            for (int y = 0; y < kYres; y += kBucketSize)
+            {
+                for (int x = 0; x < kXres; x += kBucketSize)
+                {
+                    const int w = std::min(kBucketSize, kXres - x);
+                    const int h = std::min(kBucketSize, kYres - y);
+                    for (int a = 0; a < kAovs; ++a)
+                    {
+                        DataPixels dp(kXres, kYres, x, y, w, h, kAovSpp[a],
+                                      0, 0, kAovNames[a], &pixels[0]);
+                        client.sendPixels(dp);
+                    }
+                }
+            }
+        }
+        client.closeImage();
+        st.join();
+        const double seconds = timer.elapsed();
+
+        char extra[64];
+        sprintf(extra, "%.1f frames/s  %.0f MB/s", kFrames / seconds,
+                handler.bytes / seconds / 1048576.0);
+        bench_report(shm ? "transport/shm_4k_20aovs" : "transport/tcp_4k_20aovs",
+                     seconds, handler.buckets, "buckets", extra);
+    }
+}
+
+static void shm_suite()
+{
+    run(false);
+    run(true);
+}
+
+ATON_BENCH("shm", shm_suite);
@@ -0,0 +1,150 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Fails if the BlitPool copies two buckets touching the same tile out of
+// order. Buckets of different origins and sizes, which overlap each other
+// and the tiles, are pushed with their push index as samples and copied
+// like the FBWriter does. Some blits are slowed down so that a later
+// bucket would overtake them on another worker. Every pixel must end up
+// with the index of the last bucket pushed over it, and no tile may be
+// copied into by a bucket pushed before the last one copied into it.
+
+#include "aton_blit_pool.h"
+#include "aton_framebuffer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <boost/thread.hpp>
+
+namespace
+{
+    const int kXres = 512;
+    const int kYres = 384;
+    const int kBuckets = 4000;
+    const int kThreads = 8;
+    const int T = AOVBuffer::kTileSize;
+    const int kTilesX = (kXres + T - 1) / T;
+    const int kTilesY = (kYres + T - 1) / T;
+
+    // Copies the buckets, keeping the last bucket copied into every tile
+    class CheckBlitter: public BlitHandler
+    {
+    public:
+        CheckBlitter(RenderBuffer& rb): overtaken(0), mRb(rb), mLast(kTilesX * kTilesY, -1) {}
+
+        void onBlit(const BlitJob& job)
+        {
+            const int index = static_cast<int>(job.data[0]);
+
+            // Rows are flipped in the buffer, so are the tiles
+            const int y0 = kYres - job.y - job.height;
+            const int y1 = kYres - job.y - 1;
+            {
+                boost::mutex::scoped_lock lock(mMutex);
+                for (int ty = y0 / T; ty <= y1 / T; ++ty)
+                {
+                    for (int tx = job.x / T; tx <= (job.x + job.width - 1) / T; ++tx)
+                    {
+                        int& last = mLast[ty * kTilesX + tx];
+                        if (last > index)
+                            overtaken++;
+                        last = std::max(last, index);
+                    }
+                }
+            }
+
+            // Let the next buckets go ahead of this one
+            if (index % 5 == 0)
+                boost::this_thread::sleep(boost::posix_time::microseconds(200));
+
+            mRb.copyBucket(job.b, job.x, job.y, job.width, job.height, job.spp, job.samples());
+        }
+
+        long long overtaken;
+
+    private:
+        RenderBuffer& mRb;
+        std::vector<int> mLast;
+        boost::mutex mMutex;
+    };
+
+    struct CheckBucket
+    {
+        int x, y, width, height;
+    };
+}
+
+int main()
+{
+    RenderBuffer rb(0, kXres, kYres);
+    rb.addBuffer("order", 1);
+
+    // Buckets of random origins and sizes, and the expected samples
+    srand(1);
+    std::vector<CheckBucket> buckets(kBuckets);
+    std::vector<float> expected(kXres * kYres, 0.0f);
+    for (int i = 0; i < kBuckets; ++i)
+    {
+        CheckBucket& bucket = buckets[i];
+        bucket.width = 8 + rand() % 96;
+        bucket.height = 8 + rand() % 96;
+        bucket.x = rand() % (kXres - bucket.width + 1);
+        bucket.y = rand() % (kYres - bucket.height + 1);
+
+        for (int y = bucket.y; y < bucket.y + bucket.height; ++y)
+            std::fill(&expected[y * kXres + bucket.x],
+                      &expected[y * kXres + bucket.x + bucket.width], static_cast<float>(i));
+    }
+
+    // Every tile made writable up front, the blits run alongside
+    rb.prepareBucket(0, 0, 0, kXres, kYres, 1);
+
+    CheckBlitter blitter(rb);
+    {
+        BlitPool pool(&blitter, kThreads);
+        for (int i = 0; i < kBuckets; ++i)
+        {
+            const CheckBucket& bucket = buckets[i];
+            BlitJob* job = pool.acquire();
+            job->target = &rb;
+            job->b = 0;
+            job->x = bucket.x;
+            job->y = bucket.y;
+            job->width = bucket.width;
+            job->height = bucket.height;
+            job->spp = 1;
+            job->data.assign(bucket.width * bucket.height, static_cast<float>(i));
+            job->update = false;
+            pool.push(job);
+        }
+        pool.drain();
+    }
+
+    int failed = blitter.overtaken > 0;
+    if (failed)
+        fprintf(stderr, "blit_order: %lld tiles copied into out of order\n", blitter.overtaken);
+
+    std::vector<float> row(kXres);
+    for (int y = 0; y < kYres && !failed; ++y)
+    {
+        // Rows are stored bottom-up
+        rb.readRow(0, kYres - 1 - y, 0, 0, kXres, &row[0]);
+        for (int x = 0; x < kXres; ++x)
+        {
+            if (row[x] != expected[y * kXres + x])
+            {
+                fprintf(stderr, "blit_order: pixel %d %d has bucket %g instead of %g\n",
+                        x, y, row[x], expected[y * kXres + x]);
+                failed = 1;
+                break;
+            }
+        }
+    }
+
+    printf("%-36s %s\n", "blit_order", failed ? "failed" : "ok");
+    return failed;
+}
@@ -0,0 +1,221 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Fails if an integer AOV is stored in half precision. Its samples are
+// the bits of the integers, small ones are denormal floats which half
+// flushes to zero. A bucket of an integer AOV is written with
+// writeBucket into a RenderBuffer storing the other AOVs in half, then
+// sent by a Client through the socket, with a range the Client narrows
+// and one too wide for it, and through shared memory, to a Server whose
+// handler adds the buffers the way the FBWriter does with half AOVs on.
+
+#include "aton_client.h"
+#include "aton_codec.h"
+#include "aton_framebuffer.h"
+#include "aton_server.h"
+
+#include <cstdio>
+#include <cstring>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+    const int kXres = 96;
+    const int kYres = 80;
+    const int kBucketSize = 32;
+    const char* const kIntAov = "objectIndex";
+    const char* const kHalfAov = "diffuse";
+
+    // Integer samples as the driver sends them, the bits of the ints,
+    // all denormal floats
+    std::vector<float> int_samples(const unsigned int& step)
+    {
+        std::vector<float> samples(kXres * kYres);
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            const unsigned int bits = 1 + static_cast<unsigned int>(i % 251) * step;
+            memcpy(&samples[i], &bits, sizeof(bits));
+        }
+        return samples;
+    }
+
+    // Add the buffer of an AOV with half AOVs on, like the FBWriter
+    void add_buffer(RenderBuffer& rb, const DataPixels& dp)
+    {
+        if (!rb.isBufferExist(dp.aovName()))
+            rb.addBuffer(dp.aovName(), dp.spp(), !aov_full_precision(dp));
+    }
+
+    // Check that the integer AOV reads back bit for bit, and that
+    // the other AOV was stored in half
+    int check_buffer(const char* name, RenderBuffer& rb, const std::vector<float>& samples)
+    {
+        if (!rb.isBufferExist(kIntAov) || !rb.isBufferExist(kHalfAov) || rb.memorySaved() == 0)
+        {
+            fprintf(stderr, "%s: the buffers weren't added with half AOVs on\n", name);
+            return 1;
+        }
+
+        const int b = rb.getBufferIndex(kIntAov);
+        std::vector<float> row(kXres);
+        for (int y = 0; y < kYres; ++y)
+        {
+            // Rows are stored bottom-up
+            rb.readRow(b, kYres - 1 - y, 0, 0, kXres, &row[0]);
+            if (memcmp(&row[0], &samples[y * kXres], sizeof(float) * kXres) != 0)
+            {
+                fprintf(stderr, "%s: row %d of %s lost its integer samples\n", name, y, kIntAov);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // Copy the rows of a bucket out of the image
+    void bucket_samples(const std::vector<float>& image, const int& x, const int& y,
+                        const int& w, const int& h, std::vector<float>& out)
+    {
+        out.resize(w * h);
+        for (int r = 0; r < h; ++r)
+            memcpy(&out[r * w], &image[(y + r) * kXres + x], sizeof(float) * w);
+    }
+
+    // The steps of FBWriterHandler that add and write the buffers
+    class CheckWriter: public ServerHandler
+    {
+    public:
+        CheckWriter(): buffer(0, kXres, kYres), received(0) {}
+
+        void onOpenImage(const int&, DataHeader&) {}
+
+        void onPixels(const int&, DataPixels& dp)
+        {
+            add_buffer(buffer, dp);
+            buffer.writeBucket(buffer.getBufferIndex(dp.aovName()), dp.bucket_xo(), dp.bucket_yo(),
+                               dp.bucket_size_x(), dp.bucket_size_y(), dp.spp(), dp.data());
+
+            boost::mutex::scoped_lock lock(mMutex);
+            received++;
+            mReceived.notify_all();
+        }
+
+        void onCloseImage(const int&) {}
+
+        // Wait for the given number of buckets
+        void wait(const long long& buckets)
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            while (received < buckets)
+                mReceived.wait(lock);
+        }
+
+        RenderBuffer buffer;
+        long long received;
+
+    private:
+        boost::mutex mMutex;
+        boost::condition_variable mReceived;
+    };
+
+    void run_server(Server* server, CheckWriter* handler)
+    {
+        server->run(*handler);
+    }
+
+    // Write the buckets straight into a RenderBuffer
+    int run_local(const char* name)
+    {
+        const std::vector<float> samples = int_samples(1);
+        const std::vector<float> shaded(kBucketSize * kBucketSize, 0.5f);
+        RenderBuffer rb(0, kXres, kYres);
+
+        std::vector<float> bucket;
+        for (int y = 0; y < kYres; y += kBucketSize)
+        {
+            for (int x = 0; x < kXres; x += kBucketSize)
+            {
+                bucket_samples(samples, x, y, kBucketSize, kBucketSize, bucket);
+                DataPixels dp(kXres, kYres, x, y, kBucketSize, kBucketSize, 1,
+                              0, 0, kIntAov, &bucket[0]);
+                dp.setEncoding(ENCODING_INT16);
+                add_buffer(rb, dp);
+                rb.writeBucket(rb.getBufferIndex(kIntAov), x, y,
+                               kBucketSize, kBucketSize, 1, &bucket[0]);
+
+                DataPixels half(kXres, kYres, x, y, kBucketSize, kBucketSize, 1,
+                                0, 0, kHalfAov, &shaded[0]);
+                add_buffer(rb, half);
+                rb.writeBucket(rb.getBufferIndex(kHalfAov), x, y,
+                               kBucketSize, kBucketSize, 1, &shaded[0]);
+            }
+        }
+
+        const int failed = check_buffer(name, rb, samples);
+        printf("%-36s %s\n", name, failed ? "failed" : "ok");
+        return failed;
+    }
+
+    // Send the buckets through a Client
+    int run_client(const char* name, const unsigned int& step, const bool& shm)
+    {
+        CheckWriter handler;
+        Server server;
+        server.connect(9360, true);
+        boost::thread thread(boost::bind(run_server, &server, &handler));
+
+        const std::vector<float> samples = int_samples(step);
+        const std::vector<float> shaded(kBucketSize * kBucketSize, 0.5f);
+        long long buckets = 0;
+        {
+            Client client("127.0.0.1", server.getPort());
+            client.useSharedMemory(shm);
+
+            DataHeader dh(0, kXres, kYres, kXres * kYres);
+            client.openImage(dh);
+
+            std::vector<float> bucket;
+            for (int y = 0; y < kYres; y += kBucketSize)
+            {
+                for (int x = 0; x < kXres; x += kBucketSize)
+                {
+                    bucket_samples(samples, x, y, kBucketSize, kBucketSize, bucket);
+                    DataPixels dp(kXres, kYres, x, y, kBucketSize, kBucketSize, 1,
+                                  0, 0, kIntAov, &bucket[0]);
+                    dp.setEncoding(ENCODING_INT16);
+                    client.sendPixels(dp);
+
+                    DataPixels half(kXres, kYres, x, y, kBucketSize, kBucketSize, 1,
+                                    0, 0, kHalfAov, &shaded[0]);
+                    half.setEncoding(ENCODING_FLOAT16);
+                    client.sendPixels(half);
+                    buckets += 2;
+                }
+            }
+            client.closeImage();
+        }
+
+        handler.wait(buckets);
+        server.quit();
+        thread.join();
+
+        const int failed = check_buffer(name, handler.buffer, samples);
+        printf("%-36s %s\n", name, failed ? "failed" : "ok");
+        return failed;
+    }
+}
+
+int main()
+{
+    int failed = 0;
+    failed += run_local("half/write_bucket");
+
+    // Narrowed to 8 bits, then sent as floats with a range over 16 bits
+    failed += run_client("half/socket_narrowed", 1, false);
+    failed += run_client("half/socket_wide", 0x1000, false);
+    failed += run_client("half/shm", 1, true);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,247 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Fails if two renders sent at once write into each other's frames. Two
+// Clients, one through the socket and one through shared memory, render
+// the same frame number with their own session index, AOVs and samples
+// into a Server whose handler keeps the frames of every session in a
+// FrameBuffer the way the FBWriter does. The second render changes its
+// AOVs between iterations, which resets the AOVs of its frame only. Runs
+// with and without multiframes.
+
+#include "aton_client.h"
+#include "aton_framebuffer.h"
+#include "aton_server.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+    const int kXres = 320;
+    const int kYres = 200;
+    const int kBucketSize = 64;
+    const int kIterations = 3;
+    const double kFrame = 1001;
+
+    // AOVs of a render for every iteration
+    struct CheckRender
+    {
+        int session;
+        bool shm;
+        const char* aovs[kIterations][2];
+    };
+
+    const CheckRender kRenders[] = {{101, false, {{"RGBA", "diffuse"},
+                                                  {"RGBA", "diffuse"},
+                                                  {"RGBA", "diffuse"}}},
+                                    {202, true,  {{"RGBA", "Z"},
+                                                  {"RGBA", "specular"},
+                                                  {"RGBA", "specular"}}}};
+    const int kNumRenders = 2;
+
+    int aov_spp(const std::string& aov)
+    {
+        return aov == "RGBA" ? 4 : aov == "Z" ? 1 : 3;
+    }
+
+    // The steps of FBWriterHandler that pick the frame of a bucket
+    class CheckWriter: public ServerHandler
+    {
+    public:
+        CheckWriter(const bool& multiframes): received(0), mMultiframes(multiframes) {}
+
+        void onOpenImage(const int& client, DataHeader& dh)
+        {
+            if (find_session(frames, dh.index()) < 0)
+                frames.push_back(FrameBuffer(dh.index()));
+            FrameBuffer& fbs = frames[find_session(frames, dh.index())];
+
+            Writing& w = mClients[client];
+            w.session = dh.index();
+            w.frame = fbs.open(dh.currentFrame(), dh.xres(), dh.yres(), mMultiframes);
+
+            // AOVs of the last iteration, a new set resets the frame
+            std::vector<std::string>& aovs = mAovs[w.session];
+            RenderBuffer& rb = fbs[w.frame];
+            if (!rb.empty() && !aovs.empty() && rb.isAovsChanged(aovs))
+                rb.resize(1);
+            aovs.clear();
+        }
+
+        void onPixels(const int& client, DataPixels& dp)
+        {
+            Writing& w = mClients[client];
+            RenderBuffer& rb = frames[find_session(frames, w.session)][w.frame];
+            const char* aov = dp.aovName();
+
+            std::vector<std::string>& aovs = mAovs[w.session];
+            if (std::find(aovs.begin(), aovs.end(), aov) == aovs.end())
+                aovs.push_back(aov);
+
+            if (rb.isResolutionChanged(dp.xres(), dp.yres()))
+                rb.setResolution(dp.xres(), dp.yres());
+            if (!rb.isBufferExist(aov))
+                rb.addBuffer(aov, dp.spp());
+            rb.writeBucket(rb.getBufferIndex(aov), dp.bucket_xo(), dp.bucket_yo(),
+                           dp.bucket_size_x(), dp.bucket_size_y(), dp.spp(), dp.data());
+
+            boost::mutex::scoped_lock lock(mMutex);
+            received++;
+            mReceived.notify_all();
+        }
+
+        void onCloseImage(const int& client) {}
+
+        // Wait for the given number of buckets
+        void wait(const long long& buckets)
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            while (received < buckets)
+                mReceived.wait(lock);
+        }
+
+        std::vector<FrameBuffer> frames;
+        long long received;
+
+    private:
+        struct Writing
+        {
+            Writing(): session(0), frame(0) {}
+            int session, frame;
+        };
+
+        bool mMultiframes;
+        std::map<int, Writing> mClients;
+        std::map<int, std::vector<std::string> > mAovs;
+        boost::mutex mMutex;
+        boost::condition_variable mReceived;
+    };
+
+    void run_server(Server* server, CheckWriter* handler)
+    {
+        server->run(*handler);
+    }
+
+    // Render every iteration, the samples are the session index
+    void render(const int& port, const CheckRender* render)
+    {
+        Client client("127.0.0.1", port);
+        client.useSharedMemory(render->shm);
+
+        const std::vector<float> pixels(kBucketSize * kBucketSize * 4,
+                                        static_cast<float>(render->session));
+        for (int i = 0; i < kIterations; ++i)
+        {
+            DataHeader dh(render->session, kXres, kYres, kXres * kYres, 0, kFrame);
+            client.openImage(dh);
+
+            for (int y = 0; y < kYres; y += kBucketSize)
+            {
+                for (int x = 0; x < kXres; x += kBucketSize)
+                {
+                    const int w = std::min(kBucketSize, kXres - x);
+                    const int h = std::min(kBucketSize, kYres - y);
+                    for (int a = 0; a < 2; ++a)
+                    {
+                        const char* aov = render->aovs[i][a];
+                        DataPixels dp(kXres, kYres, x, y, w, h, aov_spp(aov),
+                                      0, 0, aov, &pixels[0]);
+                        client.sendPixels(dp);
+                    }
+                }
+            }
+            client.closeImage();
+        }
+    }
+
+    // Check that the frame of a session only has its own AOVs and samples
+    int check_session(const char* name, CheckWriter& handler, const CheckRender& render)
+    {
+        const int s = find_session(handler.frames, render.session);
+        if (s < 0 || handler.frames[s].size() != 1)
+        {
+            fprintf(stderr, "%s: session %d has no frame of its own\n", name, render.session);
+            return 1;
+        }
+
+        RenderBuffer& rb = handler.frames[s][0];
+        const char* const* aovs = render.aovs[kIterations - 1];
+        if (rb.size() != 2 || !rb.isBufferExist(aovs[0]) || !rb.isBufferExist(aovs[1]))
+        {
+            fprintf(stderr, "%s: session %d doesn't have the AOVs it sent\n", name, render.session);
+            return 1;
+        }
+
+        std::vector<float> row(kXres);
+        for (int a = 0; a < 2; ++a)
+        {
+            const int b = rb.getBufferIndex(aovs[a]);
+            for (int c = 0; c < aov_spp(aovs[a]); ++c)
+            {
+                for (int y = 0; y < kYres; ++y)
+                {
+                    rb.readRow(b, y, c, 0, kXres, &row[0]);
+                    for (int x = 0; x < kXres; ++x)
+                    {
+                        if (row[x] != render.session)
+                        {
+                            fprintf(stderr, "%s: session %d has a sample of %g in %s\n",
+                                    name, render.session, row[x], aovs[a]);
+                            return 1;
+                        }
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+
+    int run(const char* name, const bool& multiframes)
+    {
+        CheckWriter handler(multiframes);
+        Server server;
+        server.connect(9330, true);
+        boost::thread thread(boost::bind(run_server, &server, &handler));
+
+        // Both renders at once
+        boost::thread_group renders;
+        for (int r = 0; r < kNumRenders; ++r)
+            renders.create_thread(boost::bind(render, server.getPort(), &kRenders[r]));
+        renders.join_all();
+
+        const int buckets = ((kXres + kBucketSize - 1) / kBucketSize) *
+                            ((kYres + kBucketSize - 1) / kBucketSize);
+        handler.wait(static_cast<long long>(kNumRenders) * kIterations * buckets * 2);
+
+        server.quit();
+        thread.join();
+
+        int failed = 0;
+        if (handler.frames.size() != kNumRenders)
+        {
+            fprintf(stderr, "%s: %d sessions instead of %d\n", name,
+                    static_cast<int>(handler.frames.size()), kNumRenders);
+            failed = 1;
+        }
+        for (int r = 0; r < kNumRenders && !failed; ++r)
+            failed = check_session(name, handler, kRenders[r]);
+
+        printf("%-36s %s\n", name, failed ? "failed" : "ok");
+        return failed;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int failed = 0;
+    failed += run("multi_client/single_frame", false);
+    failed += run("multi_client/multiframes", true);
+    return failed > 0 ? 1 : 0;
+}
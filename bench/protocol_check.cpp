@@ -0,0 +1,350 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Fails if the Server passes a malformed message on to its handler or
+// keeps the connection that sent it. Every message is written on a socket
+// of its own after opening an image, the Server must close it without
+// calling the handler, while a well formed message sent the same way must
+// reach the handler unless its image has been closed. The Server must
+// also refuse to open a shared memory segment that isn't a ring of a
+// Client, open the ring of a Client connected to an address of this
+// machine other than the loopback, and close the connection of a ring
+// holding a message larger than the ring or skipping past its last message.
+// A ring's consumer must be able to sleep while it holds messages it has
+// read, and only then.
+
+#include "aton_client.h"
+#include "aton_codec.h"
+#include "aton_server.h"
+#include "aton_shm.h"
+
+#include <cstdio>
+#include <cstring>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using boost::asio::ip::tcp;
+
+namespace
+{
+    // Fixed part of a pixels message, see Client::writePixels
+    struct CheckPixels
+    {
+        const char* name;
+        int xres, yres;
+        int bucket_size_x, bucket_size_y, spp;
+        int encoding;
+    };
+
+    const int kValid = 0;
+    const CheckPixels kPixels[] = {{"valid", 64, 64, 2, 2, 4, ENCODING_FLOAT32},
+                                   {"empty_bucket", 64, 64, 0, 2, 4, ENCODING_FLOAT32},
+                                   {"negative_bucket", 64, 64, 2, -2, 4, ENCODING_FLOAT32},
+                                   {"bucket_over_xres", 64, 64, 65, 2, 4, ENCODING_FLOAT32},
+                                   {"bucket_over_yres", 64, 64, 2, 65, 4, ENCODING_FLOAT32},
+                                   {"no_channels", 64, 64, 2, 2, 0, ENCODING_FLOAT32},
+                                   {"too_many_channels", 64, 64, 2, 2, 5, ENCODING_FLOAT32},
+                                   {"samples_overflow", 65536, 65536, 65536, 65536, 1,
+                                    ENCODING_FLOAT32 | ENCODING_COMPRESSED},
+                                   {"decoded_too_large", 8192, 8192, 8192, 8192, 4,
+                                    ENCODING_FLOAT32 | ENCODING_COMPRESSED}};
+    const int kNumPixels = 9;
+
+    // Counts the buckets let through
+    class CheckHandler: public ServerHandler
+    {
+    public:
+        CheckHandler(): received(0) {}
+
+        void onOpenImage(const int& client, DataHeader& header) {}
+
+        void onPixels(const int& client, DataPixels& dp)
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            received++;
+            mReceived.notify_all();
+        }
+
+        void onCloseImage(const int& client) {}
+
+        // Wait for the given number of buckets
+        void wait(const int& buckets)
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            while (received < buckets)
+                mReceived.wait(lock);
+        }
+
+        int received;
+
+    private:
+        boost::mutex mMutex;
+        boost::condition_variable mReceived;
+    };
+
+    void run_server(Server* server, CheckHandler* handler)
+    {
+        server->run(*handler);
+    }
+
+    template <typename T>
+    void append(std::vector<char>& message, const T& value)
+    {
+        const char* ptr = reinterpret_cast<const char*>(&value);
+        message.insert(message.end(), ptr, ptr + sizeof(T));
+    }
+
+    // Pack a pixels message the way Client::writePixels does, the samples
+    // of an uncompressed message are zeros and a compressed one gets a few
+    // bytes of garbage
+    std::vector<char> pack_pixels(const CheckPixels& p, const int& image_id)
+    {
+        const char aov[] = "RGBA";
+        const int aov_size = pad_4(sizeof(aov));
+        const bool compressed = (p.encoding & ENCODING_COMPRESSED) != 0;
+        const int pixels_size = compressed ? 64 : p.bucket_size_x * p.bucket_size_y * p.spp *
+                                                  static_cast<int>(sizeof(float));
+
+        std::vector<char> message;
+        append(message, 1);
+        append(message, pixels_header_size() + aov_size + std::max(pixels_size, 0));
+        append(message, image_id);
+        append(message, p.xres);
+        append(message, p.yres);
+        append(message, 0);
+        append(message, 0);
+        append(message, p.bucket_size_x);
+        append(message, p.bucket_size_y);
+        append(message, p.spp);
+        append(message, p.encoding);
+        append(message, 0LL);
+        append(message, 0U);
+        append(message, aov_size);
+        message.insert(message.end(), aov, aov + sizeof(aov));
+        message.resize(message.size() + aov_size - sizeof(aov) + std::max(pixels_size, 0), 0x5a);
+        return message;
+    }
+
+    // Check that the Server closes the connection after the message
+    bool is_closed(tcp::socket& socket)
+    {
+        char byte;
+        boost::system::error_code ec;
+        socket.read_some(boost::asio::buffer(&byte, 1), ec);
+        return ec == boost::asio::error::eof || ec == boost::asio::error::connection_reset;
+    }
+
+    // Open an image of the given size the way Client::openImage does,
+    // returns its id
+    int open_image(tcp::socket& socket, const int& xres, const int& yres)
+    {
+        std::vector<char> message;
+        append(message, 0);
+        append(message, 0);
+        append(message, xres);
+        append(message, yres);
+        append(message, static_cast<long long>(xres) * yres);
+        append(message, 0);
+        for (int i = 0; i < 2 + 16; ++i)
+            append(message, 0.0f);
+        for (int i = 0; i < 6; ++i)
+            append(message, 0);
+        boost::asio::write(socket, boost::asio::buffer(message));
+
+        int reply[2] = {-1, 0};
+        boost::asio::read(socket, boost::asio::buffer(reply, sizeof(reply)));
+        return reply[0];
+    }
+
+    int check_pixels(const int& port, CheckHandler& handler, const CheckPixels& p,
+                     const bool& valid, const bool& open = true, const char* name = NULL)
+    {
+        boost::asio::io_service ios;
+        tcp::socket socket(ios);
+        socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+        // The image is closed again before the message if it mustn't be open
+        const int image_id = open_image(socket, p.xres, p.yres);
+        if (!open)
+        {
+            const int key = 2;
+            boost::asio::write(socket, boost::asio::buffer(&key, sizeof(int)));
+            boost::asio::write(socket, boost::asio::buffer(&image_id, sizeof(int)));
+        }
+
+        const int received = handler.received;
+        const std::vector<char> message = pack_pixels(p, image_id);
+        boost::asio::write(socket, boost::asio::buffer(message));
+
+        int failed = 0;
+        if (valid)
+            handler.wait(received + 1);
+        else if (!is_closed(socket) || handler.received != received)
+            failed = 1;
+
+        printf("%-36s %s\n", name != NULL ? name : p.name, failed ? "failed" : "ok");
+        return failed;
+    }
+
+    // Ask the Server to open a shared memory segment, returns its status
+    int attach(tcp::socket& socket, const std::string& name)
+    {
+        std::vector<char> message;
+        append(message, 4);
+        append(message, static_cast<int>(name.size()));
+        message.insert(message.end(), name.begin(), name.end());
+        boost::asio::write(socket, boost::asio::buffer(message));
+
+        int status = -1;
+        boost::asio::read(socket, boost::asio::buffer(&status, sizeof(int)));
+        return status;
+    }
+
+    // Get a non loopback address of this machine, the one its route to a
+    // documentation address goes out from. Unspecified if there is none
+    boost::asio::ip::address own_address()
+    {
+        using boost::asio::ip::udp;
+        boost::asio::io_service ios;
+        udp::socket socket(ios);
+        boost::system::error_code ec;
+        socket.connect(udp::endpoint(boost::asio::ip::address_v4::from_string("198.51.100.1"), 9), ec);
+        const boost::asio::ip::address address = socket.local_endpoint(ec).address();
+        if (ec || address.is_loopback())
+            return boost::asio::ip::address();
+        return address;
+    }
+
+    // Write a message of the given size word in a ring and check that the
+    // Server closes the connection without reading it
+    int check_ring(const int& port, CheckHandler& handler, const std::string& name,
+                   const char* label, const int& size)
+    {
+        boost::asio::io_service ios;
+        tcp::socket socket(ios);
+        socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+        ShmRing* ring = ShmRing::create(name, 1048576);
+        const int received = handler.received;
+        int corrupted = attach(socket, ring->name()) != 1;
+        if (!corrupted)
+        {
+            char* ptr = ring->reserve(pixels_header_size());
+            memcpy(ptr - 8, &size, sizeof(int));
+            if (ring->commit())
+            {
+                const int key = 3;
+                boost::asio::write(socket, boost::asio::buffer(&key, sizeof(int)));
+            }
+            corrupted = !is_closed(socket) || handler.received != received;
+        }
+        delete ring;
+
+        printf("%-36s %s\n", label, corrupted ? "failed" : "ok");
+        return corrupted;
+    }
+
+    // Sleep with a message held, then with one not read yet
+    int check_ring_sleep(const std::string& name)
+    {
+        ShmRing* producer = ShmRing::create(name, 1048576);
+        ShmRing* consumer = ShmRing::open(name);
+
+        producer->reserve(16);
+        producer->commit();
+
+        int size = 0;
+        ShmLease lease;
+        int failed = consumer->peek(size, lease) == NULL;
+
+        // The held message isn't consumed but there's nothing left to read,
+        // and the next message wakes the consumer
+        failed += !consumer->sleep() || producer->empty();
+        producer->reserve(16);
+        failed += !producer->commit();
+
+        // Held and unread messages, the unread one keeps it awake
+        failed += consumer->sleep();
+
+        lease.release();
+        delete consumer;
+        delete producer;
+
+        printf("%-36s %s\n", "shm_sleep_while_held", failed ? "failed" : "ok");
+        return failed > 0;
+    }
+
+    int check_shm(const int& port, CheckHandler& handler)
+    {
+        const std::string pid = boost::lexical_cast<std::string>(getpid());
+        int failed = 0;
+
+        // Not a ring of a Client
+        {
+            boost::asio::io_service ios;
+            tcp::socket socket(ios);
+            socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+            ShmRing* other = ShmRing::create("check_" + pid, 1048576);
+            const int status = attach(socket, other->name());
+            delete other;
+
+            printf("%-36s %s\n", "shm_foreign_name", status != 0 ? "failed" : "ok");
+            failed += status != 0;
+        }
+
+        // A Client on this machine connected to its own address
+        const boost::asio::ip::address own = own_address();
+        if (own.is_unspecified())
+            printf("%-36s %s\n", "shm_own_address", "skipped, no address");
+        else
+        {
+            boost::asio::io_service ios;
+            tcp::socket socket(ios);
+            socket.connect(tcp::endpoint(own, port));
+
+            ShmRing* ring = ShmRing::create("aton_check_own_" + pid, 1048576);
+            const int status = attach(socket, ring->name());
+            delete ring;
+
+            printf("%-36s %s\n", "shm_own_address", status != 1 ? "failed" : "ok");
+            failed += status != 1;
+        }
+
+        failed += check_ring(port, handler, "aton_check_" + pid, "shm_oversized_message", 1 << 30);
+        failed += check_ring(port, handler, "aton_check_skip_" + pid, "shm_skip_past_write", -1);
+        failed += check_ring_sleep("aton_check_sleep_" + pid);
+        return failed;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    CheckHandler handler;
+    Server server;
+    server.connect(9340, true);
+    boost::thread thread(boost::bind(run_server, &server, &handler));
+
+    int failed = 0;
+    for (int i = 0; i < kNumPixels; ++i)
+        failed += check_pixels(server.getPort(), handler, kPixels[i], i == kValid);
+    failed += check_pixels(server.getPort(), handler, kPixels[kValid], false, false,
+                           "image_not_open");
+    failed += check_shm(server.getPort(), handler);
+
+    server.quit();
+    thread.join();
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,253 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_blit_pool.h"
+#include "aton_framebuffer.h"
+#include <algorithm>
+#include <boost/bind.hpp>
+
+namespace
+{
+    // Queued jobs looked at for one that can be copied, the ones behind
+    // wait for the first ones to be taken
+    const int kReadyScan = 32;
+}
+
+BlitPool::BlitPool(BlitHandler* handler,
+                   const int& threads,
+                   const size_t& memoryCap): mHandler(handler),
+                                             mMemoryCap(memoryCap),
+                                             mMemory(0),
+                                             mPending(0),
+                                             mStop(false),
+                                             mFree(NULL),
+                                             mFreeMemory(0),
+                                             mJobSamples(0),
+                                             mHead(NULL),
+                                             mTail(NULL)
+{
+    // Leave a core to the network thread
+    int count = threads;
+    if (count <= 0)
+        count = std::min(std::max(static_cast<int>(boost::thread::hardware_concurrency()) - 1, 1), 8);
+
+    for (int i = 0; i < count; ++i)
+        mWorkers.push_back(new Worker);
+
+    // Started once every worker exists
+    std::vector<Worker*>::iterator it;
+    for (it = mWorkers.begin(); it != mWorkers.end(); ++it)
+    {
+        boost::thread thread(boost::bind(&BlitPool::run, this, *it));
+        (*it)->thread.swap(thread);
+    }
+}
+
+BlitPool::~BlitPool()
+{
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mStop = true;
+    }
+
+    mReady.notify_all();
+
+    std::vector<Worker*>::iterator it;
+    for (it = mWorkers.begin(); it != mWorkers.end(); ++it)
+    {
+        (*it)->thread.join();
+        delete *it;
+    }
+
+    while (mFree != NULL)
+    {
+        BlitJob* job = mFree;
+        mFree = job->next;
+        delete job;
+    }
+}
+
+BlitJob* BlitPool::acquire()
+{
+    BlitJob* job = NULL;
+    size_t samples = 0;
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        samples = mJobSamples;
+        if (mFree != NULL)
+        {
+            job = mFree;
+            mFree = job->next;
+            mFreeMemory -= job->data.capacity() * sizeof(float);
+            job->next = NULL;
+        }
+    }
+
+    // Jobs of small buckets don't grow when they're reused for big ones
+    if (job == NULL)
+        job = new BlitJob;
+    job->data.reserve(samples);
+    job->pixels = NULL;
+    job->lease = ShmLease();
+    return job;
+}
+
+void BlitPool::push(BlitJob* job)
+{
+    // Recycled jobs may hold more than the samples of the bucket
+    const size_t size = job->data.capacity() * sizeof(float);
+
+    // Tiles of the bucket, its rows are flipped in the buffer
+    const int T = AOVBuffer::kTileSize;
+    const int height = job->target->getHeight();
+    job->tx0 = std::max(job->x, 0) / T;
+    job->tx1 = std::max(job->x + job->width - 1, 0) / T;
+    job->ty0 = std::max(height - job->y - job->height, 0) / T;
+    job->ty1 = std::max(height - job->y - 1, 0) / T;
+
+    boost::mutex::scoped_lock lock(mMutex);
+    mJobSamples = std::max(mJobSamples, static_cast<size_t>(job->width) * job->height * job->spp);
+
+    // A bucket bigger than the cap still goes through once the queues are empty
+    while (mMemory + size > mMemoryCap && mPending > 0)
+        mNotFull.wait(lock);
+
+    mMemory += size;
+    mPending++;
+    job->next = NULL;
+    if (mTail != NULL)
+        mTail->next = job;
+    else
+        mHead = job;
+    mTail = job;
+    lock.unlock();
+    mReady.notify_one();
+}
+
+BlitJob* BlitPool::takeReady()
+{
+    BlitJob* prev = NULL;
+    BlitJob* job = mHead;
+    for (int i = 0; job != NULL && i < kReadyScan; ++i, prev = job, job = job->next)
+    {
+        // Buckets being copied
+        bool blocked = false;
+        std::vector<Worker*>::const_iterator it;
+        for (it = mWorkers.begin(); it != mWorkers.end() && !blocked; ++it)
+            blocked = (*it)->job != NULL && job->overlaps(*(*it)->job);
+
+        // Buckets pushed before it
+        for (BlitJob* older = mHead; older != job && !blocked; older = older->next)
+            blocked = job->overlaps(*older);
+
+        if (blocked)
+            continue;
+
+        if (prev != NULL)
+            prev->next = job->next;
+        else
+            mHead = job->next;
+        if (mTail == job)
+            mTail = prev;
+        job->next = NULL;
+        return job;
+    }
+    return NULL;
+}
+
+void BlitPool::drain()
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    while (mPending > 0)
+        mNotFull.wait(lock);
+}
+
+void BlitPool::run(Worker* worker)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    while (true)
+    {
+        BlitJob* job = takeReady();
+        if (job == NULL)
+        {
+            if (mStop && mHead == NULL)
+                break;
+            mReady.wait(lock);
+            continue;
+        }
+
+        // Another worker may take the next one
+        worker->job = job;
+        if (mHead != NULL)
+            mReady.notify_one();
+        lock.unlock();
+
+        mHandler->onBlit(*job);
+        job->lease.release();
+
+        // Keep the job for the next bucket unless the kept ones already
+        // take the memory cap, which leaves room for every job the
+        // queues can hold plus the one waiting to be pushed
+        const size_t size = job->data.capacity() * sizeof(float);
+        bool recycled = false;
+        lock.lock();
+        worker->job = NULL;
+        mMemory -= size;
+        mPending--;
+        if (mFreeMemory <= mMemoryCap)
+        {
+            job->next = mFree;
+            mFree = job;
+            mFreeMemory += size;
+            recycled = true;
+        }
+
+        // The buckets waiting on its tiles can go
+        mNotFull.notify_all();
+        mReady.notify_all();
+        if (!recycled)
+        {
+            lock.unlock();
+            delete job;
+            lock.lock();
+        }
+    }
+}
+
+BlitLock::BlitLock(): mActive(0), mTurn(COPY)
+{
+    mWaiting[COPY] = mWaiting[READ] = 0;
+}
+
+void BlitLock::lock(const int& side)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    mWaiting[side]++;
+
+    // Join the side holding the lock unless the other one is waiting,
+    // or take it once it's free and not the other side's turn
+    while (mActive > 0 ? mTurn != side || mWaiting[1 - side] > 0
+                       : mTurn != side && mWaiting[1 - side] > 0)
+        mChanged.wait(lock);
+
+    mWaiting[side]--;
+    mTurn = side;
+    mActive++;
+}
+
+void BlitLock::unlock(const int& side)
+{
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        if (--mActive > 0)
+            return;
+
+        // Hand the turn over to the other side if it's waiting
+        if (mWaiting[1 - side] > 0)
+            mTurn = 1 - side;
+    }
+    mChanged.notify_all();
+}
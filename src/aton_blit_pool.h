@@ -0,0 +1,174 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_BLIT_POOL_H_
+#define ATON_BLIT_POOL_H_
+
+#include "aton_shm.h"
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+class RenderBuffer;
+
+// Bucket waiting to be copied into a RenderBuffer
+struct BlitJob
+{
+    BlitJob(): pixels(NULL), next(NULL) {}
+
+    RenderBuffer* target;
+    int b, x, y, width, height, spp;
+    std::vector<float> data;
+
+    // Samples lent by the Server instead of a copy in data, NULL if
+    // there are none, and their lease, released once the job is copied
+    const float* pixels;
+    ShmLease lease;
+
+    // Get the samples of the bucket
+    const float* samples() const { return pixels != NULL ? pixels : &data[0]; }
+
+    // Ask for a viewer update once the bucket is copied
+    bool update;
+
+    // Time the bucket was handed over by the Server
+    boost::posix_time::ptime queued;
+
+    // Tiles the bucket touches in the buffer, inclusive, set by push
+    int tx0, ty0, tx1, ty1;
+
+    // Next job of the queue or of the free list
+    BlitJob* next;
+
+    // Check if the bucket touches a tile of another one
+    bool overlaps(const BlitJob& other) const
+    {
+        return target == other.target && b == other.b &&
+               tx0 <= other.tx1 && other.tx0 <= tx1 &&
+               ty0 <= other.ty1 && other.ty0 <= ty1;
+    }
+};
+
+// Copies the buckets, called from the worker threads
+class BlitHandler
+{
+public:
+    virtual ~BlitHandler() {}
+    virtual void onBlit(const BlitJob& job) = 0;
+};
+
+// Pool of threads copying buckets into the frame buffers
+// The network thread prepares the tiles of a bucket and pushes a copy of
+// its pixels, the workers do the actual copy. A worker takes the oldest
+// bucket that touches no tile of the buckets pushed before it and not
+// copied yet, so the buckets of a tile are written in the order they were
+// pushed, whatever their origin and size, and the other ones are copied
+// in parallel. Copied jobs are kept with their samples for the next buckets, up to
+// memoryCap bytes, and are all sized for the biggest bucket pushed so far,
+// so a steady stream of buckets allocates nothing once the queues have
+// been full.
+class BlitPool
+{
+public:
+    // threads is the number of workers, 0 picks one from the hardware.
+    // memoryCap is the number of bytes of pixel data allowed to wait
+    BlitPool(BlitHandler* handler,
+             const int& threads = 0,
+             const size_t& memoryCap = 268435456);
+
+    // Copies what is left in the queues and stops the workers
+    ~BlitPool();
+
+    // Get a job to fill and push, a recycled one if there is any, with
+    // room for the samples of the biggest bucket pushed so far and no
+    // lent samples
+    BlitJob* acquire();
+
+    // Queue a copy of the bucket, takes ownership of the job
+    void push(BlitJob* job);
+
+    // Block until every queued bucket has been copied
+    void drain();
+
+    int threads() const { return static_cast<int>(mWorkers.size()); }
+
+private:
+    struct Worker
+    {
+        Worker(): job(NULL) {}
+
+        // Job being copied
+        BlitJob* job;
+        boost::thread thread;
+    };
+
+    void run(Worker* worker);
+
+    // Take the oldest queued job that can be copied now, NULL if none can
+    BlitJob* takeReady();
+
+    BlitHandler* mHandler;
+    size_t mMemoryCap, mMemory;
+    int mPending;
+    bool mStop;
+
+    // Copied jobs and the bytes their samples take
+    BlitJob* mFree;
+    size_t mFreeMemory;
+
+    // Samples of the biggest bucket pushed
+    size_t mJobSamples;
+
+    // Jobs waiting to be copied in push order, linked through BlitJob::next
+    BlitJob* mHead;
+    BlitJob* mTail;
+
+    std::vector<Worker*> mWorkers;
+
+    boost::mutex mMutex;
+    boost::condition_variable mNotFull;
+    boost::condition_variable mReady;
+};
+
+// Keeps the blit workers and the readers of the frame buffers apart.
+// Any number of workers may copy buckets at once, they write different
+// pixels, and any number of readers may read at once, but never both.
+// When the other side is waiting the current one lets it go next, so a
+// busy viewer can't hold the workers off and the other way around.
+class BlitLock
+{
+public:
+    enum Side { COPY = 0, READ = 1 };
+
+    BlitLock();
+
+    void lock(const int& side);
+    void unlock(const int& side);
+
+    // Holds a side of the lock for a scope
+    class Guard
+    {
+    public:
+        Guard(BlitLock& lock, const int& side): mLock(lock), mSide(side) { mLock.lock(mSide); }
+        ~Guard() { mLock.unlock(mSide); }
+
+    private:
+        BlitLock& mLock;
+        int mSide;
+    };
+
+private:
+    // Threads holding the lock, the side that has it or has the next turn,
+    // and the threads waiting on each side
+    int mActive;
+    int mTurn;
+    int mWaiting[2];
+
+    boost::mutex mMutex;
+    boost::condition_variable mChanged;
+};
+
+#endif // ATON_BLIT_POOL_H_
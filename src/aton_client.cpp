@@ -5,8 +5,20 @@ All rights reserved. See COPYING.txt for more details.
 */
 
 #include "aton_client.h"
+#include "aton_codec.h"
+#include "aton_shm.h"
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/array.hpp>
 #include <boost/lexical_cast.hpp>
 
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
 using namespace boost::asio;
 
 const int get_port()
@@ -40,9 +52,46 @@ const bool host_exists(const char* host)
     return !ec;
 }
 
+const bool host_is_local(const char* host)
+{
+    // Names like localhost or the workstation's own are resolved first
+    io_service ios;
+    boost::system::error_code ec;
+    ip::tcp::resolver resolver(ios);
+    ip::tcp::resolver::query query(host, "");
+    ip::tcp::resolver::iterator it = resolver.resolve(query, ec), end;
+    for (; !ec && it != end; ++it)
+    {
+        ip::address address = it->endpoint().address();
+        if (address.is_v6() && address.to_v6().is_v4_mapped())
+            address = address.to_v6().to_v4();
+        
+        if (address.is_loopback())
+            return true;
+        
+        // Only the addresses of this machine can be bound
+        boost::system::error_code bind_ec;
+        ip::udp::socket socket(ios);
+        socket.open(address.is_v4() ? ip::udp::v4() : ip::udp::v6(), bind_ec);
+        if (!bind_ec)
+            socket.bind(ip::udp::endpoint(address, 0), bind_ec);
+        if (!bind_ec)
+            return true;
+    }
+    return false;
+}
+
 const unsigned int gen_unique_id()
 {
-    srand(static_cast<unsigned int>(time(NULL)));
+    // Seeded once with the process id too, the renders started in the
+    // same second would share their session otherwise
+    static bool seeded = false;
+    if (!seeded)
+    {
+        srand(static_cast<unsigned int>(time(NULL)) ^
+              (static_cast<unsigned int>(getpid()) << 16));
+        seeded = true;
+    }
     return rand() % 1000000 + 1;
 }
 
@@ -51,6 +100,16 @@ const int pack_4_int(int a, int b, int c, int d)
     return a * 1000000 + b * 10000 + c * 100 + d;
 }
 
+const int pixels_header_size()
+{
+    return sizeof(int) * 10 + sizeof(long long) + sizeof(unsigned int);
+}
+
+const int pad_4(const int& size)
+{
+    return (size + 3) & ~3;
+}
+
 // Data Class
 DataHeader::DataHeader(const int& index,
                        const int& xres,
@@ -68,11 +127,12 @@ DataHeader::DataHeader(const int& index,
                                             mCurrentFrame(currentFrame),
                                             mCamFov(cam_fov)
 {
+    // Keep our own copies so the header can outlive the caller's arrays
     if (cam_matrix != NULL)
-        mCamMatrix = const_cast<float*>(cam_matrix);
+        mCamMatrixStore.assign(cam_matrix, cam_matrix + 16);
     
     if (samples != NULL)
-        mSamples = const_cast<int*>(samples);
+        mSamplesStore.assign(samples, samples + 6);
 }
 
 DataHeader::~DataHeader() {}
@@ -95,35 +155,46 @@ DataPixels::DataPixels(const int& xres,
                                             mBucket_size_x(bucket_size_x),
                                             mBucket_size_y(bucket_size_y),
                                             mSpp(spp),
+                                            mEncoding(ENCODING_FLOAT32),
                                             mRam(ram),
                                             mTime(time),
-                                            mAovName(aovName)
-
-{
-    if (data != NULL)
-        mpData = const_cast<float*>(data);
-}
+                                            mAovName(aovName),
+                                            mpData(const_cast<float*>(data)) {}
 
 DataPixels::~DataPixels() {}
 
-void DataPixels::free()
+const bool aov_full_precision(const DataPixels& pixels)
 {
-    delete[] mAovName;
-    mAovName = NULL;
+    return pixels.isInteger() || aov_full_precision(pixels.aovName());
 }
 
 
 
+
 // Client Class
-Client::Client(std::string hostname, int port): mHost(hostname),
+Client::Client(std::string hostname, int port): mCompress(false),
+                                                mDeltaMemory(0),
+                                                mServerEncodings(encoding_mask(ENCODING_FLOAT32)),
+                                                mHost(hostname),
                                                 mPort(port),
                                                 mImageId(-1),
-                                                mSocket(mIoService) {}
+                                                mRingAttached(false),
+                                                mRing(NULL),
+                                                mSocket(mIoService)
+{
+    const char* def_shm = getenv("ATON_SHM");
+    mUseShm = host_is_local(hostname.c_str()) &&
+              (def_shm == NULL || strcmp(def_shm, "0") != 0);
+    
+    // Key and message size are sent along with the fixed part
+    mPixelsHeader.resize(sizeof(int) * 2 + pixels_header_size());
+}
 
 
 Client::~Client()
 {
     disconnect();
+    delete mRing;
 }
 
 void Client::connect(std::string hostname, int port)
@@ -134,6 +205,14 @@ void Client::connect(std::string hostname, int port)
     tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
     tcp::resolver::iterator end;
     boost::system::error_code error = boost::asio::error::host_not_found;
+    
+    // Let the Server read what's left in the ring on the old connection
+    waitRing();
+    mRingAttached = false;
+    
+    // The Server only knows the buckets of this connection
+    mDeltas.clear();
+    
     while (error && endpoint_iterator != end)
     {
         mSocket.close();
@@ -141,24 +220,117 @@ void Client::connect(std::string hostname, int port)
     }
     if (error)
         throw boost::system::system_error(error);
+    
+    // Buckets are sent as single messages, don't wait to coalesce them
+    mSocket.set_option(tcp::no_delay(true));
 }
 
 void Client::disconnect()
 {
+    waitRing();
+    mRingAttached = false;
     mSocket.close();
 }
 
+void Client::attachRing()
+{
+    try
+    {
+        if (mRing == NULL)
+        {
+            // Ring size in MB
+            const char* def_size = getenv("ATON_SHM_SIZE");
+            const size_t size = def_size == NULL ? 64 : atoi(def_size);
+            
+            // Unique per process and per Client
+            const std::string name = "aton_" + boost::lexical_cast<std::string>(getpid()) +
+                                     "_" + boost::lexical_cast<std::string>(reinterpret_cast<size_t>(this));
+            mRing = ShmRing::create(name, size * 1048576);
+        }
+        
+        // Ask the Server to open the ring
+        const int key = 4;
+        const std::string& name = mRing->name();
+        const int name_size = static_cast<int>(name.size());
+        std::vector<const_buffer> buffers;
+        buffers.push_back(buffer(&key, sizeof(int)));
+        buffers.push_back(buffer(&name_size, sizeof(int)));
+        buffers.push_back(buffer(name.c_str(), name_size));
+        write(mSocket, buffers);
+        
+        int status = 0;
+        read(mSocket, buffer(reinterpret_cast<char*>(&status), sizeof(int)));
+        mRingAttached = status == 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Aton: Shared memory disabled, " << e.what() << std::endl;
+        delete mRing;
+        mRing = NULL;
+        mRingAttached = false;
+    }
+    
+    // Don't try again if the Server can't see our ring
+    if (!mRingAttached)
+        mUseShm = false;
+}
+
+void Client::waitRing()
+{
+    if (mRing == NULL || !mRingAttached || !mSocket.is_open())
+        return;
+    
+    // Give up after 10 seconds, the Server may be gone
+    for (int i = 0; i < 10000 && !mRing->empty(); ++i)
+        boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+}
+
 void Client::openImage(DataHeader& header)
 {
+    // Keep the header to open the image again after reconnecting
+    mHeader = header;
+    
+    try
+    {
+        sendHeader();
+    }
+    catch (const boost::system::system_error&)
+    {
+        // The Server may have been restarted since the last image
+        reconnect();
+    }
+}
+
+void Client::reconnect()
+{
+    // Don't wait for a dead Server to read the ring
+    boost::system::error_code ec;
+    mSocket.close(ec);
+    mRingAttached = false;
+    sendHeader();
+}
+
+void Client::sendHeader()
+{
+    DataHeader& header = mHeader;
+    
     // Connect to port!
-    connect(mHost, mPort);
+    if (!mSocket.is_open())
+        connect(mHost, mPort);
+    
+    // Set up the shared memory transport
+    if (mUseShm && !mRingAttached)
+        attachRing();
 
     // Send image header message with image desc information
     int key = 0;
     write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
     
-    // Read our imageid
-    read(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    // Read our imageid and the encodings the Server can decode
+    int reply[2];
+    read(mSocket, buffer(reinterpret_cast<char*>(reply), sizeof(reply)));
+    mImageId = reply[0];
+    mServerEncodings = reply[1] | encoding_mask(ENCODING_FLOAT32);
     
     // Send our width & height
     write(mSocket, buffer(reinterpret_cast<char*>(&header.mIndex), sizeof(int)));
@@ -170,10 +342,12 @@ void Client::openImage(DataHeader& header)
     write(mSocket, buffer(reinterpret_cast<char*>(&header.mCamFov), sizeof(float)));
     
     const int camMatrixSize = 16;
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mCamMatrix[0]), sizeof(float)*camMatrixSize));
+    header.mCamMatrixStore.resize(camMatrixSize);
+    write(mSocket, buffer(reinterpret_cast<char*>(&header.mCamMatrixStore[0]), sizeof(float)*camMatrixSize));
     
     const int samplesSize = 6;
-    write(mSocket, buffer(reinterpret_cast<char*>(&header.mSamples[0]), sizeof(int)*samplesSize));
+    header.mSamplesStore.resize(samplesSize);
+    write(mSocket, buffer(reinterpret_cast<char*>(&header.mSamplesStore[0]), sizeof(int)*samplesSize));
 
 }
 
@@ -183,45 +357,184 @@ void Client::sendPixels(DataPixels& pixels)
     {
         throw std::runtime_error("Could not send data - image id is not valid!");
     }
-
-    // Send data for image_id
-    int key = 1;
     
-    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    try
+    {
+        writePixels(pixels);
+    }
+    catch (const boost::system::system_error&)
+    {
+        // Open the image on a new connection and send the bucket again,
+        // the Server has lost the buckets sent before
+        reconnect();
+        writePixels(pixels);
+    }
+}
 
-    // Get size of aov name
-    size_t aov_size = strlen(pixels.mAovName) + 1;
+void Client::writePixels(DataPixels& pixels)
+{
+    // Get size of aov name, including the null terminator
+    const int aov_size = static_cast<int>(strlen(pixels.mAovName)) + 1;
+    const int aov_padded = pad_4(aov_size);
 
     // Get size of overall samples
     const int num_samples = pixels.mBucket_size_x * pixels.mBucket_size_y * pixels.mSpp;
     
-    // Sending data to buffer
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mXres), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mYres), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mBucket_xo), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mBucket_yo), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mBucket_size_x), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mBucket_size_y), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mSpp), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mRam), sizeof(long long)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mTime), sizeof(int)));
-    write(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
-    write(mSocket, buffer(pixels.mAovName, aov_size));
-    write(mSocket, buffer(reinterpret_cast<char*>(&pixels.mpData[0]), sizeof(float)*num_samples));
+    // Encode the samples if the Server can decode them, the shared
+    // memory ring is fast enough for the floats as they are
+    int encoding = ENCODING_FLOAT32;
+    const char* payload = reinterpret_cast<const char*>(pixels.mpData);
+    if (!mRingAttached && pixels.mEncoding != ENCODING_FLOAT32 &&
+        (mServerEncodings & encoding_mask(pixels.mEncoding)))
+    {
+        encoding = encode_pixels(pixels.mEncoding, pixels.mpData, num_samples, mEncoded);
+        if (encoding != ENCODING_FLOAT32)
+            payload = &mEncoded[0];
+    }
+    int payload_size = encoded_size(encoding, num_samples);
+    int flags = 0;
+    
+    // Keeps the integer samples out of the half buffers, even when
+    // they're sent as floats
+    if (pixels.isInteger() && (mServerEncodings & ENCODING_INTEGER))
+        flags |= ENCODING_INTEGER;
+    
+    // Send the difference with the last pass of the bucket
+    if (!mRingAttached && mDeltaMemory > 0 && (mServerEncodings & ENCODING_DELTA))
+    {
+        std::vector<char>* last = mDeltas.find(pixels.mAovName,
+                                               pixels.mBucket_xo,
+                                               pixels.mBucket_yo,
+                                               encoding,
+                                               payload_size);
+        if (last != NULL)
+        {
+            mDelta.resize(payload_size);
+            xor_bytes(payload, &(*last)[0], payload_size, &mDelta[0]);
+            memcpy(&(*last)[0], payload, payload_size);
+            payload = &mDelta[0];
+            flags |= ENCODING_DELTA;
+        }
+        else if (mDeltas.store(pixels.mAovName,
+                               pixels.mBucket_xo,
+                               pixels.mBucket_yo,
+                               encoding,
+                               payload,
+                               payload_size,
+                               mDeltaMemory))
+            flags |= ENCODING_CACHE;
+    }
+    
+    if (!mRingAttached && (mCompress || (flags & ENCODING_DELTA)) &&
+        (mServerEncodings & ENCODING_COMPRESSED))
+    {
+        // Deltas are always worth trying, the counts are kept by the
+        // interned name to look them up without copying it
+        const char* aov = mNames.intern(pixels.mAovName, aov_size);
+        int& skip = mCompressSkip[aov != NULL ? aov : ""];
+        if (skip > 0 && !(flags & ENCODING_DELTA))
+            skip--;
+        else if (compress_pixels(encoding, payload, payload_size, mCompressed, mScratch))
+        {
+            flags |= ENCODING_COMPRESSED;
+            payload = &mCompressed[0];
+            payload_size = static_cast<int>(mCompressed.size());
+        }
+        else if (!(flags & ENCODING_DELTA))
+            skip = 16;
+    }
+    encoding |= flags;
+    
+    // Size of the message body following the key and the size itself
+    const int msg_size = pixels_header_size() + aov_padded + payload_size;
+    
+    if (mRingAttached)
+    {
+        // Write the message straight into the ring, waiting up to
+        // 10 seconds for the Server to make room
+        char* ptr = mRing->reserve(msg_size);
+        for (int i = 0; ptr == NULL && i < 100000; ++i)
+        {
+            boost::this_thread::sleep(boost::posix_time::microseconds(100));
+            ptr = mRing->reserve(msg_size);
+        }
+        if (ptr == NULL)
+        {
+            // The Server stopped reading the ring, it may be gone. Let
+            // sendPixels() reconnect, through the socket from now on
+            std::cerr << "Aton: Shared memory ring is full, falling back to the socket" << std::endl;
+            mUseShm = false;
+            mRingAttached = false;
+            throw boost::system::system_error(boost::asio::error::timed_out);
+        }
+        
+        ptr = packPixels(ptr, pixels, encoding, aov_padded);
+        memcpy(ptr, pixels.mAovName, aov_size);
+        memset(ptr + aov_size, 0, aov_padded - aov_size);
+        memcpy(ptr + aov_padded, payload, payload_size);
+        
+        // Wake the Server up if it's idle
+        if (mRing->commit())
+        {
+            const int key = 3;
+            write(mSocket, buffer(reinterpret_cast<const char*>(&key), sizeof(int)));
+        }
+        return;
+    }
+    
+    // Pack the fixed part of the message
+    const int key = 1;
+    char* ptr = &mPixelsHeader[0];
+    pack_field(ptr, key);
+    pack_field(ptr, msg_size);
+    packPixels(ptr, pixels, encoding, aov_padded);
+    
+    // Send header, aov name and pixels with one gather write
+    static const char padding[4] = {0, 0, 0, 0};
+    boost::array<const_buffer, 4> buffers = {{buffer(mPixelsHeader),
+                                              buffer(pixels.mAovName, aov_size),
+                                              buffer(padding, aov_padded - aov_size),
+                                              buffer(payload, payload_size)}};
+    write(mSocket, buffers);
 }
 
-void Client::closeImage()
+char* Client::packPixels(char* ptr,
+                         const DataPixels& pixels,
+                         const int& encoding,
+                         const int& aov_size)
 {
-    // Send image complete message for image_id
-    int key = 2;
-    write(mSocket, buffer(reinterpret_cast<char*>(&key), sizeof(int)));
-
-    // Tell the server which image we're closing
-    write(mSocket, buffer(reinterpret_cast<char*>(&mImageId), sizeof(int)));
+    pack_field(ptr, mImageId);
+    pack_field(ptr, pixels.mXres);
+    pack_field(ptr, pixels.mYres);
+    pack_field(ptr, pixels.mBucket_xo);
+    pack_field(ptr, pixels.mBucket_yo);
+    pack_field(ptr, pixels.mBucket_size_x);
+    pack_field(ptr, pixels.mBucket_size_y);
+    pack_field(ptr, pixels.mSpp);
+    pack_field(ptr, encoding);
+    pack_field(ptr, pixels.mRam);
+    pack_field(ptr, pixels.mTime);
+    pack_field(ptr, aov_size);
+    return ptr;
+}
 
-    // Disconnect from port!
-    disconnect();
+void Client::closeImage()
+{
+    // Send image complete message for image_id, telling the server
+    // which image we're closing
+    int msg[2] = {2, mImageId};
+    try
+    {
+        write(mSocket, buffer(reinterpret_cast<char*>(msg), sizeof(msg)));
+    }
+    catch (const boost::system::system_error&)
+    {
+        // The new connection reads what's left in the ring
+        reconnect();
+        msg[1] = mImageId;
+        write(mSocket, buffer(reinterpret_cast<char*>(msg), sizeof(msg)));
+    }
+    mImageId = -1;
 }
 
 void Client::quit()
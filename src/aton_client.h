@@ -7,7 +7,13 @@ All rights reserved. See COPYING.txt for more details.
 #ifndef ATON_CLIENT_H_
 #define ATON_CLIENT_H_
 
+#include "aton_codec.h"
+#include "aton_shm.h"
+
+#include <algorithm>
+#include <map>
 #include <vector>
+#include <cstring>
 #include <boost/asio.hpp>
 
 
@@ -18,10 +24,37 @@ const std::string get_host();
 
 const bool host_exists(const char* host);
 
+// Check if the host, a name or an address, resolves to this machine
+const bool host_is_local(const char* host);
+
 const unsigned int gen_unique_id();
 
 const int pack_4_int(int a, int b, int c, int d);
 
+// Copy a field into a message buffer and advance the write pointer
+template <typename T>
+inline void pack_field(char*& ptr, const T& value)
+{
+    memcpy(ptr, &value, sizeof(T));
+    ptr += sizeof(T);
+}
+
+// Copy a field out of a message buffer and advance the read pointer
+template <typename T>
+inline void unpack_field(const char*& ptr, T& value)
+{
+    memcpy(&value, ptr, sizeof(T));
+    ptr += sizeof(T);
+}
+
+// Size of the fixed part of a pixels message body, which is made of
+// image id, xres, yres, bucket xo, yo, size x, size y, spp, encoding,
+// ram, time and the aov name size
+const int pixels_header_size();
+
+// Aov names are padded to keep the pixel data float aligned
+const int pad_4(const int& size);
+
 class Client;
 
 class DataHeader
@@ -88,11 +121,10 @@ private:
     // Camera Field of View
     float mCamFov;
     
-    // Camera Matrix pointer, storage
-    float* mCamMatrix;
+    // Camera Matrix storage
     std::vector<float> mCamMatrixStore;
     
-    int* mSamples;
+    // Samples storage
     std::vector<int> mSamplesStore;
 
 };
@@ -145,17 +177,45 @@ public:
     // Taken time while rendering
     const unsigned int& time() const { return mTime; }
     
-    // Get Aov name
+    // Get Aov name, owned by the display driver on the client-side and
+    // by the Server's name table of the connection on the server-side
     const char* aovName() const { return mAovName; }
     
-    // Pointer to pixel data owned by the display driver (client-side)
+    // Wire encoding of the samples, see PixelEncoding. Set by the
+    // application on the client-side, the Client only uses it if the
+    // Server supports it. Samples are always decoded to float server-side,
+    // where it's the encoding they were sent with, plus ENCODING_INTEGER
+    // for the integer AOVs
+    const int& encoding() const { return mEncoding; }
+    void setEncoding(const int& encoding) { mEncoding = encoding; }
+    
+    // Check if the samples are the bits of integers, the integer
+    // encodings are only asked for them
+    const bool isInteger() const
+    {
+        return (mEncoding & ENCODING_INTEGER) != 0 ||
+               mEncoding == ENCODING_INT8 || mEncoding == ENCODING_INT16;
+    }
+    
+    // Pointer to pixel data, owned by the display driver on the client-side
+    // and by the Server's receive buffer on the server-side
     const float* data() const { return mpData; }
     
-    // Reference to pixel data owned by this object (server-side)
-    const float& pixel(int index = 0) { return mPixelStore[index]; }
+    // Check if the pixel data is read in place from the Client's shared
+    // memory ring (server-side), see ServerHandler::onPixels()
+    bool isShared() const { return mLease.valid(); }
+    
+    // Take the lease of the pixel data in the ring, to keep it past the
+    // call and release it once done with it (server-side)
+    ShmLease takeLease()
+    {
+        ShmLease lease = mLease;
+        mLease = ShmLease();
+        return lease;
+    }
     
-    // Deallocate Aov name
-    void free();
+    // Reference to the pixel data (server-side)
+    const float& pixel(int index = 0) { return mpData[index]; }
     
 private:
     // Resolution, X & Y
@@ -171,6 +231,9 @@ private:
     // Sample Per Pixel
     int mSpp;
     
+    // Wire encoding
+    int mEncoding;
+    
     // Memory
     long long mRam;
     
@@ -180,19 +243,23 @@ private:
     // AOV Name
     const char *mAovName;
     
-    // Our pixel data pointer (for driver-owned pixels)
+    // Our pixel data pointer
     float *mpData;
     
-    // Our persistent pixel storage (for Data-owned pixels)
-    std::vector<float> mPixelStore;
+    // Pixel data in shared memory, if any
+    ShmLease mLease;
 };
 
 
+// Check if the buckets of an AOV need full float precision, the integer
+// AOVs and the data ones, see aov_full_precision(const char*)
+const bool aov_full_precision(const DataPixels& pixels);
 
-// Used to send an image to a Server
-// The Client class is created each time an application wants to send
-// an image to the Server. Once it is instantiated the application should
-// call openImage(), send(), and closeImage() to send an image to the Server
+// Used to send images to a Server
+// The Client keeps one connection to the Server for as long as it lives,
+// so a render session can send any number of images, one per IPR
+// iteration, with openImage(), sendPixels() and closeImage(). If the
+// connection is lost the Client reconnects and opens the image again.
 class Client
 {
     friend class Server;
@@ -205,7 +272,7 @@ public:
     
     // Sends a message to the Server to open a new image
     // The header parameter is used to tell the Server the size of image
-    // buffer to allocate.
+    // buffer to allocate. Connects to the Server if needed.
     void openImage(DataHeader& header);
     
     // Sends a section of image data to the Server
@@ -213,23 +280,95 @@ public:
     // pixel blocks to the Server. The Data object passed must correctly
     // specify the block position and dimensions as well as provide a
     // pointer to pixel data.
+    // Every bucket goes out as one length-prefixed message with a single
+    // gather write: [key][size][image id][xres][yres][bucket xo][bucket yo]
+    // [bucket size x][bucket size y][spp][encoding][ram][time]
+    // [aov name size][aov name, padded to 4 bytes][encoded pixels]
     void sendPixels(DataPixels& data);
     
     // Sends a message to the Server that the Clients has finished
     // This tells the Server that a Client has finished sending pixel
-    // information for an image.
+    // information for an image. The connection stays open for the next one.
     void closeImage();
     
+    // Send buckets through a shared memory ring instead of the socket.
+    // Enabled by default when the host is this machine, unless the
+    // ATON_SHM environment variable is set to 0. Falls back to the socket
+    // if the Server can't open the ring or stops reading it
+    void useSharedMemory(const bool& use) { mUseShm = use; }
+    
+    // Compress the buckets sent through the socket if the Server supports
+    // it. Off by default, it costs more than it saves on loopback and fast
+    // links. AOVs that don't compress are only tried again every few
+    // buckets
+    void useCompression(const bool& use) { mCompress = use; }
+    
+    // Send progressive passes of a bucket as the difference with the last
+    // one if the Server supports it, the differences are compressed even
+    // without useCompression. Up to memory bytes of samples are kept on
+    // both sides, at most MAX_DELTA_MEMORY, 0 disables it
+    void useDelta(const size_t& memory) { mDeltaMemory = std::min(memory, MAX_DELTA_MEMORY); }
+    
+    // Image id the Server gave to the current image, -1 if none is open
+    const int& imageId() const { return mImageId; }
+    
 private:
     void connect(std::string host, int port);
     void disconnect();
     void quit();
     
+    // Send the open image message of the current header, connecting first
+    // if needed
+    void sendHeader();
+    
+    // Connect again after a failed write and reopen the current image
+    void reconnect();
+    
+    // Send a bucket through the ring or the socket
+    void writePixels(DataPixels& pixels);
+    
+    // Create the shared memory ring if needed and ask the Server to open it
+    void attachRing();
+    
+    // Wait until the Server has read every message of the ring
+    void waitRing();
+    
+    // Pack the fixed part of the pixels message body
+    char* packPixels(char* ptr,
+                     const DataPixels& pixels,
+                     const int& encoding,
+                     const int& aov_size);
+    
+    // Fixed part of the pixels message, reused for every bucket
+    std::vector<char> mPixelsHeader;
+    
+    // Encoded, delta and compressed pixels of the bucket being sent
+    std::vector<char> mEncoded, mDelta, mCompressed, mScratch;
+    
+    // Buckets to send before trying to compress an AOV again
+    bool mCompress;
+    std::map<const char*, int> mCompressSkip;
+    NameTable mNames;
+    
+    // Last samples sent for every bucket
+    size_t mDeltaMemory;
+    DeltaCache mDeltas;
+    
+    // Encodings the Server can decode, sent back on open image
+    int mServerEncodings;
+    
+    // Header of the current image, sent again after reconnecting
+    DataHeader mHeader;
+    
     // Store the port we should connect to
     std::string mHost;
     int mPort, mImageId;
     bool mIsConnected;
     
+    // Shared memory transport
+    bool mUseShm, mRingAttached;
+    ShmRing* mRing;
+    
     // TCP stuff
     boost::asio::io_service mIoService;
     boost::asio::ip::tcp::socket mSocket;
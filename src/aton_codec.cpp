@@ -0,0 +1,467 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_codec.h"
+#include "aton_half.h"
+#include <cstring>
+
+namespace
+{
+    const int pad_size(const int& size) { return (size + 3) & ~3; }
+
+    // The integer samples are the bits of the floats
+    inline unsigned int sample_bits(const float* data, const int& i)
+    {
+        unsigned int bits;
+        memcpy(&bits, data + i, sizeof(bits));
+        return bits;
+    }
+
+    template <typename T>
+    void narrow(const float* data, const int& num_samples,
+                const unsigned int& base, char* out)
+    {
+        memcpy(out, &base, sizeof(base));
+        T* dst = reinterpret_cast<T*>(out + sizeof(base));
+        for (int i = 0; i < num_samples; ++i)
+            dst[i] = static_cast<T>(sample_bits(data, i) - base);
+    }
+
+    template <typename T>
+    void widen(const char* data, const int& num_samples, float* out)
+    {
+        unsigned int base;
+        memcpy(&base, data, sizeof(base));
+        const T* src = reinterpret_cast<const T*>(data + sizeof(base));
+        for (int i = 0; i < num_samples; ++i)
+        {
+            const unsigned int bits = base + src[i];
+            memcpy(out + i, &bits, sizeof(bits));
+        }
+    }
+
+    // Bytes per sample of an encoding
+    const int sample_size(const int& encoding)
+    {
+        switch (encoding)
+        {
+            case ENCODING_FLOAT16:
+            case ENCODING_INT16: return 2;
+            case ENCODING_INT8: return 1;
+        }
+        return 4;
+    }
+
+    // Split the bytes of the samples in planes, the tail
+    // that doesn't make a whole sample is copied as it is
+    void shuffle(const unsigned char* in, const int& size,
+                 const int& stride, unsigned char* out)
+    {
+        const int count = size / stride;
+        for (int b = 0; b < stride; ++b)
+        {
+            unsigned char* dst = out + b * count;
+            for (int i = 0; i < count; ++i)
+                dst[i] = in[i * stride + b];
+        }
+        memcpy(out + count * stride, in + count * stride, size - count * stride);
+    }
+
+    void unshuffle(const unsigned char* in, const int& size,
+                   const int& stride, unsigned char* out)
+    {
+        const int count = size / stride;
+        for (int b = 0; b < stride; ++b)
+        {
+            const unsigned char* src = in + b * count;
+            for (int i = 0; i < count; ++i)
+                out[i * stride + b] = src[i];
+        }
+        memcpy(out + count * stride, in + count * stride, size - count * stride);
+    }
+
+    inline unsigned int read_32(const unsigned char* p)
+    {
+        unsigned int v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // Write a length in the extra bytes following a token
+    inline unsigned char* put_length(unsigned char* op, int length)
+    {
+        for (; length >= 255; length -= 255)
+            *op++ = 255;
+        *op++ = static_cast<unsigned char>(length);
+        return op;
+    }
+
+    inline bool get_length(const unsigned char*& ip, const unsigned char* end, int& length)
+    {
+        unsigned char b;
+        do
+        {
+            if (ip >= end)
+                return false;
+            b = *ip++;
+            length += b;
+        } while (b == 255);
+        return true;
+    }
+
+    const int kMinMatch = 4;
+    const int kHashBits = 12;
+
+    // Sequences of [token][literal length][literals][offset][match length],
+    // the token holds 4 bits of each length. The last sequence only has
+    // literals. Returns the packed size, or -1 if it's over capacity
+    int lz_compress(const unsigned char* in, const int& size,
+                    unsigned char* out, const int& capacity)
+    {
+        int table[1 << kHashBits];
+        memset(table, -1, sizeof(table));
+
+        unsigned char* op = out;
+        const unsigned char* op_end = out + capacity;
+        int ip = 0, anchor = 0, misses = 0;
+
+        while (ip + kMinMatch <= size)
+        {
+            const unsigned int seq = read_32(in + ip);
+            const unsigned int h = (seq * 2654435761u) >> (32 - kHashBits);
+            const int ref = table[h];
+            table[h] = ip;
+
+            if (ref < 0 || ip - ref > 65535 || read_32(in + ref) != seq)
+            {
+                // Skip faster through data that doesn't match
+                ip += 1 + (misses++ >> 5);
+                continue;
+            }
+            misses = 0;
+
+            int length = kMinMatch;
+            while (ip + length < size && in[ref + length] == in[ip + length])
+                ++length;
+
+            // Worst case size of the sequence
+            const int literals = ip - anchor;
+            if (op + 1 + literals / 255 + 1 + literals + 2 + length / 255 + 1 > op_end)
+                return -1;
+
+            const int match = length - kMinMatch;
+            unsigned char* token = op++;
+            *token = static_cast<unsigned char>(((literals < 15 ? literals : 15) << 4) |
+                                                (match < 15 ? match : 15));
+            if (literals >= 15)
+                op = put_length(op, literals - 15);
+            memcpy(op, in + anchor, literals);
+            op += literals;
+
+            const int offset = ip - ref;
+            *op++ = static_cast<unsigned char>(offset & 0xff);
+            *op++ = static_cast<unsigned char>(offset >> 8);
+            if (match >= 15)
+                op = put_length(op, match - 15);
+
+            ip += length;
+            anchor = ip;
+        }
+
+        // Last literals
+        const int literals = size - anchor;
+        if (op + 1 + literals / 255 + 1 + literals > op_end)
+            return -1;
+        *op++ = static_cast<unsigned char>((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15)
+            op = put_length(op, literals - 15);
+        memcpy(op, in + anchor, literals);
+        op += literals;
+
+        return static_cast<int>(op - out);
+    }
+
+    bool lz_decompress(const unsigned char* in, const int& packed_size,
+                       unsigned char* out, const int& size)
+    {
+        const unsigned char* ip = in;
+        const unsigned char* end = in + packed_size;
+        unsigned char* op = out;
+        unsigned char* op_end = out + size;
+
+        while (ip < end)
+        {
+            const unsigned char token = *ip++;
+
+            int literals = token >> 4;
+            if (literals == 15 && !get_length(ip, end, literals))
+                return false;
+            if (literals > end - ip || literals > op_end - op)
+                return false;
+            memcpy(op, ip, literals);
+            ip += literals;
+            op += literals;
+
+            // Last sequence, it may be followed by padding
+            if (op == op_end)
+                return end - ip < 4;
+
+            if (end - ip < 2)
+                return false;
+            const int offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+
+            int length = token & 15;
+            if (length == 15 && !get_length(ip, end, length))
+                return false;
+            length += kMinMatch;
+
+            if (offset == 0 || offset > op - out || length > op_end - op)
+                return false;
+
+            // Matches may overlap what they write
+            const unsigned char* ref = op - offset;
+            if (offset >= length)
+                memcpy(op, ref, length);
+            else
+                for (int i = 0; i < length; ++i)
+                    op[i] = ref[i];
+            op += length;
+        }
+        return op == op_end;
+    }
+}
+
+const int all_encodings()
+{
+    return ((1 << ENCODING_COUNT) - 1) | ENCODING_COMPRESSED | ENCODING_DELTA |
+           ENCODING_INTEGER;
+}
+
+// Data AOVs are matched by name, Cryptomatte ones by prefix
+const bool aov_full_precision(const char* aovName)
+{
+    static const char* names[] = {"Z", "depth", "P", "Pref", "N", "ID", "motionvector"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if (strcmp(aovName, names[i]) == 0)
+            return true;
+    }
+    return strncmp(aovName, "crypto", 6) == 0;
+}
+
+const int encoded_size(const int& encoding, const int& num_samples)
+{
+    switch (encoding)
+    {
+        case ENCODING_FLOAT32: return static_cast<int>(sizeof(float)) * num_samples;
+        case ENCODING_FLOAT16: return pad_size(static_cast<int>(sizeof(half_t)) * num_samples);
+        case ENCODING_INT8: return pad_size(static_cast<int>(sizeof(unsigned int)) + num_samples);
+        case ENCODING_INT16: return pad_size(static_cast<int>(sizeof(unsigned int) + sizeof(unsigned short) * num_samples));
+    }
+    return -1;
+}
+
+const int encode_pixels(const int& encoding,
+                        const float* data,
+                        const int& num_samples,
+                        std::vector<char>& out)
+{
+    if (num_samples <= 0)
+        return ENCODING_FLOAT32;
+
+    int used = encoding;
+    unsigned int lo = 0xffffffff, hi = 0;
+    if (encoding == ENCODING_INT8 || encoding == ENCODING_INT16)
+    {
+        // Narrowest integer type fitting the range of the bucket
+        for (int i = 0; i < num_samples; ++i)
+        {
+            const unsigned int bits = sample_bits(data, i);
+            lo = bits < lo ? bits : lo;
+            hi = bits > hi ? bits : hi;
+        }
+        if (hi - lo > 0xffff)
+            return ENCODING_FLOAT32;
+        used = hi - lo > 0xff ? ENCODING_INT16 : ENCODING_INT8;
+    }
+    else if (encoding != ENCODING_FLOAT16)
+        return ENCODING_FLOAT32;
+
+    // Zero the padding, the samples are written over the rest
+    const int size = encoded_size(used, num_samples);
+    out.resize(size);
+    memset(&out[size - sizeof(int)], 0, sizeof(int));
+
+    if (used == ENCODING_FLOAT16)
+        floats_to_halves(data, reinterpret_cast<half_t*>(&out[0]), num_samples);
+    else if (used == ENCODING_INT8)
+        narrow<unsigned char>(data, num_samples, lo, &out[0]);
+    else
+        narrow<unsigned short>(data, num_samples, lo, &out[0]);
+    return used;
+}
+
+void decode_pixels(const int& encoding,
+                   const char* data,
+                   const int& num_samples,
+                   float* out)
+{
+    switch (encoding)
+    {
+        case ENCODING_FLOAT32:
+            memcpy(out, data, sizeof(float) * num_samples);
+            break;
+        case ENCODING_FLOAT16:
+            halves_to_floats(reinterpret_cast<const half_t*>(data), out, num_samples);
+            break;
+        case ENCODING_INT8:
+            widen<unsigned char>(data, num_samples, out);
+            break;
+        case ENCODING_INT16:
+            widen<unsigned short>(data, num_samples, out);
+            break;
+    }
+}
+
+const bool compress_pixels(const int& encoding,
+                           const char* data,
+                           const int& size,
+                           std::vector<char>& out,
+                           std::vector<char>& scratch)
+{
+    // Has to save at least 1/8 to be worth decompressing
+    const int capacity = size - size / 8;
+    if (capacity <= 0)
+        return false;
+
+    if (scratch.size() < static_cast<size_t>(size))
+        scratch.resize(size);
+    shuffle(reinterpret_cast<const unsigned char*>(data), size,
+            sample_size(encoding), reinterpret_cast<unsigned char*>(&scratch[0]));
+
+    out.resize(sizeof(int) + capacity + sizeof(int));
+    const int packed = lz_compress(reinterpret_cast<const unsigned char*>(&scratch[0]), size,
+                                   reinterpret_cast<unsigned char*>(&out[sizeof(int)]), capacity);
+    if (packed < 0)
+        return false;
+
+    memcpy(&out[0], &size, sizeof(int));
+    const int total = pad_size(static_cast<int>(sizeof(int)) + packed);
+    memset(&out[sizeof(int) + packed], 0, total - sizeof(int) - packed);
+    out.resize(total);
+    return true;
+}
+
+const bool decompress_pixels(const int& encoding,
+                             const char* data,
+                             const int& packed_size,
+                             const int& size,
+                             char* out,
+                             std::vector<char>& scratch)
+{
+    int stored;
+    if (packed_size < static_cast<int>(sizeof(int)))
+        return false;
+    memcpy(&stored, data, sizeof(int));
+    if (stored != size)
+        return false;
+
+    if (scratch.size() < static_cast<size_t>(size) + 1)
+        scratch.resize(size + 1);
+
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data + sizeof(int));
+    if (!lz_decompress(in, packed_size - static_cast<int>(sizeof(int)),
+                       reinterpret_cast<unsigned char*>(&scratch[0]), size))
+        return false;
+
+    unshuffle(reinterpret_cast<const unsigned char*>(&scratch[0]), size,
+              sample_size(encoding), reinterpret_cast<unsigned char*>(out));
+    return true;
+}
+
+void xor_bytes(const char* a, const char* b, const int& size, char* out)
+{
+    // A word at a time, the compiler vectorizes it
+    int i = 0;
+    for (; i + 4 <= size; i += 4)
+    {
+        unsigned int x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        x ^= y;
+        memcpy(out + i, &x, sizeof(x));
+    }
+    for (; i < size; ++i)
+        out[i] = a[i] ^ b[i];
+}
+
+bool DeltaCache::Key::operator<(const Key& other) const
+{
+    if (x != other.x)
+        return x < other.x;
+    if (y != other.y)
+        return y < other.y;
+    return strcmp(aov, other.aov) < 0;
+}
+
+std::vector<char>* DeltaCache::find(const char* aov,
+                                    const int& x,
+                                    const int& y,
+                                    const int& encoding,
+                                    const int& size)
+{
+    Key key;
+    key.aov = aov;
+    key.x = x;
+    key.y = y;
+
+    std::map<Key, Entry>::iterator it = mEntries.find(key);
+    if (it == mEntries.end() || it->second.encoding != encoding ||
+        it->second.data.size() != static_cast<size_t>(size))
+        return NULL;
+    return &it->second.data;
+}
+
+bool DeltaCache::store(const char* aov,
+                       const int& x,
+                       const int& y,
+                       const int& encoding,
+                       const char* data,
+                       const int& size,
+                       const size_t& capacity)
+{
+    Key key;
+    key.aov = aov;
+    key.x = x;
+    key.y = y;
+
+    std::map<Key, Entry>::iterator it = mEntries.find(key);
+    const size_t old_size = it != mEntries.end() ? it->second.data.size() : 0;
+    if (mMemory - old_size + size > capacity)
+        return false;
+
+    // New bucket, its key keeps the name of the table
+    if (it == mEntries.end())
+    {
+        key.aov = mNames.intern(aov, strlen(aov));
+        if (key.aov == NULL)
+            return false;
+        it = mEntries.insert(std::make_pair(key, Entry())).first;
+    }
+
+    Entry& entry = it->second;
+    entry.encoding = encoding;
+    entry.data.assign(data, data + size);
+    mMemory = mMemory - old_size + size;
+    return true;
+}
+
+void DeltaCache::clear()
+{
+    mEntries.clear();
+    mMemory = 0;
+}
@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_CODEC_H_
+#define ATON_CODEC_H_
+
+#include "aton_names.h"
+
+#include <map>
+#include <vector>
+
+// Wire encodings of the bucket samples
+// The Server tells the Client which ones it can decode when an image is
+// opened, the Client falls back to ENCODING_FLOAT32 for the other ones.
+enum PixelEncoding
+{
+    // 32 bit floats as rendered, always supported
+    ENCODING_FLOAT32 = 0,
+
+    // Half floats
+    ENCODING_FLOAT16,
+
+    // Integer samples sent as 8 or 16 bit offsets from the smallest sample
+    // of the bucket, lossless. Asking for ENCODING_INT16 lets the Client
+    // pick the narrowest one, or ENCODING_FLOAT32 if the range is too wide
+    ENCODING_INT8,
+    ENCODING_INT16,
+
+    ENCODING_COUNT
+};
+
+// Set on the encoding of buckets compressed with compress_pixels(), and
+// in the mask of a Server that can decompress them
+const int ENCODING_COMPRESSED = 0x10000;
+
+// Set on buckets sent as the XOR of their encoded samples with the ones
+// last sent for the same bucket, see DeltaCache, and in the mask of a
+// Server that can apply them. The samples are then kept for the next delta
+const int ENCODING_DELTA = 0x20000;
+
+// Set on buckets the Server should keep for the next delta
+const int ENCODING_CACHE = 0x40000;
+
+// Most bytes of samples kept for the deltas of a connection, a Client
+// asking the Server to keep more is disconnected
+const size_t MAX_DELTA_MEMORY = 1024 * 1048576;
+
+// Set on the buckets of integer AOVs whatever encoding they are sent
+// with, and in the mask of a Server that tells them apart. Their samples
+// are the bits of the integers, small ones are denormal floats and must
+// never be stored in half
+const int ENCODING_INTEGER = 0x80000;
+
+const int ENCODING_FLAGS = ENCODING_COMPRESSED | ENCODING_DELTA | ENCODING_CACHE |
+                           ENCODING_INTEGER;
+
+// Mask of the encodings a Server can decode
+inline int encoding_mask(const int& encoding) { return 1 << encoding; }
+const int all_encodings();
+
+// Check if an AOV needs full float precision, positions, normals,
+// depth, motion vectors and IDs. The other ones are fine in half for viewing
+const bool aov_full_precision(const char* aovName);
+
+// Size in bytes of num_samples samples in the given encoding, padded to
+// 4 bytes, -1 if the encoding is unknown
+const int encoded_size(const int& encoding, const int& num_samples);
+
+// Encode the samples into out, integer encodings take the float's bits
+// as unsigned integers. Returns the encoding used, out is left untouched
+// when it's ENCODING_FLOAT32 and the samples can be sent as they are
+const int encode_pixels(const int& encoding,
+                        const float* data,
+                        const int& num_samples,
+                        std::vector<char>& out);
+
+// Decode encoded_size() bytes of data into num_samples floats
+void decode_pixels(const int& encoding,
+                   const char* data,
+                   const int& num_samples,
+                   float* out);
+
+// Compress encoded samples. Their bytes are first split in planes, the
+// exponents of neighbour floats are alike and compress much better than
+// the interleaved samples, then packed with a LZ77 coder in the spirit of
+// LZ4. Writes [size][packed bytes] padded to 4 bytes into out, returns
+// false if that isn't at least 1/8 smaller than the input
+const bool compress_pixels(const int& encoding,
+                           const char* data,
+                           const int& size,
+                           std::vector<char>& out,
+                           std::vector<char>& scratch);
+
+// Decompress a payload of compress_pixels() holding size bytes,
+// returns false if it's corrupted
+const bool decompress_pixels(const int& encoding,
+                             const char* data,
+                             const int& packed_size,
+                             const int& size,
+                             char* out,
+                             std::vector<char>& scratch);
+
+// XOR size bytes of a and b into out
+void xor_bytes(const char* a, const char* b, const int& size, char* out);
+
+// Encoded samples last sent or received for every bucket of a connection
+// Progressive passes resend the same buckets with samples that barely
+// changed, their XOR with the last pass is mostly zeros and compresses
+// far better. The Client and the Server keep the same buckets, the Client
+// tells the Server which ones with ENCODING_CACHE.
+class DeltaCache
+{
+public:
+    DeltaCache(): mMemory(0) {}
+
+    // Get the samples of a bucket, NULL if there are none
+    // with the same encoding and size
+    std::vector<char>* find(const char* aov,
+                            const int& x,
+                            const int& y,
+                            const int& encoding,
+                            const int& size);
+
+    // Keep a copy of the samples of a bucket, replacing the ones it had.
+    // Returns false if that would take the cache over capacity bytes,
+    // or its AOV over the number of names kept
+    bool store(const char* aov,
+               const int& x,
+               const int& y,
+               const int& encoding,
+               const char* data,
+               const int& size,
+               const size_t& capacity);
+
+    void clear();
+
+    // Bytes of samples kept
+    const size_t& memory() const { return mMemory; }
+
+private:
+    // The AOV name of the kept buckets points into mNames,
+    // a name being looked up isn't copied
+    struct Key
+    {
+        const char* aov;
+        int x, y;
+        bool operator<(const Key& other) const;
+    };
+
+    struct Entry
+    {
+        int encoding;
+        std::vector<char> data;
+    };
+
+    std::map<Key, Entry> mEntries;
+    NameTable mNames;
+    size_t mMemory;
+};
+
+#endif // ATON_CODEC_H_
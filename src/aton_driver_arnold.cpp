@@ -6,6 +6,9 @@ All rights reserved. See COPYING.txt for more details.
 
 #include <ai.h>
 #include "aton_client.h"
+#include "aton_codec.h"
+#include "aton_half.h"
+#include "aton_send_queue.h"
 
 AI_DRIVER_NODE_EXPORT_METHODS(AtonDriverMtd);
 
@@ -20,18 +23,40 @@ inline const int calc_res(int res, int min, int max)
     return res;
 }
 
+static const char* queue_policies[] = {"block", "drop", "coalesce", NULL};
+
+// Wire encodings of the float AOVs, the integer ones are always
+// narrowed losslessly if the Server supports it
+enum WireEncoding { WIRE_FLOAT = 0, WIRE_HALF };
+static const char* wire_encodings[] = {"float", "half", NULL};
+
 struct ShaderData
 {
-    Client* client;
+    SendQueue* queue;
     int index, xres, yres, min_x, min_y, max_x, max_y;
+    bool half;
 };
 
+// Log the errors raised by the sender thread
+inline void report_errors(SendQueue* queue)
+{
+    std::string err;
+    if (queue != NULL && queue->takeError(err))
+        AiMsgError("ATON | %s", err.c_str());
+}
+
 node_parameters
 {
     AiParameterStr("host", get_host().c_str());
     AiParameterInt("port", get_port());
     AiParameterStr("intput", "");
     AiParameterStr("output", "");
+    AiParameterInt("queue_memory", 256);
+    AiParameterEnum("queue_policy", SEND_BLOCK, queue_policies);
+    AiParameterEnum("encoding", WIRE_HALF, wire_encodings);
+    AiParameterBool("compression", false);
+    AiParameterInt("delta_memory", 0);
+    AiParameterStr("stats_file", "");
     
 #ifdef ARNOLD_5
     AiMetaDataSetStr(nentry, NULL, "maya.translator", "aton");
@@ -50,8 +75,9 @@ node_parameters
 node_initialize
 {
     ShaderData* data = (ShaderData*)AiMalloc(sizeof(ShaderData));
-    data->client = NULL;
+    data->queue = NULL;
     data->index = gen_unique_id();
+    data->half = false;
 
 #ifdef ARNOLD_5
     AiDriverInitialize(node, true);
@@ -102,6 +128,12 @@ driver_open
     data->xres = calc_res(xres, data->min_x, data->max_x);
     data->yres = calc_res(yres, data->min_y, data->max_y);
     
+    // Send the beauty type AOVs as half floats
+    const bool half = AiNodeGetInt(node, "encoding") == WIRE_HALF;
+    if (half && !data->half)
+        AiMsgInfo("ATON | Half floats encoded %s", half_f16c() ? "with F16C" : "without F16C");
+    data->half = half;
+    
     // Get Region Area
     const long long region_area = data->xres * data->yres;
     
@@ -156,23 +188,35 @@ driver_open
                   cam_matrix,
                   samples);
 
-    try // Now we can connect to the server and start rendering
+    // The Client keeps its connection across IPR iterations, it's only
+    // created for the first one
+    if (data->queue == NULL)
     {
-        if (data->client == NULL)
+        // Get Host and Port
+        const char* host = AiNodeGetStr(node, "host");
+        const int port = AiNodeGetInt(node, "port");
+        
+        // Get the send queue memory cap and policy
+        const size_t queue_memory = static_cast<size_t>(AiNodeGetInt(node, "queue_memory")) * 1048576;
+        const int queue_policy = AiNodeGetInt(node, "queue_policy");
+        
+        if (host_exists(host))
         {
-            // Get Host and Port
-            const char* host = AiNodeGetStr(node, "host");
-            const int port = AiNodeGetInt(node, "port");
+            Client* client = new Client(host, port);
+            client->useCompression(AiNodeGetBool(node, "compression"));
             
-            if (host_exists(host))
-                data->client = new Client(host, port);
+            // Memory in MB for the last pass of every bucket, 0 disables deltas
+            client->useDelta(static_cast<size_t>(AiNodeGetInt(node, "delta_memory")) * 1048576);
+            data->queue = new SendQueue(client, queue_memory, queue_policy);
         }
-        data->client->openImage(dh);
+        else
+            AiMsgError("ATON | Invalid host: %s", host);
     }
-    catch(const std::exception &e)
+    
+    if (data->queue != NULL)
     {
-        const char* err = e.what();
-        AiMsgError("ATON | %s", err);
+        report_errors(data->queue);
+        data->queue->openImage(dh);
     }
 }
 
@@ -196,6 +240,9 @@ driver_write_bucket
     const void* bucket_data;
     const char* aov_name;
     
+    if (data->queue == NULL)
+        return;
+    
     if (data->min_x < 0)
         bucket_xo = bucket_xo - data->min_x;
     if (data->min_y < 0)
@@ -207,10 +254,14 @@ driver_write_bucket
         const long long memory = AiMsgUtilGetUsedMemory();
         const unsigned int time = AiMsgUtilGetElapsedTime();
         
+        int encoding = ENCODING_FLOAT32;
         switch (pixel_type)
         {
             case(AI_TYPE_INT):
             case(AI_TYPE_UINT):
+                encoding = ENCODING_INT16;
+                spp = 1;
+                break;
             case(AI_TYPE_FLOAT):
                 spp = 1;
                 break;
@@ -233,13 +284,30 @@ driver_write_bucket
                       time,
                       aov_name,
                       ptr);
+        
+        // Data AOVs keep their full precision
+        if (encoding == ENCODING_FLOAT32 && data->half && !aov_full_precision(aov_name))
+            encoding = ENCODING_FLOAT16;
+        dp.setEncoding(encoding);
 
-        // Send it to the server
-        data->client->sendPixels(dp);
+        // Queue a copy for the sender thread
+        data->queue->sendPixels(dp);
     }
 }
 
-driver_close {}
+driver_close
+{
+#ifdef ARNOLD_5
+    ShaderData* data = (ShaderData*)AiNodeGetLocalData(node);
+#else
+    ShaderData* data = (ShaderData*)AiDriverGetLocalData(node);
+#endif
+    
+    // End of the IPR iteration, the connection stays open for the next one
+    if (data->queue != NULL)
+        data->queue->closeImage();
+    report_errors(data->queue);
+}
 
 node_finish
 {
@@ -249,8 +317,30 @@ node_finish
 #else
     ShaderData* data = (ShaderData*)AiDriverGetLocalData(node);
 #endif
-    data->client->closeImage();
-    delete data->client;
+    if (data->queue != NULL)
+    {
+        // Send the remaining buckets before returning
+        data->queue->flush();
+        report_errors(data->queue);
+        
+        const long long dropped = data->queue->dropped();
+        const long long coalesced = data->queue->coalesced();
+        if (dropped > 0 || coalesced > 0)
+            AiMsgInfo("ATON | Send queue full: %lld buckets dropped, %lld coalesced",
+                      dropped, coalesced);
+        
+        // Latencies of the driver side of the pipeline
+        const PipelineStats& stats = data->queue->stats();
+        for (int s = STAGE_QUEUE; s <= STAGE_SEND; ++s)
+        {
+            if (stats.stage(s).count() > 0)
+                AiMsgInfo("ATON | Latency %s: %s", stage_name(s), stats.summary(s).c_str());
+        }
+        const char* stats_file = AiNodeGetStr(node, "stats_file");
+        if (stats_file[0] != '\0' && !stats.save(stats_file))
+            AiMsgWarning("ATON | Could not save the latencies to %s", stats_file);
+        delete data->queue;
+    }
     AiFree(data);
 
 #ifndef ARNOLD_5
@@ -10,34 +10,74 @@ All rights reserved. See COPYING.txt for more details.
 #include "aton_node.h"
 
 // Our RenderBuffer updater thread
+// Sleeps until the frame changes, a viewer update held back by the
+// update rate is due, or the node disconnects
 static void FBUpdater(unsigned index, unsigned nthreads, void* data)
 {
     Aton* node = reinterpret_cast<Aton*>(data);
-    double uiFrame, opFrame, prevFrame = 0;
-    const int ms = 20;
+    double prevFrame = 0;
 
-    while (node->m_legit)
+    while (true)
     {
-        uiFrame = node->uiContext().frame();
-        opFrame = node->outputContext().frame();
-        const size_t fbSize = node->m_framebuffers.size();
+        bool frameChanged;
+        {
+            boost::unique_lock<boost::mutex> lock(node->m_update_mutex);
+            while (!node->m_updater_stop && !node->m_frame_changed)
+            {
+                if (!node->m_update_pending)
+                    node->m_update_cond.wait(lock);
+                else if (!node->m_update_cond.timed_wait(lock, node->updateDeadline()))
+                    break;
+            }
+            if (node->m_updater_stop)
+                break;
+            frameChanged = node->m_frame_changed;
+            node->m_frame_changed = false;
+        }
 
-        if (node->m_multiframes && fbSize > 1 && uiFrame != prevFrame &&
-                                                 uiFrame != opFrame)
+        const double uiFrame = node->uiContext().frame();
+        size_t fbSize = 0;
+        {
+            ReadGuard lock(node->m_mutex);
+            const int s_index = node->findSession();
+            if (s_index >= 0)
+                fbSize = node->m_framebuffers[s_index].size();
+        }
+
+        if (frameChanged && node->m_multiframes && fbSize > 1 && uiFrame != prevFrame)
         {
-            const int f_index = node->getFrameIndex(node->m_frames, uiFrame);
-            RenderBuffer& fB = node->m_framebuffers[f_index];
             if (node->m_live_camera)
             {
-                node->setCameraKnobs(fB.getCameraFov(),
-                                     fB.getCameraMatrix());
+                // Copy the camera under the lock, the writer may drop frames
+                bool found = false;
+                float fov = 0;
+                std::vector<float> matrix;
+                {
+                    ReadGuard lock(node->m_mutex);
+                    const int s_index = node->findSession();
+                    if (s_index >= 0)
+                    {
+                        FrameBuffer& fBs = node->m_framebuffers[s_index];
+                        const int f_index = node->findFrameIndex(fBs, uiFrame);
+                        if (f_index < static_cast<int>(fBs.size()))
+                        {
+                            RenderBuffer& fB = fBs[f_index];
+                            fov = fB.getCameraFov();
+                            matrix = fB.getCameraMatrix();
+                            found = true;
+                        }
+                    }
+                }
+                if (found)
+                    node->setCameraKnobs(fov, matrix);
             }
 
             node->flagForUpdate();
             prevFrame = uiFrame;
         }
-        else
-            SleepMS(ms);
+
+        // Push the buckets held back by the update rate
+        node->flushUpdates();
     }
 }
 
@@ -8,272 +8,445 @@ All rights reserved. See COPYING.txt for more details.
 #define FBWriter_h
 
 #include "aton_node.h"
+#include "aton_blit_pool.h"
+#include "aton_codec.h"
 
-// Our RenderBuffer writer thread
-static void FBWriter(unsigned index, unsigned nthreads, void* data)
+// Copies the buckets queued by the FBWriterHandler into the RenderBuffers
+class FBBlitter: public BlitHandler
 {
-    bool killThread = false;
-    std::vector<std::string> active_aovs;
+public:
+    FBBlitter(Aton* node): m_node(node) {}
 
-    Aton* node = reinterpret_cast<Aton*> (data);
+    void onBlit(const BlitJob& job)
+    {
+        Aton* node = m_node;
+        {
+            // The tiles are made writable by the handler, the read lock
+            // keeps the frame buffers from being changed and the blit
+            // lock keeps the engine from reading while we write
+            ReadGuard lock(node->m_mutex);
+            BlitLock::Guard copying(node->m_blit_lock, BlitLock::COPY);
+            job.target->copyBucket(job.b, job.x, job.y, job.width, job.height,
+                                   job.spp, job.samples());
+        }
+        node->m_stats.stage(STAGE_BLIT).addSince(job.queued);
+
+        // The viewer picks the tiles written up
+        if (job.update)
+            node->queueUpdate();
+    }
+
+private:
+    Aton* m_node;
+};
+
+// Writes the images of every connected Client into the RenderBuffers
+class FBWriterHandler: public ServerHandler
+{
+public:
+    FBWriterHandler(Aton* node, BlitPool& pool): m_node(node), m_pool(pool) {}
 
-    while (!killThread)
+    void onOpenImage(const int& client, DataHeader& dh)
     {
-        // Accept incoming connections!
-        node->m_server.accept();
-        
-        // Session Index
-        int s_index = 0;
+        Aton* node = m_node;
 
-        // Our incoming data object
-        int dataType = 0;
+        // Frames may be added, dropped or reset from here on
+        m_pool.drain();
+        WriterClient& wc = m_clients[client];
 
-        // Frame index in RenderBuffers
-        int f_index = 0;
-        
-        // For progress percentage
-        long long progress, regionArea = 0;
-        
-        // Time to reset per every IPR iteration
-        static int _active_time, delta_time = 0;
-        
-        // Loop over incoming data
-        while (dataType != 2 || dataType != 9)
+        // Copy data from d
+        const int& _index = dh.index();
+        const int& _xres = dh.xres();
+        const int& _yres = dh.yres();
+        const long long& _area = dh.rArea();
+        const int& _version = dh.version();
+        const double& _frame = static_cast<double>(dh.currentFrame());
+        const float& _fov = dh.camFov();
+        const std::vector<float>& _matrix = dh.camMatrix();
+        const std::vector<int> _samples = dh.samples();
+
+        // Session state is kept across IPR iterations
+        WriterSession& ws = m_sessions[_index];
+        std::vector<std::string>& active_aovs = ws.active_aovs;
+        wc.s_index = _index;
+
+        // Get image area to calculate the progress
+        wc.regionArea = _area;
+
+        // Get delta time per IPR iteration
+        ws.delta_time = ws.active_time;
+
+        // Set current frame
+        node->m_current_frame = _frame;
+
+        {
+            WriteGuard lock(node->m_mutex);
+
+            // Adding new session, the viewer shows the
+            // latest one unless another one is picked
+            std::vector<FrameBuffer>& fbs = node->m_framebuffers;
+            if (find_session(fbs, _index) < 0)
+                fbs.push_back(FrameBuffer(_index));
+            node->m_latest_session = _index;
+
+            // Create RenderBuffer in the frames of the session
+            FrameBuffer& frames = *sessionFrames(_index);
+            wc.f_index = frames.open(_frame, _xres, _yres, node->m_multiframes);
+
+            // Keep the frames within the memory budget
+            frames[wc.f_index].setLastUsed(++node->m_frames_tick);
+            trimFrames();
+        }
+
+        // Get current RenderBuffer
+        RenderBuffer& fB = (*sessionFrames(_index))[wc.f_index];
+
+        // Reset Frame and Buffers if changed
+        if (!fB.empty() && !active_aovs.empty())
         {
-            // Listen for some data
-            try
+            if (fB.isFrameChanged(_frame))
             {
-                dataType = node->m_server.listenType();
+                WriteGuard lock(node->m_mutex);
+                fB.setFrame(_frame);
             }
-            catch( ... )
+            if(fB.isAovsChanged(active_aovs))
             {
-                break;
+                WriteGuard lock(node->m_mutex);
+                fB.resize(1);
+                fB.ready(false);
+                node->resetChannels(node->m_channels);
             }
+        }
+
+        // Setting Camera
+        if (fB.isCameraChanged(_fov, _matrix))
+        {
+            WriteGuard lock(node->m_mutex);
+            fB.setCamera(_fov, _matrix);
+            node->setCameraKnobs(fB.getCameraFov(),
+                                 fB.getCameraMatrix());
+        }
+
+        // Set Version
+        if (fB.getVersionInt() != _version)
+            fB.setVersion(_version);
+
+        // Set Samples
+        if (fB.getSamplesInt() != _samples)
+            fB.setSamples(_samples);
+
+        // Reset active AOVs
+        if(!active_aovs.empty()) active_aovs.clear();
+    }
+
+    void onPixels(const int& client, DataPixels& dp)
+    {
+        std::map<int, WriterClient>::iterator itC = m_clients.find(client);
+        if (itC == m_clients.end())
+            return;
+
+        Aton* node = m_node;
+        WriterClient& wc = itC->second;
+        WriterSession& ws = m_sessions[wc.s_index];
+        std::vector<std::string>& active_aovs = ws.active_aovs;
+
+        // Get frame buffer of the session
+        FrameBuffer* frames = sessionFrames(wc.s_index);
+        if (frames == NULL || wc.f_index >= static_cast<int>(frames->size()))
+            return;
+        RenderBuffer& fB = (*frames)[wc.f_index];
+        const char* _aov_name = dp.aovName();
+        const int& _xres = dp.xres();
+        const int& _yres = dp.yres();
+
+        if(fB.isResolutionChanged(_xres, _yres))
+        {
+            m_pool.drain();
+            WriteGuard lock(node->m_mutex);
+            fB.setResolution(_xres, _yres);
+        }
+
+        // Get active aov names
+        if(std::find(active_aovs.begin(),
+                     active_aovs.end(),
+                     _aov_name) == active_aovs.end())
+        {
+            if (node->m_enable_aovs || active_aovs.empty())
+                active_aovs.push_back(_aov_name);
+            else if (active_aovs.size() > 1)
+                active_aovs.resize(1);
+        }
+
+        // Skip non RGBA buckets if AOVs are disabled
+        if (node->m_enable_aovs || active_aovs[0] == _aov_name)
+        {
+            // Get data from d
+            const int& _x = dp.bucket_xo();
+            const int& _y = dp.bucket_yo();
+            const int& _width = dp.bucket_size_x();
+            const int& _height = dp.bucket_size_y();
+            const int& _spp = dp.spp();
+            const long long& _ram = dp.ram();
+            const int& _time = dp.time();
+
+            // Set active time
+            ws.active_time = _time;
+
+            // Get framebuffer width and height
+            const int& w = fB.getWidth();
+            const int& h = fB.getHeight();
+
+            // Adding buffer, the queued buckets are copied first
+            // as the AOV buffers may move
+            const bool added = !fB.isBufferExist(_aov_name) &&
+                               (node->m_enable_aovs || fB.empty());
+            if (added)
+                m_pool.drain();
+
+            node->m_mutex.writeLock();
+            if (added)
+                fB.addBuffer(_aov_name, _spp, node->m_half_aovs &&
+                             !aov_full_precision(dp));
+            else
+                fB.ready(true);
+
+            // Get buffer index
+            const int b = fB.getBufferIndex(_aov_name);
+
+            // Make the bucket's tiles writable
+            fB.prepareBucket(b, _x, _y, _width, _height, _spp);
+            node->m_mutex.unlock();
+
+            // Update only on first aov
+            const bool update = !node->m_capturing && fB.isFirstBufferName(_aov_name);
+
+            // Writing to buffer is left to the blit pool
+            BlitJob* job = m_pool.acquire();
+            job->target = &fB;
+            job->b = b;
+            job->x = _x;
+            job->y = _y;
+            job->width = _width;
+            job->height = _height;
+            job->spp = _spp;
             
-            // Handle the data we received
-            switch (dataType)
+            // Buckets in shared memory are blitted from there, their
+            // room goes back to the Client once they're copied
+            if (dp.isShared())
             {
-                case 0: // Open a new image
-                {
-                    DataHeader dh = node->m_server.listenHeader();
-                    
-                    // Copy data from d
-                    const int& _index = dh.index();
-                    const int& _xres = dh.xres();
-                    const int& _yres = dh.yres();
-                    const long long& _area = dh.rArea();
-                    const int& _version = dh.version();
-                    const double& _frame = static_cast<double>(dh.currentFrame());
-                    const float& _fov = dh.camFov();
-                    const Matrix4& _matrix = Matrix4(&dh.camMatrix()[0]);
-                    const std::vector<int> _samples = dh.samples();
-                    
-                    // Get image area to calculate the progress
-                    regionArea = _area;
-                    
-                    // Get delta time per IPR iteration
-                    delta_time = _active_time;
-                    
-                    // Set current frame
-                    node->m_current_frame = _frame;
-                    
-                    std::vector<double>& m_frs = node->m_frames;
-                    std::vector<RenderBuffer>& m_fbs = node->m_framebuffers;
-
-                    // Adding new session
-                    if (node->M_FRAMEBUFFERS.empty() || s_index != _index)
-                    {
-                        FrameBuffer fb(_frame, _xres, _yres);
-                        WriteGuard lock(node->m_mutex);
-                        node->M_FRAMEBUFFERS.push_back(fb);
-                        s_index = _index;
-                    }
-                    
-                    FrameBuffer& fb = node->M_FRAMEBUFFERS.back();
-                    
-                    // Create RenderBuffer
-                    if (node->m_multiframes)
-                    {
-                        // If the Frame not exists
-                        if (std::find(m_frs.begin(), m_frs.end(), _frame) == m_frs.end())
-                        {
-                            RenderBuffer fB(_frame, _xres, _yres);
-                            if (!m_frs.empty())
-                                fB = m_fbs.back();
-                            WriteGuard lock(node->m_mutex);
-                            m_frs.push_back(_frame);
-                            m_fbs.push_back(fB);
-                        }
-                    }
-                    else
-                    {
-                        RenderBuffer fB(_frame, _xres, _yres);
-                        if (!node->m_frames.empty())
-                        {
-                            f_index = node->getFrameIndex(node->m_frames, node->m_current_frame);
-                            fB = m_fbs[f_index];
-                        }
-                        WriteGuard lock(node->m_mutex);
-                        m_frs = std::vector<double>();
-                        m_fbs = std::vector<RenderBuffer>();
-                        m_frs.push_back(_frame);
-                        m_fbs.push_back(fB);
-                    }
-                    
-                    // Get current RenderBuffer
-                    f_index = node->getFrameIndex(node->m_frames, _frame);
-                    RenderBuffer& fB = m_fbs[f_index];
-                    
-                    // Reset Frame and Buffers if changed
-                    if (!fB.empty() && !active_aovs.empty())
-                    {
-                        if (fB.isFrameChanged(_frame))
-                        {
-                            WriteGuard lock(node->m_mutex);
-                            fB.setFrame(_frame);
-                        }
-                        if(fB.isAovsChanged(active_aovs))
-                        {
-                            WriteGuard lock(node->m_mutex);
-                            fB.resize(1);
-                            fB.ready(false);
-                            node->resetChannels(node->m_channels);
-                        }
-                    }
-                    
-                    // Setting Camera
-                    if (fB.isCameraChanged(_fov, _matrix))
-                    {
-                        WriteGuard lock(node->m_mutex);
-                        fB.setCamera(_fov, _matrix);
-                        node->setCameraKnobs(fB.getCameraFov(),
-                                             fB.getCameraMatrix());
-                    }
+                job->pixels = dp.data();
+                job->lease = dp.takeLease();
+            }
+            else
+                job->data.assign(dp.data(), dp.data() + _width * _height * _spp);
+            job->update = update;
+            job->queued = boost::posix_time::microsec_clock::universal_time();
+            m_pool.push(job);
 
-                    // Set Version
-                    if (fB.getVersionInt() != _version)
-                        fB.setVersion(_version);
-                    
-                    // Set Samples
-                    if (fB.getSamplesInt() != _samples)
-                        fB.setSamples(_samples);
-                    
-                    // Reset active AOVs
-                    if(!active_aovs.empty()) active_aovs.clear();
-                    break;
-                }
-                case 1: // Write image data
-                {
-                    DataPixels dp = node->m_server.listenPixels();
+            if (update)
+            {
+                // Calculate the progress percentage
+                wc.regionArea -= _width * _height;
+                const long long progress = 100 - (wc.regionArea * 100) / (w * h);
 
-                    // Get frame buffer
-                    RenderBuffer& fB = node->m_framebuffers[f_index];
-                    const char* _aov_name = dp.aovName();
-                    const int& _xres = dp.xres();
-                    const int& _yres = dp.yres();
+                // Set status parameters
+                node->m_mutex.writeLock();
+                fB.setProgress(progress);
+                fB.setRAM(_ram);
+                fB.setTime(_time, ws.delta_time);
+                node->m_mutex.unlock();
+            }
 
-                    if(fB.isResolutionChanged(_xres, _yres))
-                    {
-                        WriteGuard lock(node->m_mutex);
-                        fB.setResolution(_xres, _yres);
-                    }
+            // A new AOV may take the frames over the memory budget,
+            // fB can't be used after this as frames may be dropped
+            if (added)
+            {
+                m_pool.drain();
+                WriteGuard lock(node->m_mutex);
+                trimFrames();
+            }
+        }
+    }
 
-                    // Get active aov names
-                    if(std::find(active_aovs.begin(),
-                                 active_aovs.end(),
-                                 _aov_name) == active_aovs.end())
-                    {
-                        if (node->m_enable_aovs || active_aovs.empty())
-                            active_aovs.push_back(_aov_name);
-                        else if (active_aovs.size() > 1)
-                            active_aovs.resize(1);
-                    }
-                    
-                    // Skip non RGBA buckets if AOVs are disabled
-                    if (node->m_enable_aovs || active_aovs[0] == _aov_name)
+    void onCloseImage(const int& client)
+    {
+        // Show the last buckets right away, with the frames trimmed
+        // to the budget now that the tiles the image shared are copied
+        m_pool.drain();
+        {
+            WriteGuard lock(m_node->m_mutex);
+            trimFrames();
+        }
+        m_node->flushUpdates(true);
+
+        std::cout << "Close Image! (" << m_node->m_updates_suppressed
+                  << " viewer updates merged)" << std::endl;
+
+        // Compression of the image's buckets
+        const CodecStats& stats = m_node->m_server.codecStats(client);
+        if (stats.compressed > 0 || stats.deltas > 0)
+        {
+            std::cout << "Compression: " << stats.compressed << " of " << stats.buckets
+                      << " buckets, " << stats.deltas << " deltas, ratio "
+                      << static_cast<double>(stats.decoded) / stats.received
+                      << ":1, " << stats.seconds * 1000 << " ms decompressing" << std::endl;
+        }
+        
+        // The connection stays open for the next image, its frame
+        // can be trimmed until then
+        m_clients.erase(client);
+    }
+
+    // The buckets still waiting in the Client's shared memory are copied
+    // before it's closed
+    void onRelease(const int&)
+    {
+        m_pool.drain();
+    }
+
+    void onDisconnect(const int& client)
+    {
+        m_clients.erase(client);
+    }
+
+    // The memory budget has changed
+    void onWake()
+    {
+        m_pool.drain();
+        {
+            WriteGuard lock(m_node->m_mutex);
+            trimFrames();
+        }
+        m_node->flagForUpdate();
+    }
+
+private:
+    // Get the frames of a session, NULL if it has opened no image yet
+    FrameBuffer* sessionFrames(const int& s_index)
+    {
+        std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+        const int s = find_session(fbs, s_index);
+        return s >= 0 ? &fbs[s] : NULL;
+    }
+
+    // Update the memory usage and drop the least recently used frames of
+    // every session while it's over the budget, the frames being written
+    // are kept. Must be called with the write lock held
+    void trimFrames()
+    {
+        Aton* node = m_node;
+        std::vector<FrameBuffer>& fbs = node->m_framebuffers;
+        const long long budget = static_cast<long long>(node->m_memory_budget) * 1048576;
+
+        long long usage = 0, saved = 0;
+        std::vector<FrameBuffer>::iterator it;
+        for (it = fbs.begin(); it != fbs.end(); ++it)
+        {
+            for (int i = 0; i < static_cast<int>(it->size()); ++i)
+            {
+                usage += (*it)[i].memoryUsage();
+                saved += (*it)[i].memorySaved();
+            }
+        }
+
+        while (budget > 0 && usage > budget)
+        {
+            FrameBuffer* lru_frames = NULL;
+            int lru = -1;
+            for (it = fbs.begin(); it != fbs.end(); ++it)
+            {
+                for (int i = 0; i < static_cast<int>(it->size()); ++i)
+                {
+                    if (!isWritten(it->session(), i) &&
+                        (lru < 0 || (*it)[i].getLastUsed() < (*lru_frames)[lru].getLastUsed()))
                     {
-                        // Get data from d
-                        const int& _x = dp.bucket_xo();
-                        const int& _y = dp.bucket_yo();
-                        const int& _width = dp.bucket_size_x();
-                        const int& _height = dp.bucket_size_y();
-                        const int& _spp = dp.spp();
-                        const long long& _ram = dp.ram();
-                        const int& _time = dp.time();
-
-                        // Set active time
-                        _active_time = _time;
-                        
-                        // Get framebuffer width and height
-                        const int& w = fB.getWidth();
-                        const int& h = fB.getHeight();
-
-                        // Adding buffer
-                        node->m_mutex.writeLock();
-                        if(!fB.isBufferExist(_aov_name) && (node->m_enable_aovs || fB.empty()))
-                            fB.addBuffer(_aov_name, _spp);
-                        else
-                            fB.ready(true);
-                        
-                        // Get buffer index
-                        const int b = fB.getBufferIndex(_aov_name);
-                    
-                        // Writing to buffer
-                        int x, y, c, xpos, ypos, offset;
-                        for (x = 0; x < _width; ++x)
-                        {
-                            for (y = 0; y < _height; ++y)
-                            {
-                                offset = (_width * y * _spp) + (x * _spp);
-                                for (c = 0; c < _spp; ++c)
-                                {
-                                    xpos = x + _x;
-                                    ypos = h - (y + _y + 1);
-                                    const float& _pix = dp.pixel(offset + c);
-                                    fB.setBufferPix(b, xpos, ypos, _spp, c, _pix);
-                                }
-                            }
-                        }
-                        node->m_mutex.unlock();
-                        
-                        // Update only on first aov
-                        if(!node->m_capturing && fB.isFirstBufferName(_aov_name))
-                        {
-                            // Calculate the progress percentage
-                            regionArea -= _width * _height;
-                            progress = 100 - (regionArea * 100) / (w * h);
-
-                            // Set status parameters
-                            node->m_mutex.writeLock();
-                            fB.setProgress(progress);
-                            fB.setRAM(_ram);
-                            fB.setTime(_time, delta_time);
-                            node->m_mutex.unlock();
-                            
-                            // Update the image
-                            const Box box = Box(_x, h - _y - _width, _x + _height, h - _y);
-                            node->setCurrentFrame(node->m_current_frame);
-                            node->flagForUpdate(box);
-                        }
+                        lru_frames = &*it;
+                        lru = i;
                     }
-                    dp.free();
-                    break;
-                }
-                case 2: // Close image
-                {
-                    std::cout << "Close Image!" << std::endl;
-                    break;
-                }
-                case 9: // This is sent when the parent process want to kill
-                        // the listening thread
-                {
-                    std::cout << "Quit!" << std::endl;
-                    killThread = true;
-                    break;
                 }
             }
+            if (lru < 0)
+                break;
+
+            usage -= (*lru_frames)[lru].memoryUsage();
+            saved -= (*lru_frames)[lru].memorySaved();
+            lru_frames->erase(lru);
+
+            std::map<int, WriterClient>::iterator itC;
+            for (itC = m_clients.begin(); itC != m_clients.end(); ++itC)
+            {
+                if (itC->second.s_index == lru_frames->session() && itC->second.f_index > lru)
+                    itC->second.f_index--;
+            }
         }
+
+        node->m_memory_usage = usage;
+        node->m_memory_peak = std::max(node->m_memory_peak, usage);
+        node->m_memory_saved = saved;
     }
+
+    // Check if a Client is writing the frame of the given session and index
+    bool isWritten(const int& s_index, const int& f_index)
+    {
+        std::map<int, WriterClient>::iterator itC;
+        for (itC = m_clients.begin(); itC != m_clients.end(); ++itC)
+        {
+            if (itC->second.s_index == s_index && itC->second.f_index == f_index)
+                return true;
+        }
+        return false;
+    }
+
+    // Per connection state
+    struct WriterClient
+    {
+        WriterClient(): s_index(0), f_index(0), regionArea(0) {}
+
+        // Session Index
+        int s_index;
+
+        // Frame index in the FrameBuffer of the session
+        int f_index;
+
+        // For progress percentage
+        long long regionArea;
+    };
+
+    // Per render session state, kept across connections
+    struct WriterSession
+    {
+        WriterSession(): active_time(0), delta_time(0) {}
+
+        // Aovs received in the current iteration
+        std::vector<std::string> active_aovs;
+
+        // Time to reset per every IPR iteration
+        int active_time, delta_time;
+    };
+
+    Aton* m_node;
+    BlitPool& m_pool;
+    std::map<int, WriterClient> m_clients;
+    std::map<int, WriterSession> m_sessions;
+};
+
+// Our RenderBuffer writer thread
+static void FBWriter(unsigned index, unsigned nthreads, void* data)
+{
+    Aton* node = reinterpret_cast<Aton*> (data);
+
+    // Buckets are received here and copied by the pool's threads
+    FBBlitter blitter(node);
+    BlitPool pool(&blitter);
+
+    // Serve every connected Client until we are asked to quit
+    FBWriterHandler handler(node, pool);
+    node->m_server.run(handler);
+
+    // Copy the last buckets before the frame buffers can be cleared
+    pool.drain();
+
+    std::cout << "Quit!" << std::endl;
 }
 
 #endif /* FBWriter_h */
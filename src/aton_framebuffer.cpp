@@ -7,6 +7,12 @@ All rights reserved. See COPYING.txt for more details.
 #include "aton_framebuffer.h"
 #include "boost/format.hpp"
 #include <boost/lexical_cast.hpp>
+#include <boost/atomic.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
 
 using namespace std;
 using namespace boost;
@@ -25,6 +31,39 @@ const std::string chStr::RGBA = "RGBA",
                   chStr::_Y = ".Y",
                   chStr::_Z = ".Z";
 
+// Stamps are unique across every RenderBuffer
+static unsigned int next_aovs_stamp()
+{
+    static boost::atomic<unsigned int> stamp(0);
+    return ++stamp;
+}
+
+// Tiles generations are comparable across every RenderBuffer
+static boost::atomic<unsigned long long> s_tile_generation(0);
+
+unsigned long long tile_generation()
+{
+    return s_tile_generation.load();
+}
+
+// Look AOV names up in the index without copying them into a
+// std::string, hashed the same way as boost::hash<std::string>
+struct AovNameHash
+{
+    size_t operator()(const char* name) const
+    {
+        return boost::hash_range(name, name + strlen(name));
+    }
+};
+
+struct AovNameEqual
+{
+    bool operator()(const char* name, const std::string& aov) const
+    {
+        return aov == name;
+    }
+};
+
 // Unpack 1 int to 4
 const std::vector<int> unpack_4_int(const int& i)
 {
@@ -37,39 +76,116 @@ const std::vector<int> unpack_4_int(const int& i)
     return out;
 }
 
-// Lightweight color pixel class
-RenderColor::RenderColor() { _val[0] = _val[1] = _val[2] = 0.0f; }
-
-float& RenderColor::operator[](int i) { return _val[i]; }
-
-const float& RenderColor::operator[](int i) const { return _val[i]; }
-
-void RenderColor::reset() { _val[0] = _val[1] = _val[2] = 0.0f; }
-
-
-
 // AOVBuffer class
+const int AOVBuffer::kTileSize;
+
 AOVBuffer::AOVBuffer(const unsigned int& width,
                      const unsigned int& height,
-                     const int& spp)
+                     const int& spp,
+                     const bool& half): _half(half),
+                                        _tiles_x(0)
 {
-    const int size = width * height;
-    
     switch (spp)
     {
         case 1: // Float channels
-            _float_data.resize(size);
-            break;
         case 3: // Color Channels
-            _color_data.resize(size);
-            break;
         case 4: // Color + Alpha channels
-            _color_data.resize(size);
-            _float_data.resize(size);
+            _planes.resize(spp);
+            resize(width, height);
             break;
     }
 }
 
+// Planes are padded to whole tiles
+void AOVBuffer::resize(const unsigned int& width,
+                       const unsigned int& height)
+{
+    const unsigned int t = kTileSize;
+    _tiles_x = (width + t - 1) / t;
+    const size_t size = static_cast<size_t>(_tiles_x) * ((height + t - 1) / t);
+    
+    std::vector<std::vector<AOVTilePtr> >::iterator iP;
+    for(iP = _planes.begin(); iP != _planes.end(); ++iP)
+        iP->assign(size, AOVTilePtr());
+}
+
+// Float channels share their only plane across every channel index
+int AOVBuffer::planeIndex(const int& c) const
+{
+    const int p = _planes.size() == 1 ? 0 : c;
+    if (p < 0 || p >= static_cast<int>(_planes.size()) || _planes[p].empty())
+        return -1;
+    return p;
+}
+
+float* AOVBuffer::writableTile(const int& p, const size_t& t)
+{
+    AOVTilePtr& tile = _planes[p][t];
+    if (!tile)
+        tile.reset(new AOVTile(_half ? kTileSize * kTileSize / 2 : kTileSize * kTileSize));
+    else if (!tile.unique())
+        tile.reset(new AOVTile(*tile));
+    return &(*tile)[0];
+}
+
+size_t AOVBuffer::memoryUsage() const
+{
+    const size_t tileSize = (_half ? kTileSize * kTileSize / 2 : kTileSize * kTileSize) * sizeof(float);
+    size_t usage = 0;
+    std::vector<std::vector<AOVTilePtr> >::const_iterator iP;
+    for(iP = _planes.begin(); iP != _planes.end(); ++iP)
+    {
+        std::vector<AOVTilePtr>::const_iterator iT;
+        for(iT = iP->begin(); iT != iP->end(); ++iT)
+        {
+            if (*iT)
+                usage += tileSize / iT->use_count();
+        }
+    }
+    return usage;
+}
+
+
+// TileGenerations class
+TileGenerations::TileGenerations(const TileGenerations& other): _tiles(NULL), _size(0)
+{
+    *this = other;
+}
+
+TileGenerations& TileGenerations::operator=(const TileGenerations& other)
+{
+    if (this == &other)
+        return *this;
+    
+    if (_size != other._size)
+    {
+        delete[] _tiles;
+        _tiles = other._size > 0 ? new boost::atomic<unsigned long long>[other._size] : NULL;
+        _size = other._size;
+    }
+    for (size_t t = 0; t < _size; ++t)
+        _tiles[t].store(other[t], boost::memory_order_relaxed);
+    return *this;
+}
+
+void TileGenerations::reset(const size_t& size)
+{
+    if (_size != size)
+    {
+        delete[] _tiles;
+        _tiles = size > 0 ? new boost::atomic<unsigned long long>[size] : NULL;
+        _size = size;
+    }
+    const unsigned long long generation = ++s_tile_generation;
+    for (size_t t = 0; t < _size; ++t)
+        _tiles[t].store(generation, boost::memory_order_relaxed);
+}
+
+void TileGenerations::mark(const size_t& t)
+{
+    _tiles[t].store(++s_tile_generation, boost::memory_order_relaxed);
+}
+
 
 // RenderBuffer class
 RenderBuffer::RenderBuffer(const double& currentFrame,
@@ -81,15 +197,53 @@ RenderBuffer::RenderBuffer(const double& currentFrame,
                                           _time(0),
                                           _ram(0),
                                           _pram(0),
-                                          _ready(false) {}
+                                          _ready(false),
+                                          _fov(0),
+                                          _matrix(16, 0.0f),
+                                          _aovs_stamp(next_aovs_stamp()),
+                                          _last_used(0)
+{
+    resetTiles();
+}
 // Add new buffer
 void RenderBuffer::addBuffer(const char* aov,
-                            const int& spp)
+                            const int& spp,
+                            const bool& half)
 {
-    AOVBuffer buffer(_width, _height, spp);
+    AOVBuffer buffer(_width, _height, spp, half);
     
     _buffers.push_back(buffer);
     _aovs.push_back(aov);
+    _aovs_index.insert(std::make_pair(_aovs.back(), static_cast<int>(_aovs.size()) - 1));
+    _aovs_stamp = next_aovs_stamp();
+}
+
+// Map every AOV name to its first buffer
+void RenderBuffer::indexAovs()
+{
+    _aovs_index.clear();
+    for (size_t i = 0; i < _aovs.size(); ++i)
+        _aovs_index.insert(std::make_pair(_aovs[i], static_cast<int>(i)));
+    _aovs_stamp = next_aovs_stamp();
+}
+
+// Memory used by every AOV
+size_t RenderBuffer::memoryUsage() const
+{
+    size_t usage = 0;
+    std::vector<AOVBuffer>::const_iterator iRB;
+    for(iRB = _buffers.begin(); iRB != _buffers.end(); ++iRB)
+        usage += iRB->memoryUsage();
+    return usage;
+}
+
+size_t RenderBuffer::memorySaved() const
+{
+    size_t saved = 0;
+    std::vector<AOVBuffer>::const_iterator iRB;
+    for(iRB = _buffers.begin(); iRB != _buffers.end(); ++iRB)
+        saved += iRB->memorySaved();
+    return saved;
 }
 
 // Get writable buffer object
@@ -101,51 +255,303 @@ void RenderBuffer::setBufferPix(const int& b,
                                 const float& pix)
 {
     AOVBuffer& rb = _buffers[b];
-    const unsigned int index = (_width * y) + x;
-    if (c < 3 && spp != 1)
-        rb._color_data[index][c] = pix;
-    else
-        rb._float_data[index] = pix;
+    const int p = rb.planeIndex(c);
+    if (p >= 0)
+    {
+        const size_t t = rb.tileIndex(x, y);
+        float* tile = rb.writableTile(p, t);
+        if (rb.isHalf())
+            reinterpret_cast<half_t*>(tile)[AOVBuffer::tileOffset(x, y)] = float_to_half(pix);
+        else
+            tile[AOVBuffer::tileOffset(x, y)] = pix;
+        _tiles_generation.mark(t);
+    }
 }
 
-// Get read only buffer object
-const float& RenderBuffer::getBufferPix(const int& b,
-                                       const unsigned int& x,
-                                       const unsigned int& y,
-                                       const int& c) const
+// Write a whole bucket into the buffer
+void RenderBuffer::writeBucket(const int& b,
+                               const int& x,
+                               const int& y,
+                               const int& width,
+                               const int& height,
+                               const int& spp,
+                               const float* data)
 {
-    const AOVBuffer& rb = _buffers[b];
-    const unsigned int index = (_width * y) + x;
-    if (c < 3 && !rb._color_data.empty())
-        return rb._color_data[index][c];
-    else
-        return rb._float_data[index];
+    prepareBucket(b, x, y, width, height, spp);
+    copyBucket(b, x, y, width, height, spp, data);
 }
 
-// Get the current buffer index
-int RenderBuffer::getBufferIndex(const Channel& z)
+// Make the tiles of a bucket writable
+void RenderBuffer::prepareBucket(const int& b,
+                                 const int& x,
+                                 const int& y,
+                                 const int& width,
+                                 const int& height,
+                                 const int& spp)
 {
-    int b_index = 0;
-    if (_aovs.size() > 1)
+    AOVBuffer& rb = _buffers[b];
+    const int T = AOVBuffer::kTileSize;
+    
+    const int x0 = std::max(x, 0);
+    const int x1 = std::min(x + width, _width);
+    const int y0 = std::max(_height - (y + height), 0);
+    const int y1 = std::min(_height - y, _height);
+    if (x0 >= x1 || y0 >= y1 || spp <= 0)
+        return;
+    
+    const int planeCount = std::min(spp, 4);
+    
+    for (int ty = y0 / T; ty <= (y1 - 1) / T; ++ty)
     {
-        using namespace chStr;
-        const std::string& layer = getLayerName(z);
+        for (int tx = x0 / T; tx <= (x1 - 1) / T; ++tx)
+        {
+            const size_t t = rb.tileIndex(std::max(x0, tx * T), std::max(y0, ty * T));
+            
+            for (int c = 0; c < planeCount; ++c)
+            {
+                const int p = rb.planeIndex(c);
+                if (p >= 0)
+                    rb.writableTile(p, t);
+            }
+        }
+    }
+}
 
-        std::vector<std::string>::iterator it;
-        for(it = _aovs.begin(); it != _aovs.end(); ++it)
+// Copy a bucket into tiles made writable by prepareBucket
+void RenderBuffer::copyBucket(const int& b,
+                              const int& x,
+                              const int& y,
+                              const int& width,
+                              const int& height,
+                              const int& spp,
+                              const float* data)
+{
+    AOVBuffer& rb = _buffers[b];
+    const int T = AOVBuffer::kTileSize;
+    
+    // Clip the bucket against the buffer, rows are flipped
+    const int x0 = std::max(x, 0);
+    const int x1 = std::min(x + width, _width);
+    const int y0 = std::max(_height - (y + height), 0);
+    const int y1 = std::min(_height - y, _height);
+    if (x0 >= x1 || y0 >= y1 || spp <= 0)
+        return;
+    
+    // Samples the buffer has no plane for are skipped
+    int planes[4] = {-1, -1, -1, -1};
+    const int planeCount = std::min(spp, 4);
+    for (int c = 0; c < planeCount; ++c)
+        planes[c] = rb.planeIndex(c);
+    
+    for (int ty = y0 / T; ty <= (y1 - 1) / T; ++ty)
+    {
+        const int ys = std::max(y0, ty * T);
+        const int ye = std::min(y1, (ty + 1) * T);
+        
+        for (int tx = x0 / T; tx <= (x1 - 1) / T; ++tx)
         {
-            if (*it == layer)
+            const int xs = std::max(x0, tx * T);
+            const int count = std::min(x1, (tx + 1) * T) - xs;
+            const size_t t = rb.tileIndex(xs, ys);
+            
+            float* tiles[4] = {NULL, NULL, NULL, NULL};
+            for (int c = 0; c < planeCount; ++c)
             {
-                b_index = static_cast<int>(it - _aovs.begin());
-                break;
+                if (planes[c] >= 0)
+                    tiles[c] = rb.preparedTile(planes[c], t);
             }
-            else if (*it == Z && layer == depth)
+            
+            for (int ypos = ys; ypos < ye; ++ypos)
             {
-                b_index = static_cast<int>(it - _aovs.begin());
-                break;
+                const int row = _height - (y + ypos + 1);
+                const float* src = data + (static_cast<size_t>(width) * row + (xs - x)) * spp;
+                const size_t index = AOVBuffer::tileOffset(xs, ypos);
+                
+                if (rb.isHalf())
+                {
+                    // De-interleave a tile row at a time, then convert it
+                    float samples[AOVBuffer::kTileSize];
+                    for (int c = 0; c < planeCount; ++c)
+                    {
+                        if (tiles[c] == NULL)
+                            continue;
+                        half_t* dst = reinterpret_cast<half_t*>(tiles[c]) + index;
+                        if (spp == 1)
+                            floats_to_halves(src, dst, count);
+                        else
+                        {
+                            for (int i = 0; i < count; ++i)
+                                samples[i] = src[i * spp + c];
+                            floats_to_halves(samples, dst, count);
+                        }
+                    }
+                }
+                else if (spp == 1)
+                {
+                    if (tiles[0] != NULL)
+                        memcpy(tiles[0] + index, src, sizeof(float) * count);
+                }
+                else if (spp == 3 && tiles[0] && tiles[1] && tiles[2])
+                {
+                    float* r = tiles[0] + index;
+                    float* g = tiles[1] + index;
+                    float* bl = tiles[2] + index;
+                    for (int i = 0; i < count; ++i, src += 3)
+                    {
+                        r[i] = src[0];
+                        g[i] = src[1];
+                        bl[i] = src[2];
+                    }
+                }
+                else if (spp == 4 && tiles[0] && tiles[1] && tiles[2] && tiles[3])
+                {
+                    float* r = tiles[0] + index;
+                    float* g = tiles[1] + index;
+                    float* bl = tiles[2] + index;
+                    float* a = tiles[3] + index;
+                    for (int i = 0; i < count; ++i, src += 4)
+                    {
+                        r[i] = src[0];
+                        g[i] = src[1];
+                        bl[i] = src[2];
+                        a[i] = src[3];
+                    }
+                }
+                else
+                {
+                    for (int c = 0; c < planeCount; ++c)
+                    {
+                        if (tiles[c] == NULL)
+                            continue;
+                        float* dst = tiles[c] + index;
+                        for (int i = 0; i < count; ++i)
+                            dst[i] = src[i * spp + c];
+                    }
+                }
             }
+            
+            // The samples have landed
+            _tiles_generation.mark(t);
         }
+    }
+}
+
+// Get read only buffer object
+float RenderBuffer::getBufferPix(const int& b,
+                                 const unsigned int& x,
+                                 const unsigned int& y,
+                                 const int& c) const
+{
+    const AOVBuffer& rb = _buffers[b];
+    const int p = rb.planeIndex(c);
+    if (p < 0)
+        return 0.0f;
+    
+    const size_t t = rb.tileIndex(x, y);
+    if (rb.isHalf())
+    {
+        const half_t* tile = rb.halfTile(p, t);
+        return tile != NULL ? half_to_float(tile[AOVBuffer::tileOffset(x, y)]) : 0.0f;
+    }
+    const float* tile = rb.tile(p, t);
+    return tile != NULL ? tile[AOVBuffer::tileOffset(x, y)] : 0.0f;
+}
+
+// Copy a part of a buffer row
+void RenderBuffer::readRow(const int& b,
+                           const int& y,
+                           const int& c,
+                           const int& x,
+                           const int& r,
+                           float* out) const
+{
+    if (r <= x)
+        return;
+    
+    const AOVBuffer& rb = _buffers[b];
+    const int p = rb.planeIndex(c);
+    
+    // Valid part of the row
+    const int x0 = std::min(std::max(x, 0), r);
+    const int x1 = std::max(std::min(r, _width), x0);
+    
+    if (p < 0 || y < 0 || y >= _height || x0 == x1)
+    {
+        std::fill(out, out + (r - x), 0.0f);
+        return;
+    }
+    
+    std::fill(out, out + (x0 - x), 0.0f);
+    std::fill(out + (x1 - x), out + (r - x), 0.0f);
+    
+    int xpos = x0;
+    while (xpos < x1)
+    {
+        const int end = std::min(x1, (xpos / AOVBuffer::kTileSize + 1) * AOVBuffer::kTileSize);
+        const size_t t = rb.tileIndex(xpos, y);
+        const float* tile = rb.tile(p, t);
+        if (tile != NULL && rb.isHalf())
+            halves_to_floats(rb.halfTile(p, t) + AOVBuffer::tileOffset(xpos, y), out + (xpos - x), end - xpos);
+        else if (tile != NULL)
+            memcpy(out + (xpos - x), tile + AOVBuffer::tileOffset(xpos, y), sizeof(float) * (end - xpos));
+        else
+            std::fill(out + (xpos - x), out + (end - x), 0.0f);
+        xpos = end;
+    }
+}
 
+// Size the tiles generations to the resolution, all written now
+void RenderBuffer::resetTiles()
+{
+    const int T = AOVBuffer::kTileSize;
+    const size_t tiles = static_cast<size_t>((_width + T - 1) / T) * ((_height + T - 1) / T);
+    _tiles_generation.reset(tiles);
+}
+
+// Get the bounding box of the tiles written since a generation
+bool RenderBuffer::getDirtyBox(const unsigned long long& since, BufferBox& box) const
+{
+    const int T = AOVBuffer::kTileSize;
+    const int tilesX = (_width + T - 1) / T;
+    int x = INT_MAX, y = INT_MAX, r = INT_MIN, t = INT_MIN;
+    
+    for (size_t i = 0; i < _tiles_generation.size(); ++i)
+    {
+        if (_tiles_generation[i] <= since)
+            continue;
+        const int tx = static_cast<int>(i) % tilesX;
+        const int ty = static_cast<int>(i) / tilesX;
+        x = std::min(x, tx * T);
+        y = std::min(y, ty * T);
+        r = std::max(r, std::min((tx + 1) * T, _width));
+        t = std::max(t, std::min((ty + 1) * T, _height));
+    }
+    
+    if (x > r)
+        return false;
+    box = BufferBox(x, y, r, t);
+    return true;
+}
+
+// Get the buffer index of a layer
+int RenderBuffer::getLayerIndex(const std::string& layer)
+{
+    int b_index = 0;
+    if (_aovs.size() > 1)
+    {
+        using namespace chStr;
+
+        boost::unordered_map<std::string, int>::const_iterator it = _aovs_index.find(layer);
+        if (it != _aovs_index.end())
+            b_index = it->second;
+
+        // Z buffer is shown as the depth layer, the first one wins
+        if (layer == depth)
+        {
+            boost::unordered_map<std::string, int>::const_iterator itZ = _aovs_index.find(Z);
+            if (itZ != _aovs_index.end() && (it == _aovs_index.end() || itZ->second < it->second))
+                b_index = itZ->second;
+        }
     }
     return b_index;
 }
@@ -156,15 +562,10 @@ int RenderBuffer::getBufferIndex(const char* aovName)
     int b_index = 0;
     if (_aovs.size() > 1)
     {
-        std::vector<std::string>::iterator it;
-        for(it = _aovs.begin(); it != _aovs.end(); ++it)
-        {
-            if (*it == aovName)
-            {
-                b_index = static_cast<int>(it - _aovs.begin());
-                break;
-            }
-        }
+        boost::unordered_map<std::string, int>::const_iterator it =
+            _aovs_index.find(aovName, AovNameHash(), AovNameEqual());
+        if (it != _aovs_index.end())
+            b_index = it->second;
     }
     return b_index;
 }
@@ -213,7 +614,7 @@ bool RenderBuffer::isResolutionChanged(const unsigned int& w,
 }
 
 bool RenderBuffer::isCameraChanged(const float& fov,
-                                  const Matrix4& matrix)
+                                  const std::vector<float>& matrix)
 {
     return (_fov != fov || _matrix != matrix);
 }
@@ -225,23 +626,11 @@ void RenderBuffer::setResolution(const unsigned int& w,
     _width = w;
     _height = h;
     
-    const int bfSize = _width * _height;
-    
     std::vector<AOVBuffer>::iterator iRB;
     for(iRB = _buffers.begin(); iRB != _buffers.end(); ++iRB)
-    {
-        if (!iRB->_color_data.empty())
-        {
-            RenderColor color;
-            std::fill(iRB->_color_data.begin(), iRB->_color_data.end(), color);
-            iRB->_color_data.resize(bfSize);
-        }
-        if (!iRB->_float_data.empty())
-        {
-            std::fill(iRB->_float_data.begin(), iRB->_float_data.end(), 0.0f);
-            iRB->_float_data.resize(bfSize);
-        }
-    }
+        iRB->resize(_width, _height);
+    
+    resetTiles();
 }
 
 // Clear buffers and aovs
@@ -249,12 +638,14 @@ void RenderBuffer::clearAll()
 {
     _buffers = std::vector<AOVBuffer>();
     _aovs = std::vector<std::string>();
+    indexAovs();
+    resetTiles();
 }
 
 // Check if the given buffer/aov name name is exist
 bool RenderBuffer::isBufferExist(const char* aovName)
 {
-    return std::find(_aovs.begin(), _aovs.end(), aovName) != _aovs.end();
+    return _aovs_index.find(aovName, AovNameHash(), AovNameEqual()) != _aovs_index.end();
 }
 
 // Resize the buffers
@@ -262,6 +653,7 @@ void RenderBuffer::resize(const size_t& s)
 {
     _buffers.resize(s);
     _aovs.resize(s);
+    indexAovs();
 }
 
 // Set status parameters
@@ -306,83 +698,140 @@ void RenderBuffer::setSamples(std::vector<int> sp)
 }
 
 
-void RenderBuffer::setCamera(const float& fov, const Matrix4& matrix)
+void RenderBuffer::setCamera(const float& fov, const std::vector<float>& matrix)
 {
     _fov = fov;
     _matrix = matrix;
 }
 
 
-FrameBuffer::FrameBuffer(double frame, int xres, int yres)
+// Get the RenderBuffer of a new image
+int FrameBuffer::open(const double& frame,
+                      const int& xres,
+                      const int& yres,
+                      const bool& multiframes)
 {
-    RenderBuffer rb(frame, xres, yres);
+    if (multiframes)
+    {
+        // If the Frame not exists
+        if (!exists(frame))
+        {
+            RenderBuffer rb(frame, xres, yres);
+            if (!_renderbuffers.empty())
+                rb = _renderbuffers.back();
+            _frames.push_back(frame);
+            _renderbuffers.push_back(rb);
+        }
+        return _frames.find(frame);
+    }
     
+    // Keep showing what was rendered so far until it's overwritten
+    RenderBuffer rb(frame, xres, yres);
+    if (!_renderbuffers.empty())
+        rb = _renderbuffers[_frames.find(frame)];
+    clear_all();
     _frames.push_back(frame);
     _renderbuffers.push_back(rb);
+    return 0;
 }
 
-// Get RenderBuffer for given Frame
-const RenderBuffer& FrameBuffer::at(double frame)
+// Remove a frame
+void FrameBuffer::erase(const int& index)
 {
-    int index = 0;
+    if (index < 0 || index >= static_cast<int>(_renderbuffers.size()))
+        return;
     
-    if (_frames.size() > 1)
+    _renderbuffers.erase(_renderbuffers.begin() + index);
+    _frames.erase(index);
+}
+
+// Clear All Data
+void FrameBuffer::clear_all()
+{
+    _frames.clear();
+    _renderbuffers = std::vector<RenderBuffer>();
+}
+
+
+// Check if RenderBuffer already exists
+bool FrameBuffer::exists(double frame)
+{
+    return _frames.exists(frame);
+}
+
+int find_session(const std::vector<FrameBuffer>& fbs, const int& session)
+{
+    for (size_t i = 0; i < fbs.size(); ++i)
     {
-        int nearFIndex = INT_MIN;
-        int minFIndex = INT_MAX;
-        
-        std::vector<double>::iterator it;
-        for(it = _frames.begin(); it != _frames.end(); ++it)
-        {
-            if (frame == *it)
-            {
-                index = static_cast<int>(it - _frames.begin());
-                break;
-            }
-            else if (frame > *it && nearFIndex < *it)
-            {
-                nearFIndex = static_cast<int>(*it);
-                index = static_cast<int>(it - _frames.begin());
-                continue;
-            }
-            else if (*it < minFIndex && nearFIndex == INT_MIN)
-            {
-                minFIndex = static_cast<int>(*it);
-                index = static_cast<int>(it - _frames.begin());
-            }
-        }
+        if (fbs[i].session() == session)
+            return static_cast<int>(i);
     }
-    return _renderbuffers[index];
+    return -1;
 }
 
 
-// Add New RenderBuffer
-void FrameBuffer::add(double frame, int xres, int yres)
+// FrameIndex class
+namespace
 {
-    if (exists(frame))
+    bool frame_less(const std::pair<double, int>& a, const double& b) { return a.first < b; }
+    bool frame_greater(const double& a, const std::pair<double, int>& b) { return a < b.first; }
+}
+
+void FrameIndex::push_back(const double& frame)
+{
+    // Equal frames stay in the order they were added
+    const FrameEntry entry(frame, static_cast<int>(_frames.size()));
+    _sorted.insert(std::upper_bound(_sorted.begin(), _sorted.end(), frame, frame_greater), entry);
+    _frames.push_back(frame);
+    ++_generation;
+}
+
+void FrameIndex::erase(const int& index)
+{
+    if (index < 0 || index >= static_cast<int>(_frames.size()))
+        return;
+    
+    _frames.erase(_frames.begin() + index);
+    
+    std::vector<FrameEntry> sorted;
+    sorted.reserve(_sorted.size() - 1);
+    std::vector<FrameEntry>::iterator it;
+    for(it = _sorted.begin(); it != _sorted.end(); ++it)
     {
-        RenderBuffer rb(frame, xres, yres);
-        
-        if (!_frames.empty())
-            rb = _renderbuffers.back();
-        
-        _frames.push_back(frame);
-        _renderbuffers.push_back(rb);
+        if (it->second != index)
+            sorted.push_back(FrameEntry(it->first, it->second > index ? it->second - 1 : it->second));
     }
+    _sorted.swap(sorted);
+    ++_generation;
 }
 
-// Clear All Data
-void FrameBuffer::clear_all()
+void FrameIndex::clear()
 {
     _frames = std::vector<double>();
-    _renderbuffers = std::vector<RenderBuffer>();
+    _sorted = std::vector<FrameEntry>();
+    ++_generation;
 }
 
-
-// Check if RenderBuffer already exists
-bool FrameBuffer::exists(double frame)
+bool FrameIndex::exists(const double& frame) const
 {
-    return (std::find(_frames.begin(), _frames.end(), frame) != _frames.end());
+    std::vector<FrameEntry>::const_iterator it;
+    it = std::lower_bound(_sorted.begin(), _sorted.end(), frame, frame_less);
+    return it != _sorted.end() && it->first == frame;
 }
 
-
+int FrameIndex::find(const double& frame) const
+{
+    if (_sorted.size() < 2)
+        return 0;
+    
+    // First frame above the given one
+    std::vector<FrameEntry>::const_iterator it;
+    it = std::upper_bound(_sorted.begin(), _sorted.end(), frame, frame_greater);
+    if (it == _sorted.begin())
+        return it->second;
+    
+    // Same or nearest lower frame, the first one added if there are several
+    const double& found = (--it)->first;
+    it = std::lower_bound(_sorted.begin(), it, found, frame_less);
+    return it->second;
+}
@@ -7,9 +7,14 @@ All rights reserved. See COPYING.txt for more details.
 #ifndef FenderBuffer_h
 #define FenderBuffer_h
 
-#include "DDImage/Iop.h"
+#include "aton_half.h"
 
-using namespace DD::Image;
+#include <cassert>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace chStr
 {
@@ -20,34 +25,148 @@ namespace chStr
 // Unpack 1 int to 4
 const std::vector<int> unpack_4_int(const int& i);
 
-// Lightweight colour pixel class
-class RenderColor
+// Area of a buffer in pixels, from x, y to r, t exclusive,
+// the same as DD::Image::Box without depending on DDImage
+class BufferBox
 {
     public:
-        RenderColor();
-
-        float& operator[](int i);
-        const float& operator[](int i) const;
+        BufferBox(const int& x = 0,
+                  const int& y = 0,
+                  const int& r = 0,
+                  const int& t = 0): _x(x), _y(y), _r(r), _t(t) {}
+    
+        const int& x() const { return _x; }
+        const int& y() const { return _y; }
+        const int& r() const { return _r; }
+        const int& t() const { return _t; }
     
-        void reset();
+    private:
+        int _x, _y, _r, _t;
+};
 
-        // Data
-        float _val[3];
+// Get the current write generation, shared by every RenderBuffer.
+// Tiles written from now on get a higher one
+unsigned long long tile_generation();
+
+// Write generation of every tile of a RenderBuffer. The tiles are marked
+// by the threads copying the buckets at the same time, copies take the
+// generations as they are
+class TileGenerations
+{
+    public:
+        TileGenerations(): _tiles(NULL), _size(0) {}
+        TileGenerations(const TileGenerations& other);
+        ~TileGenerations() { delete[] _tiles; }
+    
+        TileGenerations& operator=(const TileGenerations& other);
+    
+        // Resize to the given number of tiles, all marked as written now
+        void reset(const size_t& size);
+    
+        // Mark a tile as written now
+        void mark(const size_t& t);
+    
+        // Get the generation a tile was last written at
+        unsigned long long operator[](const size_t& t) const
+        {
+            return _tiles[t].load(boost::memory_order_relaxed);
+        }
+    
+        size_t size() const { return _size; }
+    
+    private:
+        boost::atomic<unsigned long long>* _tiles;
+        size_t _size;
 };
 
+// Square block of samples of one channel, half precision
+// tiles pack two samples in every float
+typedef std::vector<float> AOVTile;
+typedef boost::shared_ptr<AOVTile> AOVTilePtr;
+
 // AOV Buffer class
+// Every channel is stored in its own plane, split in square tiles.
+// Tiles are shared between the copies of a buffer and only copied when
+// one of them writes to it, so seeding a new frame from the previous one
+// copies pointers, and the new frame only pays for the tiles it renders.
+// Tiles that have never been written aren't allocated and read as zero.
+// Samples are stored either as float or as half, see isHalf().
 class AOVBuffer
 {
     friend class RenderBuffer;
     public:
         AOVBuffer(const unsigned int& width = 0,
                   const unsigned int& height = 0,
-                  const int& spp = 0);
+                  const int& spp = 0,
+                  const bool& half = false);
+    
+        // Size of the tiles in pixels
+        static const int kTileSize = 64;
+    
+        // Resize every plane to the given resolution, clearing the samples
+        void resize(const unsigned int& width,
+                    const unsigned int& height);
+    
+        // Get the plane of the given channel, -1 if there is none
+        int planeIndex(const int& c) const;
+    
+        // Check if the samples are stored in half precision, the
+        // tiles of those buffers are read with the half accessors
+        const bool& isHalf() const { return _half; }
+    
+        // Get a read only tile, NULL if it has never been written
+        const float* tile(const int& p, const size_t& t) const
+        {
+            const AOVTilePtr& tile = _planes[p][t];
+            return tile ? &(*tile)[0] : NULL;
+        }
+    
+        const half_t* halfTile(const int& p, const size_t& t) const
+        {
+            return reinterpret_cast<const half_t*>(tile(p, t));
+        }
+    
+        // Get a tile for writing, allocating it or copying it
+        // first if it's shared with another buffer
+        float* writableTile(const int& p, const size_t& t);
+    
+        // Get a tile already made writable, NULL if it isn't allocated.
+        // A shared one means the buffer was copied after it was prepared
+        float* preparedTile(const int& p, const size_t& t)
+        {
+            const AOVTilePtr& tile = _planes[p][t];
+            assert(!tile || tile.unique());
+            return tile ? &(*tile)[0] : NULL;
+        }
+    
+        // Index of the tile of a pixel
+        size_t tileIndex(const unsigned int& x, const unsigned int& y) const
+        {
+            return (y / kTileSize) * _tiles_x + x / kTileSize;
+        }
+    
+        // Offset of a pixel in its tile
+        static size_t tileOffset(const unsigned int& x, const unsigned int& y)
+        {
+            return (y % kTileSize) * kTileSize + x % kTileSize;
+        }
+    
+        // Memory used by the tiles in bytes, shared tiles
+        // are split between the buffers sharing them
+        size_t memoryUsage() const;
+    
+        // Memory the tiles would take on top of memoryUsage() in float
+        size_t memorySaved() const { return _half ? memoryUsage() : 0; }
     
     private:
-        // Data
-        std::vector<RenderColor> _color_data;
-        std::vector<float> _float_data;
+        // Samples stored as half
+        bool _half;
+    
+        // Number of tiles in a row of tiles
+        unsigned int _tiles_x;
+    
+        // Data, one plane of tiles per sample
+        std::vector<std::vector<AOVTilePtr> > _planes;
 };
 
 
@@ -62,9 +181,10 @@ public:
                  const int& w = 0,
                  const int& h = 0);
 
-    // Add new buffer
+    // Add new buffer, half stores the samples in half precision
     void addBuffer(const char* aov = NULL,
-                   const int& spp = 0);
+                   const int& spp = 0,
+                   const bool& half = false);
 
     // Set writable buffer's pixel
     void setBufferPix(const int& b,
@@ -74,14 +194,62 @@ public:
                       const int& c,
                       const float& pix);
 
+    // Write a whole bucket of interleaved samples into the buffer
+    // x and y are the bucket origin with y going down like the renderer's,
+    // rows are flipped to Nuke's bottom-up order and copied one at a time
+    void writeBucket(const int& b,
+                     const int& x,
+                     const int& y,
+                     const int& width,
+                     const int& height,
+                     const int& spp,
+                     const float* data);
+
+    // Split version of writeBucket, so that buckets can be copied by
+    // several threads. prepareBucket makes the tiles of the bucket
+    // writable, it changes the buffer and needs the write lock. copyBucket
+    // only copies the samples into the prepared tiles and marks them as
+    // written, buckets touching different pixels can be copied in
+    // parallel, with the readers of the buffer kept out. The buffer must
+    // not be copied in between, the copy would share the prepared tiles
+    // and see the samples written to them
+    void prepareBucket(const int& b,
+                       const int& x,
+                       const int& y,
+                       const int& width,
+                       const int& height,
+                       const int& spp);
+
+    void copyBucket(const int& b,
+                    const int& x,
+                    const int& y,
+                    const int& width,
+                    const int& height,
+                    const int& spp,
+                    const float* data);
+
     // Get read only buffer's pixel
-    const float& getBufferPix(const int& b,
+    float getBufferPix(const int& b,
                               const unsigned int& x,
                               const unsigned int& y,
                               const int& c) const;
 
-    // Get the current buffer index
-    int getBufferIndex(const Channel& z);
+    // Copy the samples from x to r of a buffer's row into out,
+    // zero for pixels outside of the buffer or channels it doesn't have
+    void readRow(const int& b,
+                 const int& y,
+                 const int& c,
+                 const int& x,
+                 const int& r,
+                 float* out) const;
+
+    // Get the bounding box of the tiles written since the given
+    // generation, see tile_generation(). Returns false if none were
+    bool getDirtyBox(const unsigned long long& since, BufferBox& box) const;
+
+    // Get the buffer index of a Nuke layer, the depth
+    // layer shows the Z AOV
+    int getLayerIndex(const std::string& layer);
 
     // Get the current buffer index
     int getBufferIndex(const char* aovName);
@@ -102,8 +270,9 @@ public:
     bool isResolutionChanged(const unsigned int& w,
                              const unsigned int& h);
 
-    // Check if Camera fov has been changed
-    bool isCameraChanged(const float& fov, const Matrix4& matrix);
+    // Check if Camera fov has been changed, the matrix is
+    // made of 16 floats as the Client sends it
+    bool isCameraChanged(const float& fov, const std::vector<float>& matrix);
 
     // Resize the containers to match the resolution
     void setResolution(const unsigned int& w,
@@ -124,6 +293,22 @@ public:
     // Get size of the buffers aka AOVs count
     size_t size() { return _aovs.size(); }
 
+    // Memory used by the buffers in bytes
+    size_t memoryUsage() const;
+
+    // Memory saved by the half precision buffers in bytes
+    size_t memorySaved() const;
+
+    // Set and get when this RenderBuffer was last used, for evicting
+    // the least recently used frames
+    void setLastUsed(const unsigned long long& tick) { _last_used = tick; }
+    const unsigned long long& getLastUsed() const { return _last_used; }
+
+    // Get the stamp of the current AOVs set. It changes every time
+    // a buffer is added or removed, so indices resolved from the names
+    // can be cached for as long as the stamp stays the same
+    const unsigned int& getAovsStamp() { return _aovs_stamp; }
+
     // Resize the buffers
     void resize(const size_t& s);
 
@@ -169,9 +354,9 @@ public:
     // Get Camera Fov
     const float& getCameraFov() { return _fov; }
 
-    const Matrix4& getCameraMatrix() { return _matrix; }
+    const std::vector<float>& getCameraMatrix() { return _matrix; }
 
-    void setCamera(const float& fov, const Matrix4& matrix);
+    void setCamera(const float& fov, const std::vector<float>& matrix);
 
 private:
     double _frame;
@@ -183,39 +368,114 @@ private:
     int _height;
     bool _ready;
     float _fov;
-    Matrix4 _matrix;
+    std::vector<float> _matrix;
     int _versionInt;
     std::vector<int> _samples;
     std::string _versionStr;
     std::string _samplesStr;
     std::vector<AOVBuffer> _buffers;
     std::vector<std::string> _aovs;
+    boost::unordered_map<std::string, int> _aovs_index;
+    unsigned int _aovs_stamp;
+    unsigned long long _last_used;
+    TileGenerations _tiles_generation;
+    
+    // Size the tiles generations to the resolution, all written now
+    void resetTiles();
+    
+    // Rebuild the AOV name index after removing buffers
+    void indexAovs();
+};
+
+// Frames of the RenderBuffers in the order they were added, with a
+// sorted copy for the nearest frame lookups
+class FrameIndex
+{
+public:
+    FrameIndex(): _generation(0) {}
+    
+    // Add the frame of the next RenderBuffer
+    void push_back(const double& frame);
+    
+    // Remove the frame of the given index, the indices above it go down by one
+    void erase(const int& index);
+    
+    // Remove every frame
+    void clear();
+    
+    bool empty() const { return _frames.empty(); }
+    size_t size() const { return _frames.size(); }
+    
+    // Check if the frame has been added
+    bool exists(const double& frame) const;
+    
+    // Get the index of the frame, or of the nearest lower frame,
+    // or of the lowest frame if they're all higher
+    int find(const double& frame) const;
+    
+    // Get the frames in the order they were added
+    const std::vector<double>& frames() const { return _frames; }
+    
+    // Changes every time a frame is added or removed
+    const unsigned int& generation() const { return _generation; }
+    
+private:
+    typedef std::pair<double, int> FrameEntry;
+    
+    std::vector<double> _frames;
+    std::vector<FrameEntry> _sorted;
+    unsigned int _generation;
 };
 
 // FrameBuffer Class
+// Frames of one render session. Every session, told apart by the index
+// the driver sends with its images, keeps its own RenderBuffers so that
+// several renders can be received at once without writing into each other
 class FrameBuffer
 {
 public:
-    FrameBuffer(double frame, int xres, int yres);
+    FrameBuffer(const int& session = 0): _session(session) {}
+    
+    // Get the render session index this FrameBuffer belongs to
+    const int& session() const { return _session; }
+    
+    // Get the RenderBuffer a new image of the frame is written into, adding
+    // it if needed, and return its index. With multiframes a new frame is
+    // seeded from the last one added and the other frames are kept,
+    // otherwise the session only keeps the frame being rendered
+    int open(const double& frame,
+             const int& xres,
+             const int& yres,
+             const bool& multiframes);
     
-    // Get RenderBuffer for given Frame
-    const RenderBuffer& at(double frame);
+    // Get the index of the frame, see FrameIndex::find
+    int find(const double& frame) const { return _frames.find(frame); }
     
-    // Add New RenderBuffer
-    void add(double frame, int xres, int yres);
+    // Get the RenderBuffer of the given index
+    RenderBuffer& operator[](const int& index) { return _renderbuffers[index]; }
+    
+    // Remove the frame of the given index, the indices above it go down by one
+    void erase(const int& index);
     
     // Clear All Data
     void clear_all();
     
     bool empty() { return (_frames.empty() && _renderbuffers.empty()); }
+    size_t size() const { return _renderbuffers.size(); }
     
     // Check if RenderBuffer already exists
     bool exists(double frame);
     
+    // Get the frames in the order they were added
+    const FrameIndex& frames() const { return _frames; }
     
 private:
-    std::vector<double> _frames;
+    int _session;
+    FrameIndex _frames;
     std::vector<RenderBuffer> _renderbuffers;
 };
 
+// Get the index of the FrameBuffer of a session, -1 if there is none
+int find_session(const std::vector<FrameBuffer>& fbs, const int& session);
+
 #endif /* FenderBuffer_h */
@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_half.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ATON_HALF_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    void floats_to_halves_scalar(const float* in, half_t* out, const size_t& n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = float_to_half(in[i]);
+    }
+
+    void halves_to_floats_scalar(const half_t* in, float* out, const size_t& n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = half_to_float(in[i]);
+    }
+
+#ifdef ATON_HALF_X86
+    // Compiled for F16C whatever the flags of the build, and only
+    // called if the CPU has it
+    __attribute__((target("avx,f16c")))
+    void floats_to_halves_f16c(const float* in, half_t* out, const size_t& n)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            const __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), 0);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), h);
+        }
+        floats_to_halves_scalar(in + i, out + i, n - i);
+    }
+
+    __attribute__((target("avx,f16c")))
+    void halves_to_floats_f16c(const half_t* in, float* out, const size_t& n)
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            _mm256_storeu_ps(out + i, _mm256_cvtph_ps(h));
+        }
+        halves_to_floats_scalar(in + i, out + i, n - i);
+    }
+
+    // F16C takes its operands in the AVX registers, the OS must save them
+    bool cpu_has_f16c()
+    {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return false;
+
+        const unsigned int osxsave = 1u << 27, avx = 1u << 28, f16c = 1u << 29;
+        if ((ecx & (osxsave | avx | f16c)) != (osxsave | avx | f16c))
+            return false;
+
+        unsigned int xcr0, xcr0_high;
+        __asm__ __volatile__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+        return (xcr0 & 6) == 6;
+    }
+#else
+    bool cpu_has_f16c() { return false; }
+#endif
+
+    // Checked once, before main
+    const bool s_f16c = cpu_has_f16c();
+}
+
+const bool half_f16c()
+{
+    return s_f16c;
+}
+
+void floats_to_halves(const float* in, half_t* out, const size_t& n)
+{
+#ifdef ATON_HALF_X86
+    if (s_f16c)
+    {
+        floats_to_halves_f16c(in, out, n);
+        return;
+    }
+#endif
+    floats_to_halves_scalar(in, out, n);
+}
+
+void halves_to_floats(const half_t* in, float* out, const size_t& n)
+{
+#ifdef ATON_HALF_X86
+    if (s_f16c)
+    {
+        halves_to_floats_f16c(in, out, n);
+        return;
+    }
+#endif
+    halves_to_floats_scalar(in, out, n);
+}
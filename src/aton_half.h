@@ -0,0 +1,98 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_HALF_H_
+#define ATON_HALF_H_
+
+#include <cstddef>
+#include <cstring>
+
+// IEEE 754 half precision float, stored as its bits
+typedef unsigned short half_t;
+
+// Convert a float to half, rounding to nearest even like F16C does
+inline half_t float_to_half(const float& f)
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+
+    const unsigned int sign = (x >> 16) & 0x8000;
+    const unsigned int absx = x & 0x7fffffff;
+
+    // NaN and infinity, NaNs stay quiet NaNs
+    if (absx >= 0x7f800000)
+        return static_cast<half_t>(sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 | ((absx >> 13) & 0x3ff) : 0));
+
+    // Too big, infinity
+    if (absx >= 0x477ff000)
+        return static_cast<half_t>(sign | 0x7c00);
+
+    // Denormal or zero
+    if (absx < 0x38800000)
+    {
+        if (absx < 0x33000000)
+            return static_cast<half_t>(sign);
+        const unsigned int e = absx >> 23;
+        const unsigned int m = (absx & 0x7fffff) | 0x800000;
+        const unsigned int shift = 126 - e;
+        unsigned int h = m >> shift;
+        const unsigned int rest = m & ((1u << shift) - 1);
+        const unsigned int halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1)))
+            ++h;
+        return static_cast<half_t>(sign | h);
+    }
+
+    // Normal, the rounding may carry into the exponent
+    unsigned int h = ((absx - 0x38000000) >> 13);
+    const unsigned int rest = absx & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        ++h;
+    return static_cast<half_t>(sign | h);
+}
+
+// Convert a half to float, exactly
+inline float half_to_float(const half_t& h)
+{
+    const unsigned int sign = (h & 0x8000u) << 16;
+    const unsigned int e = (h >> 10) & 0x1f;
+    unsigned int m = h & 0x3ff;
+    unsigned int x;
+
+    if (e == 0x1f)
+        x = sign | 0x7f800000 | (m << 13) | (m ? 0x400000 : 0);
+    else if (e != 0)
+        x = sign | ((e + 112) << 23) | (m << 13);
+    else if (m == 0)
+        x = sign;
+    else
+    {
+        // Denormal, normalize it
+        unsigned int exp = 113;
+        while (!(m & 0x400))
+        {
+            m <<= 1;
+            --exp;
+        }
+        x = sign | (exp << 23) | ((m & 0x3ff) << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Check if the bulk conversions use the F16C instructions. They're
+// picked at run time, the CPU and the OS must support AVX and F16C
+const bool half_f16c();
+
+// Convert n floats to halves, 8 at a time with F16C
+void floats_to_halves(const float* in, half_t* out, const size_t& n);
+
+// Convert n halves to floats, 8 at a time with F16C
+void halves_to_floats(const half_t* in, float* out, const size_t& n);
+
+#endif // ATON_HALF_H_
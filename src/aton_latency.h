@@ -0,0 +1,124 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_LATENCY_H_
+#define ATON_LATENCY_H_
+
+#include "aton_server.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+// Measures the time from sending a bucket to the Server handing it over,
+// used by the tools running a Server of their own. Passes of a bucket
+// arrive in the order they were sent, whichever thread sent them.
+class LatencyHandler: public ServerHandler
+{
+public:
+    LatencyHandler(): received(0) {}
+
+    void onOpenImage(const int& client, DataHeader& header) {}
+
+    void onPixels(const int& client, DataPixels& pixels)
+    {
+        using namespace boost::posix_time;
+        const ptime now = microsec_clock::universal_time();
+        const BucketKey key(client, pixels);
+
+        boost::mutex::scoped_lock lock(mMutex);
+        SentMap::iterator it = mSent.find(key);
+        if (it != mSent.end() && !it->second.empty())
+        {
+            latencies.push_back((now - it->second.front()).total_microseconds());
+            it->second.pop_front();
+        }
+        received++;
+        mReceived.notify_all();
+    }
+
+    void onCloseImage(const int& client) {}
+
+    // Called before sending a bucket to the image id of the client
+    void sent(const int& client, const DataPixels& pixels)
+    {
+        using namespace boost::posix_time;
+        const BucketKey key(client, pixels);
+        boost::mutex::scoped_lock lock(mMutex);
+        mSent[key].push_back(microsec_clock::universal_time());
+    }
+
+    // Wait up to 10 seconds for the given number of buckets
+    void wait(const long long& buckets)
+    {
+        using namespace boost::posix_time;
+        boost::mutex::scoped_lock lock(mMutex);
+        const ptime end = microsec_clock::universal_time() + seconds(10);
+        while (received < buckets)
+        {
+            if (!mReceived.timed_wait(lock, end))
+                break;
+        }
+    }
+
+    // Print the percentiles of the latencies, sorting them
+    void print()
+    {
+        std::sort(latencies.begin(), latencies.end());
+        printf("latency: p50 %lld us, p95 %lld us, p99 %lld us, max %lld us\n",
+               percentile(0.5),
+               percentile(0.95),
+               percentile(0.99),
+               latencies.empty() ? 0 : latencies.back());
+    }
+
+    long long received;
+    std::vector<long long> latencies;
+
+private:
+    struct BucketKey
+    {
+        BucketKey(const int& client, const DataPixels& pixels):
+            client(client),
+            x(pixels.bucket_xo()),
+            y(pixels.bucket_yo()),
+            aov(pixels.aovName() != NULL ? pixels.aovName() : "") {}
+
+        bool operator<(const BucketKey& other) const
+        {
+            if (client != other.client)
+                return client < other.client;
+            if (x != other.x)
+                return x < other.x;
+            if (y != other.y)
+                return y < other.y;
+            return aov < other.aov;
+        }
+
+        int client, x, y;
+        std::string aov;
+    };
+
+    typedef std::map<BucketKey, std::deque<boost::posix_time::ptime> > SentMap;
+
+    long long percentile(const double& p) const
+    {
+        if (latencies.empty())
+            return 0;
+        const size_t i = static_cast<size_t>(p * (latencies.size() - 1) + 0.5);
+        return latencies[i];
+    }
+
+    SentMap mSent;
+    boost::mutex mMutex;
+    boost::condition_variable mReceived;
+};
+
+#endif // ATON_LATENCY_H_
@@ -0,0 +1,42 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_names.h"
+#include <cstring>
+#include <boost/functional/hash.hpp>
+
+bool NameTable::Key::operator==(const Key& other) const
+{
+    return size == other.size && memcmp(data, other.data, size) == 0;
+}
+
+size_t NameTable::KeyHash::operator()(const Key& key) const
+{
+    return boost::hash_range(key.data, key.data + key.size);
+}
+
+const char* NameTable::intern(const char* name, const size_t& size)
+{
+    // Names sent on the wire are padded with zeros
+    const char* end = static_cast<const char*>(memchr(name, '\0', size));
+
+    Key key;
+    key.data = name;
+    key.size = end != NULL ? end - name : size;
+
+    boost::unordered_map<Key, const char*, KeyHash>::const_iterator it = mIndex.find(key);
+    if (it != mIndex.end())
+        return it->second;
+
+    if (mNames.size() >= mCapacity)
+        return NULL;
+
+    // The key of the new name points to its copy
+    mNames.push_back(std::string(name, key.size));
+    key.data = mNames.back().data();
+    mIndex[key] = mNames.back().c_str();
+    return mNames.back().c_str();
+}
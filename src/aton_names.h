@@ -0,0 +1,53 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_NAMES_H_
+#define ATON_NAMES_H_
+
+#include <deque>
+#include <string>
+#include <boost/unordered_map.hpp>
+
+// Keeps one copy of every AOV name of a connection, so the buckets can
+// point to their name instead of allocating a copy of it. The names are
+// found by hash without copying the one looked up. The pointers stay
+// valid until the table is destroyed.
+class NameTable
+{
+public:
+    // capacity is the number of names the table may hold
+    NameTable(const size_t& capacity = 1024): mCapacity(capacity) {}
+
+    // Get the copy of a name made of up to size characters, adding it
+    // if it's a new one. Returns NULL if the table is full
+    const char* intern(const char* name, const size_t& size);
+
+    size_t size() const { return mNames.size(); }
+
+private:
+    // Characters of a name, the looked up one or a copy in mNames
+    struct Key
+    {
+        const char* data;
+        size_t size;
+        bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const;
+    };
+
+    size_t mCapacity;
+
+    // Grows without moving the names
+    std::deque<std::string> mNames;
+
+    // Copies of the names by their characters
+    boost::unordered_map<Key, const char*, KeyHash> mIndex;
+};
+
+#endif // ATON_NAMES_H_
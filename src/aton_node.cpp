@@ -5,6 +5,7 @@ All rights reserved. See COPYING.txt for more details.
 */
 
 #include "aton_node.h"
+#include "aton_codec.h"
 #include "aton_fb_writer.h"
 #include "aton_fb_updater.h"
 
@@ -42,6 +43,10 @@ void Aton::attach()
     boost::replace_all(str_path, "\\", "/");
     knob("path_knob")->set_text(str_path.c_str());
     
+    std::string str_stats_path = (dir / (m_node_name + "_latency.json")).string();
+    boost::replace_all(str_stats_path, "\\", "/");
+    knob("latency_path_knob")->set_text(str_stats_path.c_str());
+    
     // Check if the format is already exist
     unsigned int i;
     for (i = 0; i < Format::size(); ++i)
@@ -61,8 +66,7 @@ void Aton::detach()
     // undo stack) we should close the port and reopen if attach() gets called.
     m_legit = false;
     disconnect();
-    m_node->m_frames = std::vector<double>();
-    m_node->m_framebuffers = std::vector<RenderBuffer>();
+    m_node->m_framebuffers = std::vector<FrameBuffer>();
 }
 
 void Aton::flagForUpdate(const Box& box)
@@ -76,6 +80,88 @@ void Aton::flagForUpdate(const Box& box)
     asapUpdate(box);
 }
 
+void Aton::queueUpdate()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(m_update_mutex);
+        if (!m_update_pending)
+            m_update_since = boost::posix_time::microsec_clock::universal_time();
+        m_update_pending = true;
+    }
+    
+    // Held back, the updater pushes it once it's due
+    if (!flushUpdates())
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(m_update_mutex);
+            m_updates_suppressed++;
+        }
+        m_update_cond.notify_one();
+    }
+}
+
+bool Aton::flushUpdates(const bool& force)
+{
+    using namespace boost::posix_time;
+    
+    ptime since;
+    {
+        boost::lock_guard<boost::mutex> lock(m_update_mutex);
+        if (!m_update_pending)
+            return false;
+        
+        const ptime now = microsec_clock::universal_time();
+        if (!force && now < updateDeadline())
+            return false;
+        
+        since = m_update_since;
+        m_update_pending = false;
+        m_update_time = now;
+    }
+    
+    boost::lock_guard<boost::mutex> lock(m_push_mutex);
+    
+    // Only the tiles of the viewed frame written since the last update,
+    // with the blits kept out so that none is missed
+    BufferBox dirty;
+    bool written = false;
+    {
+        ReadGuard lock(m_node->m_mutex);
+        BlitLock::Guard reading(m_node->m_blit_lock, BlitLock::READ);
+        const int s_index = findSession();
+        if (s_index >= 0)
+        {
+            FrameBuffer& fBs = m_node->m_framebuffers[s_index];
+            const int f_index = findFrameIndex(fBs, uiContext().frame());
+            if (f_index < static_cast<int>(fBs.size()))
+                written = fBs[f_index].getDirtyBox(m_update_generation, dirty);
+        }
+        m_update_generation = tile_generation();
+    }
+    
+    setCurrentFrame(m_current_frame);
+    if (written)
+        flagForUpdate(Box(dirty.x(), dirty.y(), dirty.r(), dirty.t()));
+    m_stats.stage(STAGE_VIEWER).addSince(since);
+    return true;
+}
+
+boost::posix_time::ptime Aton::updateDeadline() const
+{
+    using namespace boost::posix_time;
+    
+    if (m_update_rate <= 0 || m_update_time.is_not_a_date_time())
+        return ptime(boost::posix_time::min_date_time);
+    return m_update_time + microseconds(1000000 / m_update_rate);
+}
+
+int Aton::wireEncodings() const
+{
+    if (m_half_aovs)
+        return all_encodings();
+    return all_encodings() & ~encoding_mask(ENCODING_FLOAT16);
+}
+
 // We can use this to change our tcp port
 void Aton::changePort(int port)
 {
@@ -89,6 +175,8 @@ void Aton::changePort(int port)
     try
     {
         m_server.connect(port, true);
+        m_server.setEncodings(wireEncodings());
+        m_server.setPipelineStats(&m_stats);
         m_legit = true;
     }
     catch ( ... )
@@ -105,6 +193,10 @@ void Aton::changePort(int port)
     // Success
     if (m_server.isConnected())
     {
+        {
+            boost::lock_guard<boost::mutex> lock(m_update_mutex);
+            m_updater_stop = false;
+        }
         Thread::spawn(::FBWriter, 1, this);
         Thread::spawn(::FBUpdater, 1, this);
         
@@ -124,6 +216,11 @@ void Aton::disconnect()
 {
     if (m_server.isConnected())
     {
+        {
+            boost::lock_guard<boost::mutex> lock(m_update_mutex);
+            m_updater_stop = true;
+        }
+        m_update_cond.notify_all();
         m_server.quit();
         Thread::wait(this);
     }
@@ -133,6 +230,20 @@ void Aton::append(Hash& hash)
 {
     hash.append(m_node->m_hash_count);
     hash.append(outputContext().frame());
+    
+    // Wake the updater up when the frame changes
+    Aton* node = m_node;
+    bool changed = false;
+    {
+        boost::lock_guard<boost::mutex> lock(node->m_update_mutex);
+        if (outputContext().frame() != node->m_append_frame)
+        {
+            node->m_append_frame = outputContext().frame();
+            node->m_frame_changed = changed = true;
+        }
+    }
+    if (changed)
+        node->m_update_cond.notify_one();
 }
 
 void Aton::_validate(bool for_real)
@@ -145,107 +256,142 @@ void Aton::_validate(bool for_real)
     if (m_inError)
         error(m_connectionError.c_str());
 
-    if (!m_node->m_framebuffers.empty())
+    // Status of the frame, copied under the lock as the writer
+    // may drop frames once it's released
+    bool has_frame = false;
+    long long progress = 0, ram = 0, p_ram = 0;
+    int time = 0, width = 0, height = 0;
+    double frame = 0;
+    std::string version, samples;
     {
-        const int f_index = getFrameIndex(m_node->m_frames, uiContext().frame());
-        RenderBuffer& fB = m_node->m_framebuffers[f_index];
+        WriteGuard lock(m_node->m_mutex);
+        const int s_index = findSession();
+        FrameBuffer* fBs = s_index >= 0 ? &m_node->m_framebuffers[s_index] : NULL;
+        const int f_index = fBs != NULL ? findFrameIndex(*fBs, uiContext().frame()) : 0;
         
-        if (!fB.empty())
+        if (fBs != NULL && f_index < static_cast<int>(fBs->size()))
         {
-            // Set the progress
-            setStatus(fB.getProgress(),
-                      fB.getRAM(),
-                      fB.getPRAM(),
-                      fB.getTime(),
-                      fB.getFrame(),
-                      fB.getVersion(),
-                      fB.getSamples());
+            RenderBuffer& fB = (*fBs)[f_index];
             
-            // Set the format
-            const int width = fB.getWidth();
-            const int height = fB.getHeight();
-            
-            if (m_node->m_fmt.width() != width ||
-                m_node->m_fmt.height() != height)
-            {
-                Format* m_fmt_ptr = &m_node->m_fmt;
-                if (m_node->m_formatExists)
-                {
-                    bool fmtFound = false;
-                    unsigned int i;
-                    for (i=0; i < Format::size(); ++i)
-                    {
-                        const char* f_name = Format::index(i)->name();
-                        if (f_name != NULL && m_node->m_node_name == f_name)
-                        {
-                            m_fmt_ptr = Format::index(i);
-                            fmtFound = true;
-                        }
-                    }
-                    if (!fmtFound)
-                        m_fmt_ptr->add(m_node->m_node_name.c_str());
-                }
-                    
-                m_fmt_ptr->set(0, 0, width, height);
-                m_fmt_ptr->width(width);
-                m_fmt_ptr->height(height);
-                knob("formats_knob")->set_text(m_node->m_node_name.c_str());
-            }
+            // Keep the indices for the engine rows of this frame
+            m_cached_frame = uiContext().frame();
+            m_cached_frames_gen = fBs->frames().generation();
+            m_cached_s_index = s_index;
+            m_cached_f_index = f_index;
             
-            // Set the channels
-            ChannelSet& channels = m_node->m_channels;
+            // Mark the frame as used, the least recently used ones
+            // are evicted first when over the memory budget
+            fB.setLastUsed(++m_node->m_frames_tick);
             
-            if (m_enable_aovs && fB.isReady())
+            if (!fB.empty())
             {
-                const int fb_size = static_cast<int>(fB.size());
+                has_frame = true;
+                progress = fB.getProgress();
+                ram = fB.getRAM();
+                p_ram = fB.getPRAM();
+                time = fB.getTime();
+                frame = fB.getFrame();
+                version = fB.getVersion();
+                samples = fB.getSamples();
+                width = fB.getWidth();
+                height = fB.getHeight();
                 
-                if (channels.size() != fb_size)
-                    channels.clear();
-
-                for(int i = 0; i < fb_size; ++i)
+                // Set the channels
+                ChannelSet& channels = m_node->m_channels;
+                
+                if (m_enable_aovs && fB.isReady())
                 {
-                    std::string bfName = fB.getBufferName(i);
+                    const int fb_size = static_cast<int>(fB.size());
                     
-                    using namespace chStr;
-                    if (bfName == RGBA && !channels.contains(Chan_Red))
-                    {
-                        channels.insert(Chan_Red);
-                        channels.insert(Chan_Green);
-                        channels.insert(Chan_Blue);
-                        channels.insert(Chan_Alpha);
-                        continue;
-                    }
-                    else if (bfName == Z && !channels.contains(Chan_Z))
-                    {
-                        channels.insert(Chan_Z);
-                        continue;
-                    }
-                    else if (bfName == N || bfName == P)
+                    if (channels.size() != fb_size)
+                        channels.clear();
+
+                    for(int i = 0; i < fb_size; ++i)
                     {
-                        if (!channels.contains(channel((bfName + _X).c_str())))
+                        std::string bfName = fB.getBufferName(i);
+                        
+                        using namespace chStr;
+                        if (bfName == RGBA && !channels.contains(Chan_Red))
                         {
-                            channels.insert(channel((bfName + _X).c_str()));
-                            channels.insert(channel((bfName + _Y).c_str()));
-                            channels.insert(channel((bfName + _Z).c_str()));
+                            channels.insert(Chan_Red);
+                            channels.insert(Chan_Green);
+                            channels.insert(Chan_Blue);
+                            channels.insert(Chan_Alpha);
+                            continue;
                         }
-                        continue;
-                    }
-                    else if (bfName == ID)
-                    {
-                        if (!channels.contains(channel((bfName + _red).c_str())))
+                        else if (bfName == Z && !channels.contains(Chan_Z))
+                        {
+                            channels.insert(Chan_Z);
+                            continue;
+                        }
+                        else if (bfName == N || bfName == P)
+                        {
+                            if (!channels.contains(channel((bfName + _X).c_str())))
+                            {
+                                channels.insert(channel((bfName + _X).c_str()));
+                                channels.insert(channel((bfName + _Y).c_str()));
+                                channels.insert(channel((bfName + _Z).c_str()));
+                            }
+                            continue;
+                        }
+                        else if (bfName == ID)
+                        {
+                            if (!channels.contains(channel((bfName + _red).c_str())))
+                                channels.insert(channel((bfName + _red).c_str()));
+                            continue;
+                        }
+                        else if (!channels.contains(channel((bfName + _red).c_str())))
+                        {
                             channels.insert(channel((bfName + _red).c_str()));
-                        continue;
+                            channels.insert(channel((bfName + _green).c_str()));
+                            channels.insert(channel((bfName + _blue).c_str()));
+                        }
                     }
-                    else if (!channels.contains(channel((bfName + _red).c_str())))
+                }
+                else
+                    resetChannels(channels);
+                
+                // Resolve the buffer of each channel once for the engine
+                m_channels_index.assign(channels.last() + 1, 0);
+                foreach(z, channels)
+                    m_channels_index[z] = fB.getLayerIndex(getLayerName(z));
+                m_channels_stamp = fB.getAovsStamp();
+            }
+        }
+    }
+    
+    if (has_frame)
+    {
+        // Set the progress
+        setStatus(progress, ram, p_ram, time, frame, version.c_str(), samples.c_str());
+        setLatency();
+        
+        // Set the format
+        if (m_node->m_fmt.width() != width ||
+            m_node->m_fmt.height() != height)
+        {
+            Format* m_fmt_ptr = &m_node->m_fmt;
+            if (m_node->m_formatExists)
+            {
+                bool fmtFound = false;
+                unsigned int i;
+                for (i=0; i < Format::size(); ++i)
+                {
+                    const char* f_name = Format::index(i)->name();
+                    if (f_name != NULL && m_node->m_node_name == f_name)
                     {
-                        channels.insert(channel((bfName + _red).c_str()));
-                        channels.insert(channel((bfName + _green).c_str()));
-                        channels.insert(channel((bfName + _blue).c_str()));
+                        m_fmt_ptr = Format::index(i);
+                        fmtFound = true;
                     }
                 }
+                if (!fmtFound)
+                    m_fmt_ptr->add(m_node->m_node_name.c_str());
             }
-            else
-                resetChannels(channels);
+                
+            m_fmt_ptr->set(0, 0, width, height);
+            m_fmt_ptr->width(width);
+            m_fmt_ptr->height(height);
+            knob("formats_knob")->set_text(m_node->m_node_name.c_str());
         }
     }
     
@@ -258,34 +404,45 @@ void Aton::_validate(bool for_real)
 
 void Aton::engine(int y, int x, int r, ChannelMask channels, Row& out)
 {
-    const int f = getFrameIndex(m_node->m_frames, uiContext().frame());
-    std::vector<RenderBuffer>& fBs = m_node->m_framebuffers;
+    const double frame = uiContext().frame();
+    
+    // One lock for the whole row, the buffer is resolved once per channel
+    // and copied in bulk, the out of range pixels being zero filled.
+    // The blit workers wait while the row is read
+    ReadGuard lock(m_node->m_mutex);
+    BlitLock::Guard reading(m_node->m_blit_lock, BlitLock::READ);
+    
+    // Use the frame index resolved in _validate unless the session or its
+    // frames changed, the writer may have dropped frames since
+    const int s = findSession();
+    FrameBuffer* fBs = s >= 0 ? &m_node->m_framebuffers[s] : NULL;
+    int f = m_cached_f_index;
+    if (fBs != NULL && (s != m_cached_s_index || frame != m_cached_frame ||
+                        fBs->frames().generation() != m_cached_frames_gen))
+        f = findFrameIndex(*fBs, frame);
+    RenderBuffer* fB = (fBs != NULL && f < static_cast<int>(fBs->size()) && (*fBs)[f].isReady()) ?
+                       &(*fBs)[f] : NULL;
     
     foreach(z, channels)
     {
-        int b = 0;
-        int xx = x;
-        const int c = colourIndex(z);
         float* cOut = out.writable(z) + x;
-        const float* END = cOut + (r - x);
         
-        ReadGuard lock(m_mutex);
-        if (m_enable_aovs && !fBs.empty() && fBs[f].isReady())
-            b = fBs[f].getBufferIndex(z);
+        if (fB == NULL)
+        {
+            std::fill(cOut, cOut + (r - x), 0.0f);
+            continue;
+        }
         
-        while (cOut < END)
+        // Use the indices resolved in _validate while the AOVs are the same
+        int b = 0;
+        if (m_enable_aovs)
         {
-            if (fBs.empty() || !fBs[f].isReady() ||
-                x >= fBs[f].getWidth() ||
-                y >= fBs[f].getHeight() || r > fBs[f].getWidth())
-            {
-                *cOut = 0.0f;
-            }
+            if (fB->getAovsStamp() == m_channels_stamp && static_cast<size_t>(z) < m_channels_index.size())
+                b = m_channels_index[z];
             else
-                *cOut = fBs[f].getBufferPix(b, xx, y, c);
-            ++cOut;
-            ++xx;
+                b = fB->getLayerIndex(getLayerName(z));
         }
+        fB->readRow(b, y, colourIndex(z), x, r, cOut);
     }
 }
 
@@ -336,9 +493,48 @@ void Aton::knobs(Knob_Callback f)
     Int_knob(f, &m_port, "port_number", "Port");
     Bool_knob(f, &m_enable_aovs, "enable_aovs_knob", "Read AOVs");
     Bool_knob(f, &m_multiframes, "multi_frame_knob", "Read Multiple Frames");
+    Int_knob(f, &m_session, "session_knob", "Session");
+    Tooltip(f, "Render session to show when several renders are sent at once, "
+               "numbered in the order they connected. 0 shows the one that "
+               "started an image last.");
+    Knob* budget_knob = Int_knob(f, &m_memory_budget, "memory_budget_knob", "Memory Budget");
+    Tooltip(f, "Memory limit of the frame buffers in MB. The least recently viewed "
+               "frames are dropped once it's exceeded, 0 means no limit.");
+    Knob* rate_knob = Int_knob(f, &m_update_rate, "update_rate_knob", "Update Rate");
+    Tooltip(f, "Maximum number of viewer updates per second while rendering, "
+               "the buckets in between are shown with the next update. "
+               "0 means no limit.");
+    Knob* half_knob = Bool_knob(f, &m_half_aovs, "half_aovs_knob", "Half Float AOVs");
+    Tooltip(f, "Store the AOVs received from now on in half precision to fit more "
+               "frames in memory. Z, P, N, ID, motionvector and Cryptomatte AOVs "
+               "are always kept in full float.");
     Knob* live_cam_knob = Bool_knob(f, &m_live_camera, "live_camera_knob", "Read Camera");
     EndToolbar(f);
 
+    // Latency knobs, the queue and send stages are timed by the driver
+    static const char* latency_labels[STAGE_COUNT] = {"Queue", "Send", "Receive", "Blit", "Viewer"};
+    static const char* latency_tooltips[STAGE_COUNT] =
+    {
+        "",
+        "",
+        "From a message arriving to its bucket being read, decompressed and decoded.",
+        "From a bucket being read to it being copied into the frame buffer.",
+        "From the first bucket of a viewer update being copied to the viewer "
+        "being invalidated, including the wait for the update rate."
+    };
+    BeginClosedGroup(f, "latency_group", "Latency");
+    std::vector<Knob*> latency_knobs;
+    for (int s = STAGE_RECEIVE; s < STAGE_COUNT; ++s)
+    {
+        std::string knob_name = (boost::format("latency_%s_knob")%stage_name(s)).str();
+        latency_knobs.push_back(String_knob(f, &m_latency[s], knob_name.c_str(), latency_labels[s]));
+        Tooltip(f, latency_tooltips[s]);
+    }
+    Knob* latency_path_knob = File_knob(f, &m_stats_path, "latency_path_knob", "JSON File");
+    Button(f, "latency_save_knob", "Save");
+    Button(f, "latency_reset_knob", "Reset");
+    EndGroup(f);
+
 
     
     // Status Bar
@@ -349,6 +545,9 @@ void Aton::knobs(Knob_Callback f)
     // Set Flags
     path_knob->set_flag(Knob::NO_RERENDER, true);
     live_cam_knob->set_flag(Knob::NO_RERENDER, true);
+    budget_knob->set_flag(Knob::NO_RERENDER, true);
+    rate_knob->set_flag(Knob::NO_RERENDER, true);
+    half_knob->set_flag(Knob::NO_RERENDER, true);
     write_multi_frame_knob->set_flag(Knob::NO_RERENDER, true);
 //    stamp_knob->set_flag(Knob::NO_RERENDER, true);
 //    stamp_scale_knob->set_flag(Knob::NO_RERENDER, true);
@@ -356,6 +555,14 @@ void Aton::knobs(Knob_Callback f)
     statusKnob->set_flag(Knob::NO_RERENDER, true);
     statusKnob->set_flag(Knob::DISABLED, true);
     statusKnob->set_flag(Knob::OUTPUT_ONLY, true);
+    latency_path_knob->set_flag(Knob::NO_RERENDER, true);
+    std::vector<Knob*>::iterator it;
+    for (it = latency_knobs.begin(); it != latency_knobs.end(); ++it)
+    {
+        (*it)->set_flag(Knob::NO_RERENDER, true);
+        (*it)->set_flag(Knob::DISABLED, true);
+        (*it)->set_flag(Knob::OUTPUT_ONLY, true);
+    }
 }
 
 int Aton::knob_changed(Knob* _knob)
@@ -370,6 +577,17 @@ int Aton::knob_changed(Knob* _knob)
         clearAllCmd();
         return 1;
     }
+    if (_knob->is("half_aovs_knob"))
+    {
+        m_server.setEncodings(wireEncodings());
+        return 1;
+    }
+    if (_knob->is("memory_budget_knob"))
+    {
+        // Trimmed by the writer, in between the buckets it receives
+        m_server.wake();
+        return 1;
+    }
     if (_knob->is("multi_frame_knob"))
     {
         m_node->m_current_frame = uiContext().frame();
@@ -409,6 +627,17 @@ int Aton::knob_changed(Knob* _knob)
         importCmd(true);
         return 1;
     }
+    if (_knob->is("latency_save_knob"))
+    {
+        saveLatencyCmd();
+        return 1;
+    }
+    if (_knob->is("latency_reset_knob"))
+    {
+        m_node->m_stats.reset();
+        setLatency();
+        return 1;
+    }
     return 0;
 }
 
@@ -431,41 +660,26 @@ bool Aton::isPathValid(std::string path)
     return boost::filesystem::exists(dir);
 }
 
-int Aton::getFrameIndex(std::vector<double>& frames, double currentFrame)
+int Aton::findSession()
 {
-    int f_index = 0;
+    std::vector<FrameBuffer>& fbs = m_node->m_framebuffers;
+    if (fbs.empty())
+        return -1;
     
-    if (frames.size() > 1)
-    {
-        if (!m_multiframes)
-            currentFrame = m_node->m_current_frame;
-        
-        int nearFIndex = INT_MIN;
-        int minFIndex = INT_MAX;
-        
-        ReadGuard lock(m_mutex);
-        std::vector<double>::iterator it;
-        for(it = frames.begin(); it != frames.end(); ++it)
-        {
-            if (currentFrame == *it)
-            {
-                f_index = static_cast<int>(it - frames.begin());
-                break;
-            }
-            else if (currentFrame > *it && nearFIndex < *it)
-            {
-                nearFIndex = static_cast<int>(*it);
-                f_index = static_cast<int>(it - frames.begin());
-                continue;
-            }
-            else if (*it < minFIndex && nearFIndex == INT_MIN)
-            {
-                minFIndex = static_cast<int>(*it);
-                f_index = static_cast<int>(it - frames.begin());
-            }
-        }
-    }
-    return f_index;
+    // Sessions are numbered from 1 in the order they connected
+    if (m_session > 0)
+        return m_session <= static_cast<int>(fbs.size()) ? m_session - 1 : -1;
+    
+    const int latest = find_session(fbs, m_node->m_latest_session);
+    return latest >= 0 ? latest : static_cast<int>(fbs.size()) - 1;
+}
+
+int Aton::findFrameIndex(const FrameBuffer& fbs, double currentFrame)
+{
+    if (!m_multiframes)
+        currentFrame = m_node->m_current_frame;
+    
+    return fbs.find(currentFrame);
 }
 
 std::string Aton::getPath()
@@ -551,20 +765,21 @@ std::vector<std::string> Aton::getCaptures()
 
 void Aton::clearAllCmd()
 {
-    std::vector<RenderBuffer>& fBs  = m_node->m_framebuffers;
-    std::vector<double>& frames  = m_node->m_frames;
+    std::vector<FrameBuffer>& fBs  = m_node->m_framebuffers;
 
-    if (!fBs.empty() && !frames.empty())
+    if (!fBs.empty())
     {
-        std::vector<RenderBuffer>::iterator it;
+        std::vector<FrameBuffer>::iterator it;
         for(it = fBs.begin(); it != fBs.end(); ++it)
-            it->ready(false);
+        {
+            for (size_t i = 0; i < it->size(); ++i)
+                (*it)[i].ready(false);
+        }
         
         m_node->m_legit = false;
         m_node->disconnect();
         
-        fBs =  std::vector<RenderBuffer>();
-        frames = std::vector<double>();
+        fBs =  std::vector<FrameBuffer>();
         
         resetChannels(m_node->m_channels);
         m_node->m_legit = true;
@@ -578,7 +793,16 @@ void Aton::captureCmd()
 {
     std::string path = std::string(m_path);
 
-    if (m_node->m_frames.size() > 0 && isPathValid(path) && m_slimit > 0)
+    // Frames of the session shown
+    std::vector<double> sortedFrames;
+    {
+        ReadGuard lock(m_node->m_mutex);
+        const int s_index = findSession();
+        if (s_index >= 0)
+            sortedFrames = m_node->m_framebuffers[s_index].frames().frames();
+    }
+
+    if (sortedFrames.size() > 0 && isPathValid(path) && m_slimit > 0)
     {
         // Add date or frame suffix to the path
         std::string key (".");
@@ -587,7 +811,6 @@ void Aton::captureCmd()
         double startFrame;
         double endFrame;
         
-        std::vector<double> sortedFrames = m_node->m_frames;
         std::stable_sort(sortedFrames.begin(), sortedFrames.end());
 
         if (m_multiframes && m_all_frames)
@@ -759,30 +982,61 @@ void Aton::setStatus(const long long& progress,
     const int hour = time / 3600000;
     const int minute = (time % 3600000) / 60000;
     const int second = ((time % 3600000) % 60000) / 1000;
-    const size_t f_count = m_node->m_framebuffers.size();
+    size_t f_count = 0;
+    {
+        ReadGuard lock(m_node->m_mutex);
+        const int s_index = findSession();
+        if (s_index >= 0)
+            f_count = m_node->m_framebuffers[s_index].size();
+    }
+    const long long fb_ram = m_node->m_memory_usage / 1048576;
+    const long long fb_pram = m_node->m_memory_peak / 1048576;
+    const long long fb_saved = m_node->m_memory_saved / 1048576;
 
     std::string str_status = (boost::format("Arnold %s | "
                                             "Memory: %sMB / %sMB | "
+                                            "Buffers: %sMB / %sMB (%sMB saved) | "
                                             "Time: %02ih:%02im:%02is | "
                                             "Frame: %s of %s | "
                                             "Samples: %s | "
                                             "Progress: %s%%")%version%ram%p_ram
+                                                             %fb_ram%fb_pram%fb_saved
                                                              %hour%minute%second
                                                              %frame%f_count%samples%progress).str();
     knob("status_knob")->set_text(str_status.c_str());
 }
 
-void Aton::setCameraKnobs(const float& fov, const Matrix4& matrix)
+void Aton::setLatency()
+{
+    for (int s = STAGE_RECEIVE; s < STAGE_COUNT; ++s)
+    {
+        const std::string knob_name = (boost::format("latency_%s_knob")%stage_name(s)).str();
+        knob(knob_name.c_str())->set_text(m_node->m_stats.summary(s).c_str());
+    }
+}
+
+void Aton::saveLatencyCmd()
+{
+    const std::string path = std::string(m_stats_path);
+    if (!isPathValid(path) || !m_node->m_stats.save(path))
+    {
+        print_name(std::cerr);
+        std::cerr << ": Could not save the latencies to " << path << std::endl;
+    }
+}
+
+void Aton::setCameraKnobs(const float& fov, const std::vector<float>& matrix)
 {
     std::string knob_value = (boost::format("%s")%fov).str();
     knob("cam_fov_knob")->set_text(knob_value.c_str());
     
+    // Same order as the columns of a Matrix4
     int k_index = 0;
     for (int i=0; i<4; i++)
     {
         for (int j=0; j<4; j++)
         {
-            const float value_m = *(matrix[i]+j);
+            const float value_m = matrix[i * 4 + j];
             knob_value = (boost::format("%s")%value_m).str();
             std::string knob_name = (boost::format("cM%s")%k_index).str();
             knob(knob_name.c_str())->set_text(knob_value.c_str());
@@ -15,9 +15,15 @@ All rights reserved. See COPYING.txt for more details.
 
 using namespace DD::Image;
 
+#include "aton_blit_pool.h"
 #include "aton_client.h"
 #include "aton_server.h"
 #include "aton_framebuffer.h"
+#include "aton_stats.h"
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 // Class name
 static const char* const CLASS = "Aton";
@@ -35,17 +41,41 @@ class Aton: public Iop
         Aton*                     m_node;             // First node pointer
         Server                    m_server;           // Aton::Server
         ReadWriteLock             m_mutex;            // Mutex for locking the pixel buffer
+        BlitLock                  m_blit_lock;        // Keeps the tiles being copied from being read
         Format                    m_fmt;              // The nuke display format
         FormatPair                m_fmtp;             // Buffer format (knob)
         ChannelSet                m_channels;         // Channels aka AOVs object
         int                       m_port;             // Port we're listening on (knob)
         int                       m_slimit;           // The limit size
+        int                       m_memory_budget;    // Frame buffers memory budget in MB (knob)
+        int                       m_session;          // Render session shown, 0 for the latest (knob)
+        int                       m_latest_session;   // Session index of the last opened image
+        int                       m_update_rate;      // Max viewer updates per second (knob)
+        long long                 m_memory_usage;     // Frame buffers memory in bytes
+        long long                 m_memory_peak;      // Peak of the frame buffers memory in bytes
+        long long                 m_memory_saved;     // Frame buffers memory saved by half AOVs in bytes
+        unsigned long long        m_frames_tick;      // Frames use counter for the eviction
+        long long                 m_updates_suppressed;// Viewer updates merged into later ones
+        bool                      m_update_pending;   // There is an area waiting to be updated
+        unsigned long long        m_update_generation;// Tile generation of the last viewer update
+        boost::mutex              m_update_mutex;     // Mutex for the pending update and the updater
+        boost::condition_variable m_update_cond;      // Wakes the updater thread up
+        boost::mutex              m_push_mutex;       // Serializes the viewer updates of the blit threads
+        bool                      m_frame_changed;    // The output frame changed since the updater ran
+        bool                      m_updater_stop;     // Asks the updater thread to return
+        double                    m_append_frame;     // Output frame of the last append()
+        boost::posix_time::ptime  m_update_time;      // Time of the last viewer update
+        boost::posix_time::ptime  m_update_since;     // Time the first area waiting to be updated was queued
+        PipelineStats             m_stats;            // Latencies of the received buckets
+        std::string               m_latency[STAGE_COUNT];// Latency summaries of the stages (knobs)
+        const char*               m_stats_path;       // JSON file the latencies are saved to (knob)
         float                     m_cam_fov;          // Default Camera fov
         float                     m_cam_matrix;       // Default Camera matrix value
         bool                      m_multiframes;      // Enable Multiple Frames toogle
         bool                      m_all_frames;       // Capture All Frames toogle
         bool                      m_stamp;            // Enable Frame stamp toogle
         bool                      m_enable_aovs;      // Enable AOVs toogle
+        bool                      m_half_aovs;        // Store non data AOVs as half toogle
         bool                      m_live_camera;      // Enable Live Camera toogle
         bool                      m_inError;          // Error handling
         bool                      m_formatExists;     // If the format was already exist
@@ -54,6 +84,11 @@ class Aton: public Iop
         double                    m_current_frame;    // Used to hold current frame
         double                    m_stamp_scale;      // Frame stamp size
         unsigned int              m_hash_count;       // Refresh hash counter
+        unsigned int              m_channels_stamp;   // AOVs stamp of the channel indices
+        double                    m_cached_frame;     // Viewer frame of the cached frame index
+        unsigned int              m_cached_frames_gen;// Frames generation of the cached frame index
+        int                       m_cached_s_index;   // Session index resolved in _validate
+        int                       m_cached_f_index;   // Frame index resolved in _validate
         const char*               m_path;             // Default path for Write node
         const char*               m_comment;          // Comment for the frame stamp
         double*                   m_cropBox;
@@ -61,10 +96,9 @@ class Aton: public Iop
         std::string               m_status;           // Status bar text
         std::string               m_details;          // Render layer details
         std::string               m_connectionError;  // Connection error report
-        std::vector<double>       m_frames;           // Frames holder
-        std::vector<RenderBuffer> m_framebuffers;     // Framebuffers holder
-        std::vector<FrameBuffer>  M_FRAMEBUFFERS;     // Framebuffers holder
+        std::vector<FrameBuffer>  m_framebuffers;     // Frames of every render session
         std::vector<std::string>  m_garbageList;      // List of captured files to be deleted
+        std::vector<int>          m_channels_index;   // Buffer index of each channel
 
         Aton(Node* node): Iop(node),
                           m_node(firstNode()),
@@ -72,10 +106,25 @@ class Aton: public Iop
                           m_channels(Mask_RGBA),
                           m_port(getPort()),
                           m_slimit(20),
+                          m_memory_budget(0),
+                          m_session(0),
+                          m_latest_session(0),
+                          m_update_rate(30),
+                          m_memory_usage(0),
+                          m_memory_peak(0),
+                          m_memory_saved(0),
+                          m_frames_tick(0),
+                          m_updates_suppressed(0),
+                          m_update_pending(false),
+                          m_update_generation(0),
+                          m_frame_changed(false),
+                          m_updater_stop(false),
+                          m_append_frame(0),
                           m_cam_fov(0),
                           m_cam_matrix(0),
                           m_multiframes(true),
                           m_enable_aovs(true),
+                          m_half_aovs(true),
                           m_live_camera(false),
                           m_all_frames(false),
                           m_stamp(false),
@@ -85,8 +134,14 @@ class Aton: public Iop
                           m_legit(false),
                           m_cropBox(NULL),
                           m_current_frame(0),
+                          m_channels_stamp(0),
+                          m_cached_frame(0),
+                          m_cached_frames_gen(UINT_MAX),
+                          m_cached_s_index(-1),
+                          m_cached_f_index(0),
                           m_stamp_scale(1.0),
                           m_path(""),
+                          m_stats_path(""),
                           m_node_name(""),
                           m_status(""),
                           m_comment(""),
@@ -105,6 +160,23 @@ class Aton: public Iop
 
         void flagForUpdate(const Box& box = Box(0,0,0,0));
 
+        // Ask for a viewer update of the tiles written since the last one,
+        // pushed right away unless the last one was less than
+        // 1 / m_update_rate ago
+        void queueUpdate();
+
+        // Push the pending viewer update if it's due or forced,
+        // returns true if there was one and it was pushed
+        bool flushUpdates(const bool& force = false);
+
+        // Time the pending viewer update is due at,
+        // must be called with m_update_mutex locked
+        boost::posix_time::ptime updateDeadline() const;
+
+        // Wire encodings the Clients may use, half floats
+        // only if we store them as half anyway
+        int wireEncodings() const;
+
         void changePort(int port);
 
         void disconnect();
@@ -123,7 +195,14 @@ class Aton: public Iop
     
         bool isPathValid(std::string path);
     
-        int getFrameIndex(std::vector<double>& frames, double currentFrame);
+        // Get the index in m_framebuffers of the session the viewer shows,
+        // -1 if there is none. m_node->m_mutex must be held
+        int findSession();
+    
+        // Get the index of the frame to show in the frames of a session,
+        // m_node->m_mutex must be held. Check the index against the
+        // session's size, it's 0 when there are none
+        int findFrameIndex(const FrameBuffer& fbs, double currentFrame);
     
         std::string getPath();
     
@@ -149,7 +228,13 @@ class Aton: public Iop
                        const char* version = "",
                        const char* samples = "");
     
-        void setCameraKnobs(const float& fov, const Matrix4& matrix);
+        // Show the latencies of the stages timed on this side
+        void setLatency();
+
+        // Save the latencies to the JSON file of the knob
+        void saveLatencyCmd();
+
+        void setCameraKnobs(const float& fov, const std::vector<float>& matrix);
     
         void setCurrentFrame(const double& frame);
     
@@ -0,0 +1,276 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Replays a session recorded with ATON_RECORD through Clients, either to
+// a running Server such as a Nuke Aton node, or to a Server of its own
+// to measure the buckets per second and the latency of every bucket.
+
+#include "aton_client.h"
+#include "aton_codec.h"
+#include "aton_latency.h"
+#include "aton_server.h"
+#include "aton_session.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace boost::posix_time;
+
+namespace
+{
+    struct ReplayOptions
+    {
+        ReplayOptions(): port(get_port()),
+                         speed(0),
+                         loops(1),
+                         compression(false),
+                         shm(true),
+                         delta_memory(0) {}
+
+        // Server to send to, a Server of our own if empty
+        std::string host;
+        int port;
+
+        // Play the original timing this many times faster, 0 for as fast
+        // as possible
+        double speed;
+
+        int loops;
+        bool compression, shm;
+        size_t delta_memory;
+        std::string path;
+    };
+
+    void usage()
+    {
+        std::cerr << "Usage: aton_replay [options] session\n"
+                  << "  --host HOST       Send to a running Server instead of our own\n"
+                  << "  --port PORT       Port of the running Server\n"
+                  << "  --realtime        Keep the original timing of the messages\n"
+                  << "  --speed X         Play the original timing X times faster\n"
+                  << "  --loop N          Replay the session N times\n"
+                  << "  --compression     Compress the buckets sent through the socket\n"
+                  << "  --no-shm          Send the buckets through the socket only\n"
+                  << "  --delta MB        Memory for the deltas of the progressive passes\n";
+    }
+
+    bool parse_options(int argc, char* argv[], ReplayOptions& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            const bool has_value = i + 1 < argc;
+            if (arg == "--host" && has_value)
+                options.host = argv[++i];
+            else if (arg == "--port" && has_value)
+                options.port = atoi(argv[++i]);
+            else if (arg == "--realtime")
+                options.speed = 1;
+            else if (arg == "--speed" && has_value)
+                options.speed = atof(argv[++i]);
+            else if (arg == "--loop" && has_value)
+                options.loops = std::max(1, atoi(argv[++i]));
+            else if (arg == "--compression")
+                options.compression = true;
+            else if (arg == "--no-shm")
+                options.shm = false;
+            else if (arg == "--delta" && has_value)
+                options.delta_memory = static_cast<size_t>(atoi(argv[++i])) * 1048576;
+            else if (arg[0] != '-' && options.path.empty())
+                options.path = arg;
+            else
+                return false;
+        }
+        return !options.path.empty();
+    }
+
+    void run_server(Server* server, LatencyHandler* handler)
+    {
+        server->run(*handler);
+    }
+
+    // Unpack an open image message
+    DataHeader unpack_header(const char* ptr)
+    {
+        int index, xres, yres, version;
+        long long area;
+        float frame, fov, matrix[16];
+        int samples[6];
+        unpack_field(ptr, index);
+        unpack_field(ptr, xres);
+        unpack_field(ptr, yres);
+        unpack_field(ptr, area);
+        unpack_field(ptr, version);
+        unpack_field(ptr, frame);
+        unpack_field(ptr, fov);
+        memcpy(matrix, ptr, sizeof(matrix));
+        ptr += sizeof(matrix);
+        memcpy(samples, ptr, sizeof(samples));
+        return DataHeader(index, xres, yres, area, version, frame, fov, matrix, samples);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    ReplayOptions options;
+    if (!parse_options(argc, argv, options))
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        SessionReader reader(options.path);
+
+        // Our own Server, unless we're sending to a running one
+        Server* server = NULL;
+        LatencyHandler handler;
+        boost::thread server_thread;
+        std::string host = options.host;
+        int port = options.port;
+        if (host.empty())
+        {
+            server = new Server();
+            server->connect(9301, true);
+            server_thread = boost::thread(boost::bind(run_server, server, &handler));
+            host = "127.0.0.1";
+            port = server->getPort();
+        }
+
+        // One Client per recorded connection
+        std::map<int, Client*> clients;
+        std::vector<float> samples;
+        long long buckets = 0, bytes = 0;
+
+        const ptime start = microsec_clock::universal_time();
+        for (int loop = 0; loop < options.loops; ++loop)
+        {
+            reader.rewind();
+            const ptime loop_start = microsec_clock::universal_time();
+
+            SessionRecord record;
+            while (reader.next(record))
+            {
+                // Wait for the time the message was received at
+                if (options.speed > 0)
+                {
+                    const ptime due = loop_start +
+                                      microseconds(static_cast<long long>(record.time / options.speed));
+                    const ptime now = microsec_clock::universal_time();
+                    if (due > now)
+                        boost::this_thread::sleep(due - now);
+                }
+
+                Client*& client = clients[record.client];
+                if (client == NULL)
+                {
+                    client = new Client(host, port);
+                    client->useSharedMemory(options.shm);
+                    client->useCompression(options.compression);
+                    client->useDelta(options.delta_memory);
+                }
+
+                switch (record.type)
+                {
+                    case SESSION_OPEN:
+                    {
+                        DataHeader dh = unpack_header(record.data);
+                        client->openImage(dh);
+                        break;
+                    }
+                    case SESSION_PIXELS:
+                    {
+                        // The recording may start in the middle of an image
+                        if (client->imageId() < 0)
+                            break;
+                        
+                        // The message as it was sent without compression
+                        const char* ptr = record.data;
+                        int image_id, xres, yres, xo, yo, sx, sy, spp, encoding, time, aov_size;
+                        long long ram;
+                        unpack_field(ptr, image_id);
+                        unpack_field(ptr, xres);
+                        unpack_field(ptr, yres);
+                        unpack_field(ptr, xo);
+                        unpack_field(ptr, yo);
+                        unpack_field(ptr, sx);
+                        unpack_field(ptr, sy);
+                        unpack_field(ptr, spp);
+                        unpack_field(ptr, encoding);
+                        unpack_field(ptr, ram);
+                        unpack_field(ptr, time);
+                        unpack_field(ptr, aov_size);
+
+                        // Integer AOVs are sent as integers again
+                        const bool integer = (encoding & ENCODING_INTEGER) != 0;
+                        encoding &= ~ENCODING_INTEGER;
+
+                        const int num_samples = sx * sy * spp;
+                        if (samples.size() < static_cast<size_t>(num_samples))
+                            samples.resize(num_samples);
+                        decode_pixels(encoding, ptr + aov_size, num_samples, &samples[0]);
+
+                        DataPixels dp(xres, yres, xo, yo, sx, sy, spp, ram, time, ptr, &samples[0]);
+                        dp.setEncoding(integer ? ENCODING_INT16 : encoding);
+                        if (server != NULL)
+                            handler.sent(client->imageId(), dp);
+                        client->sendPixels(dp);
+
+                        buckets++;
+                        bytes += encoded_size(encoding, num_samples);
+                        break;
+                    }
+                    case SESSION_CLOSE:
+                    {
+                        if (client->imageId() >= 0)
+                            client->closeImage();
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Let our Server catch up before stopping it
+        if (server != NULL)
+            handler.wait(buckets);
+        const double elapsed = (microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+
+        std::map<int, Client*>::iterator it;
+        for (it = clients.begin(); it != clients.end(); ++it)
+            delete it->second;
+
+        if (server != NULL)
+        {
+            server->quit();
+            server_thread.join();
+            delete server;
+        }
+
+        printf("%lld buckets, %.1f MB in %.3f s: %.0f buckets/s, %.1f MB/s\n",
+               buckets, bytes / 1048576.0, elapsed,
+               elapsed > 0 ? buckets / elapsed : 0,
+               elapsed > 0 ? bytes / 1048576.0 / elapsed : 0);
+
+        if (server != NULL)
+        {
+            handler.print();
+            if (handler.received < buckets)
+                printf("%lld buckets not received\n", buckets - handler.received);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "aton_replay: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,276 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_send_queue.h"
+#include <boost/bind.hpp>
+
+bool SendQueue::BucketKey::operator<(const BucketKey& other) const
+{
+    if (x != other.x)
+        return x < other.x;
+    if (y != other.y)
+        return y < other.y;
+    return aov < other.aov;
+}
+
+SendQueue::SendQueue(Client* client,
+                     const size_t& memoryCap,
+                     const int& policy): mClient(client),
+                                         mMemoryCap(memoryCap),
+                                         mMemory(0),
+                                         mPolicy(policy),
+                                         mStop(false),
+                                         mDropped(0),
+                                         mCoalesced(0),
+                                         mBusy(false),
+                                         mThread(boost::bind(&SendQueue::run, this)) {}
+
+SendQueue::~SendQueue()
+{
+    {
+        boost::mutex::scoped_lock lock(mMutex);
+        mStop = true;
+    }
+    mNotEmpty.notify_all();
+    mNotFull.notify_all();
+    mThread.join();
+    delete mClient;
+}
+
+void SendQueue::openImage(const DataHeader& header)
+{
+    Message* msg = new Message;
+    msg->type = OPEN;
+    msg->header = header;
+    push(msg);
+}
+
+void SendQueue::sendPixels(const DataPixels& pixels)
+{
+    const int num_samples = pixels.bucket_size_x() * pixels.bucket_size_y() * pixels.spp();
+
+    Message* msg = new Message;
+    msg->type = PIXELS;
+    msg->pixels = pixels;
+    msg->aov = pixels.aovName();
+    msg->data.assign(pixels.data(), pixels.data() + num_samples);
+    msg->queued = boost::posix_time::microsec_clock::universal_time();
+    push(msg);
+}
+
+void SendQueue::closeImage()
+{
+    Message* msg = new Message;
+    msg->type = CLOSE;
+    push(msg);
+}
+
+void SendQueue::flush()
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    while (!mQueue.empty() || mBusy)
+        mNotFull.wait(lock);
+}
+
+bool SendQueue::takeError(std::string& error)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    if (mError.empty())
+        return false;
+    error.swap(mError);
+    mError.clear();
+    return true;
+}
+
+void SendQueue::push(Message* msg)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+
+    if (mStop)
+    {
+        delete msg;
+        return;
+    }
+
+    if (msg->type == PIXELS)
+    {
+        const size_t size = msg->data.size() * sizeof(float);
+
+        BucketKey key;
+        key.aov = msg->aov;
+        key.x = msg->pixels.bucket_xo();
+        key.y = msg->pixels.bucket_yo();
+
+        // Apply the policy when the memory cap is hit
+        if (mMemory + size > mMemoryCap)
+        {
+            if (mPolicy != SEND_BLOCK)
+            {
+                // Newer pass of a bucket still waiting in the queue
+                BucketMap::iterator it = mBuckets.find(key);
+                if (it != mBuckets.end() &&
+                    it->second->data.size() == msg->data.size())
+                {
+                    Message* queued = it->second;
+                    queued->pixels = msg->pixels;
+                    queued->data.swap(msg->data);
+                    mCoalesced++;
+                    delete msg;
+                    return;
+                }
+
+                if (mPolicy == SEND_DROP)
+                    dropSuperseded(size);
+            }
+
+            // Wait for the sender thread, a bucket bigger than
+            // the cap still goes through once the queue is empty
+            while (mMemory + size > mMemoryCap && (mBusy || !mQueue.empty()) && !mStop)
+                mNotFull.wait(lock);
+        }
+
+        mMemory += size;
+        mBuckets[key] = msg;
+    }
+    else if (msg->type == OPEN)
+    {
+        // Don't coalesce buckets across images
+        mBuckets.clear();
+    }
+
+    mQueue.push_back(msg);
+    lock.unlock();
+    mNotEmpty.notify_one();
+}
+
+bool SendQueue::dropSuperseded(const size_t& size)
+{
+    // Buckets queued before the current image aren't replaced by its ones
+    std::deque<Message*>::iterator it = mQueue.end();
+    while (it != mQueue.begin() && (*(it - 1))->type != OPEN)
+        --it;
+
+    while (it != mQueue.end() && mMemory + size > mMemoryCap)
+    {
+        Message* queued = *it;
+        if (queued->type == PIXELS)
+        {
+            BucketKey key;
+            key.aov = queued->aov;
+            key.x = queued->pixels.bucket_xo();
+            key.y = queued->pixels.bucket_yo();
+
+            BucketMap::const_iterator newest = mBuckets.find(key);
+            if (newest != mBuckets.end() && newest->second != queued)
+            {
+                mMemory -= queued->data.size() * sizeof(float);
+                mDropped++;
+                delete queued;
+                it = mQueue.erase(it);
+                continue;
+            }
+        }
+        ++it;
+    }
+    return mMemory + size <= mMemoryCap;
+}
+
+void SendQueue::run()
+{
+    // Set when sending fails, until the next open image message
+    bool failed = false;
+
+    while (true)
+    {
+        Message* msg = NULL;
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            while (mQueue.empty() && !mStop)
+                mNotEmpty.wait(lock);
+
+            if (mQueue.empty())
+                break;
+
+            msg = mQueue.front();
+            mQueue.pop_front();
+
+            if (msg->type == PIXELS)
+            {
+                BucketKey key;
+                key.aov = msg->aov;
+                key.x = msg->pixels.bucket_xo();
+                key.y = msg->pixels.bucket_yo();
+
+                BucketMap::iterator it = mBuckets.find(key);
+                if (it != mBuckets.end() && it->second == msg)
+                    mBuckets.erase(it);
+            }
+            mBusy = true;
+        }
+
+        std::string error;
+        try
+        {
+            switch (msg->type)
+            {
+                case OPEN:
+                {
+                    failed = false;
+                    mClient->openImage(msg->header);
+                    break;
+                }
+                case PIXELS:
+                {
+                    if (failed)
+                        break;
+
+                    using namespace boost::posix_time;
+                    const ptime start = microsec_clock::universal_time();
+                    mStats.stage(STAGE_QUEUE).add((start - msg->queued).total_microseconds());
+
+                    const DataPixels& p = msg->pixels;
+                    DataPixels dp(p.xres(),
+                                  p.yres(),
+                                  p.bucket_xo(),
+                                  p.bucket_yo(),
+                                  p.bucket_size_x(),
+                                  p.bucket_size_y(),
+                                  p.spp(),
+                                  p.ram(),
+                                  p.time(),
+                                  msg->aov.c_str(),
+                                  &msg->data[0]);
+                    dp.setEncoding(p.encoding());
+                    mClient->sendPixels(dp);
+                    mStats.stage(STAGE_SEND).addSince(start);
+                    break;
+                }
+                case CLOSE:
+                {
+                    if (!failed)
+                        mClient->closeImage();
+                    break;
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            failed = true;
+            error = e.what();
+        }
+
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+            if (msg->type == PIXELS)
+                mMemory -= msg->data.size() * sizeof(float);
+            if (!error.empty())
+                mError = error;
+            mBusy = false;
+        }
+        mNotFull.notify_all();
+        delete msg;
+    }
+}
@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_SEND_QUEUE_H_
+#define ATON_SEND_QUEUE_H_
+
+#include "aton_client.h"
+#include "aton_stats.h"
+
+#include <deque>
+#include <map>
+#include <boost/thread.hpp>
+
+// Send queue policies, applied when the memory cap is hit
+enum SendPolicy
+{
+    // Wait until the sender thread has made room
+    SEND_BLOCK = 0,
+
+    // Replace a queued bucket of the same region, otherwise discard the
+    // oldest queued passes that a newer queued pass of their region
+    // repaints, and wait if there are none. A bucket is never discarded
+    // without a newer pass of it being sent
+    SEND_DROP,
+
+    // Replace a queued bucket of the same region, otherwise wait
+    SEND_COALESCE
+};
+
+// Bounded multi-producer queue in front of a Client
+// Render threads push copies of their buckets and return immediately,
+// a dedicated sender thread owns the Client and writes to the socket.
+class SendQueue
+{
+public:
+    // Takes ownership of the client. memoryCap is the number of bytes of
+    // pixel data allowed to wait in the queue
+    SendQueue(Client* client,
+              const size_t& memoryCap,
+              const int& policy = SEND_BLOCK);
+
+    // Sends what is left in the queue and stops the sender thread
+    ~SendQueue();
+
+    // Queue an open image message
+    void openImage(const DataHeader& header);
+
+    // Queue a copy of the bucket. The copy and its queue entries are
+    // allocated for every bucket, unlike on the receive side
+    void sendPixels(const DataPixels& pixels);
+
+    // Queue a close image message
+    void closeImage();
+
+    // Block until every queued message has been sent
+    void flush();
+
+    // Get the last error raised by the sender thread and clear it
+    bool takeError(std::string& error);
+
+    // Number of buckets discarded or replaced because of the memory cap
+    const long long& dropped() const { return mDropped; }
+    const long long& coalesced() const { return mCoalesced; }
+
+    // Time the buckets spent in the queue and being sent
+    const PipelineStats& stats() const { return mStats; }
+
+private:
+    enum { OPEN = 0, PIXELS = 1, CLOSE = 2 };
+
+    // Queued message
+    struct Message
+    {
+        int type;
+        DataHeader header;
+        DataPixels pixels;
+        std::string aov;
+        std::vector<float> data;
+        boost::posix_time::ptime queued;
+    };
+
+    // Bucket region used to find a queued bucket to coalesce with
+    struct BucketKey
+    {
+        std::string aov;
+        int x, y;
+        bool operator<(const BucketKey& other) const;
+    };
+
+    typedef std::map<BucketKey, Message*> BucketMap;
+
+    void push(Message* msg);
+    void run();
+
+    // Discard the oldest queued buckets of the current image that a newer
+    // queued bucket replaces until size more bytes fit under the cap.
+    // Returns false if that isn't enough
+    bool dropSuperseded(const size_t& size);
+
+    Client* mClient;
+    size_t mMemoryCap, mMemory;
+    int mPolicy;
+    bool mStop;
+    long long mDropped, mCoalesced;
+    std::string mError;
+    PipelineStats mStats;
+
+    // Messages in send order and queued buckets of the current image
+    std::deque<Message*> mQueue;
+    BucketMap mBuckets;
+
+    // Set while the sender thread is writing a message
+    bool mBusy;
+
+    boost::mutex mMutex;
+    boost::condition_variable mNotEmpty, mNotFull;
+    boost::thread mThread;
+};
+
+#endif // ATON_SEND_QUEUE_H_
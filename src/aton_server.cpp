@@ -6,18 +6,131 @@ All rights reserved. See COPYING.txt for more details.
 
 #include "aton_server.h"
 #include "aton_client.h"
+#include "aton_codec.h"
+#include "aton_names.h"
+#include "aton_session.h"
+#include "aton_shm.h"
+#include <iostream>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 using namespace boost::asio;
 
+namespace
+{
+    // Size of the open image message following its key
+    const int header_size()
+    {
+        return sizeof(int) * 3 + sizeof(long long) + sizeof(int) +
+               sizeof(float) * 2 + sizeof(float) * 16 + sizeof(int) * 6;
+    }
+    
+    // Largest pixels message accepted, a 4K square float RGBA bucket.
+    // Keeps a corrupted size from allocating gigabytes
+    const int max_message_size = 256 * 1048576;
+    
+    // Names of the shared memory rings created by the Clients
+    const char* const ring_prefix = "aton_";
+    
+    // Messages read from a ring in a row, before serving the other connections
+    const int ring_batch = 64;
+    
+    // Plain IPv4 address of an IPv4 mapped IPv6 one
+    ip::address unmapped(const ip::address& address)
+    {
+        if (address.is_v6() && address.to_v6().is_v4_mapped())
+            return address.to_v6().to_v4();
+        return address;
+    }
+    
+    // Check if the peer of a socket runs on this machine, it connects
+    // through the loopback or to the address it's connected from
+    bool is_local_peer(const ip::tcp::socket& socket)
+    {
+        boost::system::error_code ec;
+        const ip::address remote = unmapped(socket.remote_endpoint(ec).address());
+        if (ec)
+            return false;
+        if (remote.is_loopback())
+            return true;
+        
+        const ip::address local = unmapped(socket.local_endpoint(ec).address());
+        return !ec && remote == local;
+    }
+}
+
+// A connected Client
+class ServerConnection
+{
+public:
+    ServerConnection(io_service& ios, const int& id): mId(id),
+                                                      mImage(-1),
+                                                      mType(0),
+                                                      mSize(0),
+                                                      mRing(NULL),
+                                                      mSocket(ios) {}
+    
+    ~ServerConnection() { delete mRing; }
+
+    // Image id given to the Client
+    int mId;
+    
+    // Image id of the open image, -1 if there is none
+    int mImage;
+
+    // Type and size of the message being read
+    int mType, mSize;
+    
+    // Reply being sent to the Client
+    int mReply[2];
+    
+    // Time the type of the message was read at, or the message was
+    // taken from the ring
+    boost::posix_time::ptime mReceived;
+
+    // Receive buffer, grows to the largest message
+    std::vector<char> mBuffer;
+    
+    // Decoded pixels of the encoded buckets
+    std::vector<float> mDecoded;
+    
+    // Decompressed pixels, and decompression scratch buffer
+    std::vector<char> mUnpacked, mScratch;
+    
+    // Fixed part of the pixels message being recorded
+    std::vector<char> mRecord;
+    
+    // AOV names the buckets point to
+    NameTable mNames;
+    
+    CodecStats mStats;
+    
+    // Last samples received for the buckets the Client asked to keep
+    DeltaCache mDeltas;
+    
+    // Shared memory ring, if the Client is on this machine
+    ShmRing* mRing;
+
+    ip::tcp::socket mSocket;
+};
+
 Server::Server(): mPort(0),
-                  mSocket(mIoService),
+                  mNextId(1),
+                  mEncodings(all_encodings()),
+                  mHandler(NULL),
+                  mRecorder(NULL),
+                  mPipelineStats(NULL),
                   mAcceptor(mIoService)
 {
 }
 
 Server::Server(int port): mPort(0),
-                          mSocket(mIoService),
+                          mNextId(1),
+                          mEncodings(all_encodings()),
+                          mHandler(NULL),
+                          mRecorder(NULL),
+                          mPipelineStats(NULL),
                           mAcceptor(mIoService)
 {
     connect(port);
@@ -25,6 +138,7 @@ Server::Server(int port): mPort(0),
 
 Server::~Server()
 {
+    closeAll();
     if (mAcceptor.is_open())
         mAcceptor.close();
 }
@@ -79,97 +193,651 @@ void Server::quit()
     client.quit();
 }
 
-void Server::accept()
+void Server::wake()
 {
-    if (mSocket.is_open())
-        mSocket.close();
-        mAcceptor.accept(mSocket);
+    mIoService.post(boost::bind(&Server::handleWake, this));
 }
 
-int Server::listenType()
+void Server::handleWake()
 {
-    int type;
+    if (mHandler != NULL)
+        mHandler->onWake();
+}
+
+void Server::run(ServerHandler& handler)
+{
+    mHandler = &handler;
     
-    try
+    // Tee the messages into a session file
+    const char* def_record = getenv("ATON_RECORD");
+    if (def_record != NULL && def_record[0] != '\0')
     {
-        read(mSocket, buffer(reinterpret_cast<char*>(&type), sizeof(int)));
+        try
+        {
+            mRecorder = new SessionRecorder(def_record);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Aton: " << e.what() << std::endl;
+        }
+    }
+    
+    mIoService.reset();
+    startAccept();
+    mIoService.run();
+    closeAll();
+    mHandler = NULL;
+    
+    delete mRecorder;
+    mRecorder = NULL;
+}
+
+void Server::startAccept()
+{
+    if (!mAcceptor.is_open())
+        return;
+    
+    ConnectionPtr conn(new ServerConnection(mIoService, mNextId++));
+    mAcceptor.async_accept(conn->mSocket,
+                           boost::bind(&Server::handleAccept, this, conn,
+                                       placeholders::error));
+}
+
+void Server::handleAccept(ConnectionPtr conn, const boost::system::error_code& ec)
+{
+    if (!ec)
+    {
+        mConnections[conn->mId] = conn;
+        readType(conn);
+    }
+    
+    // Keep accepting other Clients
+    if (ec != error::operation_aborted)
+        startAccept();
+}
+
+void Server::readType(ConnectionPtr conn)
+{
+    async_read(conn->mSocket,
+               buffer(reinterpret_cast<char*>(&conn->mType), sizeof(int)),
+               boost::bind(&Server::handleType, this, conn, placeholders::error));
+}
+
+void Server::handleType(ConnectionPtr conn, const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        close(conn);
+        return;
+    }
     
-        if (type == 2 || type == 9)
+    conn->mReceived = boost::posix_time::microsec_clock::universal_time();
+    
+    switch (conn->mType)
+    {
+        case 0: // Open a new image
+        {
+            // Buckets of the previous image come first
+            if (!flushRing(conn))
+                return;
+            conn->mStats = CodecStats();
+            
+            // Send back an image id and the encodings we can decode,
+            // the header is read once it's sent
+            conn->mReply[0] = conn->mId;
+            conn->mReply[1] = mEncodings;
+            async_write(conn->mSocket,
+                        buffer(reinterpret_cast<const char*>(conn->mReply), sizeof(int) * 2),
+                        boost::bind(&Server::handleReply, this, conn, placeholders::error));
+            break;
+        }
+        case 1: // Write image data
+        {
+            async_read(conn->mSocket,
+                       buffer(reinterpret_cast<char*>(&conn->mSize), sizeof(int)),
+                       boost::bind(&Server::handleSize, this, conn, placeholders::error));
+            break;
+        }
+        case 2: // Close image
+        {
+            async_read(conn->mSocket,
+                       buffer(reinterpret_cast<char*>(&conn->mSize), sizeof(int)),
+                       boost::bind(&Server::handleClose, this, conn, placeholders::error));
+            break;
+        }
+        case 3: // Pixels are waiting in the shared memory ring
+        {
+            if (conn->mRing != NULL)
+                drainRing(conn);
+            else
+                readType(conn);
+            break;
+        }
+        case 4: // Open the Client's shared memory ring
+        {
+            async_read(conn->mSocket,
+                       buffer(reinterpret_cast<char*>(&conn->mSize), sizeof(int)),
+                       boost::bind(&Server::handleAttachSize, this, conn, placeholders::error));
+            break;
+        }
+        case 9: // Quit, sent when the parent process wants to stop listening
+        {
+            mAcceptor.close();
+            closeAll();
+            mIoService.stop();
+            break;
+        }
+        default:
         {
-            mSocket.close();
-            if (type == 9)
-                mAcceptor.close();
+            std::cerr << "Aton: Unknown message type " << conn->mType << std::endl;
+            close(conn);
         }
     }
-    catch( ... )
+}
+
+void Server::handleReply(ConnectionPtr conn, const boost::system::error_code& ec)
+{
+    if (ec)
     {
-        mSocket.close();
-        throw std::runtime_error("Could not read from socket!");
+        close(conn);
+        return;
     }
     
-    return type;
+    // An opened image goes on with its header
+    if (conn->mType == 0)
+    {
+        conn->mBuffer.resize(std::max(conn->mBuffer.size(),
+                                      static_cast<size_t>(header_size())));
+        async_read(conn->mSocket,
+                   buffer(&conn->mBuffer[0], header_size()),
+                   boost::bind(&Server::handleHeader, this, conn, placeholders::error));
+    }
+    else
+        readType(conn);
 }
 
-DataHeader Server::listenHeader()
+void Server::handleHeader(ConnectionPtr conn, const boost::system::error_code& ec)
 {
+    if (ec)
+    {
+        close(conn);
+        return;
+    }
+    
     DataHeader dh;
-
-    // Send back an image id
-    int image_id = 1;
-    write(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)));
     
     // Read data from the buffer
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mIndex), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mXres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mYres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mRArea), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mVersion), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mCurrentFrame), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mCamFov), sizeof(float)));
+    const char* ptr = &conn->mBuffer[0];
+    unpack_field(ptr, dh.mIndex);
+    unpack_field(ptr, dh.mXres);
+    unpack_field(ptr, dh.mYres);
+    unpack_field(ptr, dh.mRArea);
+    unpack_field(ptr, dh.mVersion);
+    unpack_field(ptr, dh.mCurrentFrame);
+    unpack_field(ptr, dh.mCamFov);
     
     const int camMatrixSize = 16;
     dh.mCamMatrixStore.resize(camMatrixSize);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mCamMatrixStore[0]), sizeof(float)*camMatrixSize));
-
+    memcpy(&dh.mCamMatrixStore[0], ptr, sizeof(float) * camMatrixSize);
+    ptr += sizeof(float) * camMatrixSize;
+    
     const int samplesSize = 6;
     dh.mSamplesStore.resize(samplesSize);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dh.mSamplesStore[0]), sizeof(int)*samplesSize));
+    memcpy(&dh.mSamplesStore[0], ptr, sizeof(int) * samplesSize);
+    
+    if (mRecorder != NULL)
+        mRecorder->write(SESSION_OPEN, conn->mId, &conn->mBuffer[0], header_size());
+    
+    try
+    {
+        mHandler->onOpenImage(conn->mId, dh);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Aton: " << e.what() << std::endl;
+        close(conn);
+        return;
+    }
+    conn->mImage = conn->mId;
+    readType(conn);
+}
 
-    return dh;
+void Server::handleClose(ConnectionPtr conn, const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        close(conn);
+        return;
+    }
+    
+    if (!flushRing(conn))
+        return;
+    conn->mImage = -1;
+    
+    if (mRecorder != NULL)
+        mRecorder->write(SESSION_CLOSE, conn->mId, NULL, 0);
+    
+    try
+    {
+        mHandler->onCloseImage(conn->mId);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Aton: " << e.what() << std::endl;
+    }
+    
+    // Clients keep their connection for the next image
+    readType(conn);
 }
 
-DataPixels Server::listenPixels()
+void Server::handleSize(ConnectionPtr conn, const boost::system::error_code& ec)
 {
-    DataPixels dp;
+    if (ec || conn->mSize < pixels_header_size())
+    {
+        close(conn);
+        return;
+    }
+    
+    if (conn->mSize > max_message_size)
+    {
+        std::cerr << "Aton: Pixels message too large, " << conn->mSize << " bytes!" << std::endl;
+        close(conn);
+        return;
+    }
     
-    // Receive image id
-    int image_id;
-    read(mSocket, buffer(reinterpret_cast<char*>(&image_id), sizeof(int)) );
+    // Read the whole message into the receive buffer
+    if (conn->mBuffer.size() < static_cast<size_t>(conn->mSize))
+        conn->mBuffer.resize(conn->mSize);
+    
+    async_read(conn->mSocket,
+               buffer(&conn->mBuffer[0], conn->mSize),
+               boost::bind(&Server::handlePixels, this, conn, placeholders::error));
+}
 
-    // Read data from the buffer
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mXres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mYres), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_xo), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_yo), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_size_x), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mBucket_size_y), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mSpp), sizeof(int)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mRam), sizeof(long long)));
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mTime), sizeof(int)));
-
-    // Get aov name's size
-    size_t aov_size;
-    read(mSocket, buffer(reinterpret_cast<char*>(&aov_size), sizeof(size_t)));
+void Server::handlePixels(ConnectionPtr conn, const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        close(conn);
+        return;
+    }
+    
+    ShmLease none;
+    if (dispatchPixels(conn, &conn->mBuffer[0], conn->mSize, none))
+        readType(conn);
+}
+
+void Server::handleAttachSize(ConnectionPtr conn, const boost::system::error_code& ec)
+{
+    if (ec || conn->mSize <= 0 || conn->mSize > 255)
+    {
+        close(conn);
+        return;
+    }
+    
+    if (conn->mBuffer.size() < static_cast<size_t>(conn->mSize))
+        conn->mBuffer.resize(conn->mSize);
+    
+    async_read(conn->mSocket,
+               buffer(&conn->mBuffer[0], conn->mSize),
+               boost::bind(&Server::handleAttach, this, conn, placeholders::error));
+}
+
+void Server::handleAttach(ConnectionPtr conn, const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        close(conn);
+        return;
+    }
+    
+    const std::string name(&conn->mBuffer[0], conn->mSize);
+    
+    // Only the rings of the Clients on this machine are opened, the
+    // Client falls back to the socket otherwise
+    int status = 0;
+    if (!is_local_peer(conn->mSocket))
+        std::cerr << "Aton: Shared memory refused to a remote Client" << std::endl;
+    else if (name.compare(0, strlen(ring_prefix), ring_prefix) != 0)
+        std::cerr << "Aton: Shared memory refused, " << name << " is not a ring" << std::endl;
+    else
+        status = 1;
+    
+    // The ring can only have one reader, take it from an older connection
+    // of the same Client
+    std::map<int, ConnectionPtr>::iterator it;
+    for (it = mConnections.begin(); status == 1 && it != mConnections.end(); ++it)
+    {
+        ServerConnection* other = it->second.get();
+        if (other != conn.get() && other->mRing != NULL && other->mRing->name() == name)
+        {
+            releaseRing(other);
+            delete other->mRing;
+            other->mRing = NULL;
+        }
+    }
+    
+    if (status == 1)
+    {
+        try
+        {
+            releaseRing(conn.get());
+            delete conn->mRing;
+            conn->mRing = NULL;
+            conn->mRing = ShmRing::open(name);
+            conn->mRing->sleep();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Aton: Could not open shared memory, " << e.what() << std::endl;
+            status = 0;
+        }
+    }
+    
+    conn->mReply[0] = status;
+    async_write(conn->mSocket,
+                buffer(reinterpret_cast<const char*>(conn->mReply), sizeof(int)),
+                boost::bind(&Server::handleReply, this, conn, placeholders::error));
+}
+
+void Server::drainRing(ConnectionPtr conn)
+{
+    // Connection closed
+    if (mConnections.count(conn->mId) == 0)
+        return;
+    
+    // Ring taken by a newer connection
+    if (conn->mRing == NULL)
+    {
+        readType(conn);
+        return;
+    }
+    
+    ShmRing* ring = conn->mRing;
+    
+    // The handler may keep the pixels lent from the ring, the other
+    // messages are given back right away
+    int size = 0;
+    const char* data;
+    ShmLease lease;
+    for (int i = 0; i < ring_batch && (data = ring->peek(size, lease)) != NULL; ++i)
+    {
+        conn->mReceived = boost::posix_time::microsec_clock::universal_time();
+        const bool ok = dispatchPixels(conn, data, size, lease);
+        lease.release();
+        if (!ok)
+            return;
+    }
+    
+    if (size < 0)
+    {
+        std::cerr << "Aton: Corrupted shared memory message!" << std::endl;
+        close(conn);
+        return;
+    }
+    
+    // Back to the socket once the ring is empty and the Client knows we're idle
+    if (ring->sleep())
+        readType(conn);
+    else
+        mIoService.post(boost::bind(&Server::drainRing, this, conn));
+}
 
+bool Server::flushRing(ConnectionPtr conn)
+{
+    if (conn->mRing == NULL)
+        return true;
+    
+    int size = 0;
+    const char* data;
+    ShmLease lease;
+    while ((data = conn->mRing->peek(size, lease)) != NULL)
+    {
+        conn->mReceived = boost::posix_time::microsec_clock::universal_time();
+        const bool ok = dispatchPixels(conn, data, size, lease);
+        lease.release();
+        if (!ok)
+            return false;
+    }
+    
+    if (size < 0)
+    {
+        std::cerr << "Aton: Corrupted shared memory message!" << std::endl;
+        close(conn);
+        return false;
+    }
+    return true;
+}
+
+void Server::releaseRing(ServerConnection* conn)
+{
+    if (conn->mRing == NULL || conn->mRing->held() == 0 || mHandler == NULL)
+        return;
+    
+    try
+    {
+        mHandler->onRelease(conn->mId);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Aton: " << e.what() << std::endl;
+    }
+}
+
+bool Server::dispatchPixels(ConnectionPtr conn, const char* data, const int& size,
+                            ShmLease& lease)
+{
+    DataPixels dp;
+    
+    if (size < pixels_header_size())
+    {
+        std::cerr << "Aton: Corrupted pixels message!" << std::endl;
+        close(conn);
+        return false;
+    }
+    
+    // Unpack the fixed part of the message
+    const char* ptr = data;
+    int image_id, encoding, aov_size;
+    unpack_field(ptr, image_id);
+    unpack_field(ptr, dp.mXres);
+    unpack_field(ptr, dp.mYres);
+    unpack_field(ptr, dp.mBucket_xo);
+    unpack_field(ptr, dp.mBucket_yo);
+    unpack_field(ptr, dp.mBucket_size_x);
+    unpack_field(ptr, dp.mBucket_size_y);
+    unpack_field(ptr, dp.mSpp);
+    unpack_field(ptr, encoding);
+    unpack_field(ptr, dp.mRam);
+    unpack_field(ptr, dp.mTime);
+    unpack_field(ptr, aov_size);
+    
+    // The buckets of a closed image, or of another one, would be written
+    // into the frame of the open one
+    if (image_id != conn->mImage)
+    {
+        std::cerr << "Aton: Pixels of an image that isn't open!" << std::endl;
+        close(conn);
+        return false;
+    }
+    
+    // The bucket must fit in the image, its decoded size in a message,
+    // before any of them is used to size a buffer
+    if (dp.bucket_size_x() <= 0 || dp.bucket_size_x() > dp.xres() ||
+        dp.bucket_size_y() <= 0 || dp.bucket_size_y() > dp.yres() ||
+        dp.spp() < 1 || dp.spp() > 4 ||
+        static_cast<long long>(dp.bucket_size_x()) * dp.bucket_size_y() * dp.spp() >
+        max_message_size / static_cast<int>(sizeof(float)))
+    {
+        std::cerr << "Aton: Corrupted pixels message!" << std::endl;
+        close(conn);
+        return false;
+    }
+    
+    // Compressed pixels take the rest of the message
+    const int flags = encoding & ENCODING_FLAGS;
+    const bool compressed = (flags & ENCODING_COMPRESSED) != 0;
+    encoding &= ~ENCODING_FLAGS;
+    const int num_samples = dp.bucket_size_x() * dp.bucket_size_y() * dp.spp();
+    const int pixels_size = encoded_size(encoding, num_samples);
+    const int received = size - pixels_header_size() - aov_size;
+    if (aov_size <= 0 || pixels_size < 0 || pixels_size > max_message_size ||
+        received < 0 || (!compressed && received != pixels_size))
+    {
+        std::cerr << "Aton: Corrupted pixels message!" << std::endl;
+        close(conn);
+        return false;
+    }
+    
     // Get aov name
-    char* aov_name = new char[aov_size];
-    read(mSocket, buffer(aov_name, aov_size));
+    const char* aov_name = conn->mNames.intern(ptr, aov_size);
+    if (aov_name == NULL)
+    {
+        std::cerr << "Aton: Too many AOV names!" << std::endl;
+        close(conn);
+        return false;
+    }
     dp.mAovName = aov_name;
+    
+    // Decompress next to the receive buffer
+    const char* pixels = ptr + aov_size;
+    if (compressed)
+    {
+        if (conn->mUnpacked.size() < static_cast<size_t>(pixels_size) + sizeof(float))
+            conn->mUnpacked.resize(pixels_size + sizeof(float));
+        
+        using namespace boost::posix_time;
+        const ptime start = microsec_clock::universal_time();
+        const bool ok = decompress_pixels(encoding, pixels, received, pixels_size,
+                                          &conn->mUnpacked[0], conn->mScratch);
+        conn->mStats.seconds += (microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+        if (!ok)
+        {
+            std::cerr << "Aton: Corrupted compressed pixels!" << std::endl;
+            close(conn);
+            return false;
+        }
+        pixels = &conn->mUnpacked[0];
+        conn->mStats.compressed++;
+    }
+    conn->mStats.buckets++;
+    conn->mStats.received += received;
+    conn->mStats.decoded += pixels_size;
+    
+    // Apply the delta to the last samples of the bucket, which become
+    // the samples of this pass
+    if (flags & ENCODING_DELTA)
+    {
+        std::vector<char>* last = conn->mDeltas.find(aov_name,
+                                                     dp.mBucket_xo,
+                                                     dp.mBucket_yo,
+                                                     encoding,
+                                                     pixels_size);
+        if (last == NULL)
+        {
+            std::cerr << "Aton: Delta of an unknown bucket!" << std::endl;
+            close(conn);
+            return false;
+        }
+        xor_bytes(pixels, &(*last)[0], pixels_size, &(*last)[0]);
+        pixels = &(*last)[0];
+        conn->mStats.deltas++;
+    }
+    else if (flags & ENCODING_CACHE)
+    {
+        // The Client keeps its cache within the same limit
+        if (!conn->mDeltas.store(aov_name, dp.mBucket_xo, dp.mBucket_yo,
+                                 encoding, pixels, pixels_size, MAX_DELTA_MEMORY))
+        {
+            std::cerr << "Aton: Too many buckets kept for deltas!" << std::endl;
+            close(conn);
+            return false;
+        }
+    }
+    
+    // Record the message as if it was sent without compression or delta
+    if (mRecorder != NULL)
+    {
+        const int head_size = pixels_header_size() + aov_size;
+        conn->mRecord.assign(data, data + head_size);
+        const int recorded = encoding | (flags & ENCODING_INTEGER);
+        memcpy(&conn->mRecord[sizeof(int) * 8], &recorded, sizeof(int));
+        mRecorder->write(SESSION_PIXELS, conn->mId, &conn->mRecord[0], head_size,
+                         pixels, pixels_size);
+    }
+    
+    // Pixels are float aligned in the receive buffer or the ring,
+    // encoded ones are decoded next to it. The ones read in place from
+    // the ring are lent to the handler
+    if (encoding == ENCODING_FLOAT32)
+    {
+        dp.mpData = reinterpret_cast<float*>(const_cast<char*>(pixels));
+        if (pixels == ptr + aov_size)
+        {
+            dp.mLease = lease;
+            lease = ShmLease();
+        }
+    }
+    else
+    {
+        if (conn->mDecoded.size() < static_cast<size_t>(num_samples) + 1)
+            conn->mDecoded.resize(num_samples + 1);
+        decode_pixels(encoding, pixels, num_samples, &conn->mDecoded[0]);
+        dp.mpData = &conn->mDecoded[0];
+    }
+    dp.mEncoding = encoding | (flags & ENCODING_INTEGER);
+    
+    if (mPipelineStats != NULL)
+        mPipelineStats->stage(STAGE_RECEIVE).addSince(conn->mReceived);
+    
+    bool failed = false;
+    try
+    {
+        mHandler->onPixels(conn->mId, dp);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Aton: " << e.what() << std::endl;
+        failed = true;
+    }
+    
+    // Unless the handler kept them
+    dp.mLease.release();
+    
+    if (failed)
+    {
+        close(conn);
+        return false;
+    }
+    return true;
+}
 
-    // Get pixels
-    const int num_samples = dp.bucket_size_x() * dp.bucket_size_y() * dp.spp();
-    dp.mPixelStore.resize(num_samples);
-    read(mSocket, buffer(reinterpret_cast<char*>(&dp.mPixelStore[0]), sizeof(float)*num_samples));
-    return dp;
+const CodecStats& Server::codecStats(const int& client) const
+{
+    static const CodecStats none;
+    std::map<int, ConnectionPtr>::const_iterator it = mConnections.find(client);
+    return it != mConnections.end() ? it->second->mStats : none;
 }
 
+void Server::close(ConnectionPtr conn)
+{
+    std::map<int, ConnectionPtr>::iterator it = mConnections.find(conn->mId);
+    if (it == mConnections.end())
+        return;
+    
+    // The handler lets go of the pixels lent from the ring first
+    releaseRing(conn.get());
+    
+    boost::system::error_code ec;
+    conn->mSocket.close(ec);
+    mConnections.erase(it);
+    
+    if (mHandler != NULL)
+        mHandler->onDisconnect(conn->mId);
+}
+
+void Server::closeAll()
+{
+    while (!mConnections.empty())
+        close(mConnections.begin()->second);
+}
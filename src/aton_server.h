@@ -8,20 +8,77 @@ All rights reserved. See COPYING.txt for more details.
 #define ATON_SERVER_H_
 
 #include "aton_client.h"
+#include "aton_stats.h"
+#include <map>
 #include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+
+// Receives the messages of every Client connected to a Server
+// All the calls are made from the thread running Server::run(), each
+// connected Client is identified by the image id the Server gave it.
+// A Client may open any number of images on the same connection.
+class ServerHandler
+{
+public:
+    virtual ~ServerHandler() {}
+
+    // A Client has opened a new image
+    virtual void onOpenImage(const int& client, DataHeader& header) = 0;
+
+    // A Client has sent a bucket. The pixel data points into the
+    // connection's receive buffer and is only valid during the call,
+    // unless DataPixels::isShared() and the handler takes its lease, then
+    // it stays valid until the lease is released. The AOV name stays valid
+    // until the connection is closed
+    virtual void onPixels(const int& client, DataPixels& pixels) = 0;
+
+    // The shared memory ring of the Client is about to be closed, every
+    // lease taken from its pixels must be released before returning
+    virtual void onRelease(const int& client) {}
+
+    // A Client has finished sending an image
+    virtual void onCloseImage(const int& client) = 0;
+
+    // The connection of a Client has been closed
+    virtual void onDisconnect(const int& client) {}
+
+    // Server::wake() has been called
+    virtual void onWake() {}
+};
+
+// Compression statistics of a connection
+struct CodecStats
+{
+    CodecStats(): buckets(0), compressed(0), deltas(0), received(0), decoded(0), seconds(0) {}
+
+    // Buckets received, and how many of them were compressed or deltas
+    long long buckets, compressed, deltas;
+
+    // Bytes of pixels received and after decompression
+    long long received, decoded;
+
+    // Time spent decompressing
+    double seconds;
+};
+
+class ServerConnection;
+class SessionRecorder;
 
  // Represents a listening Server, ready to accept incoming images
  // This class wraps up the provision of a TCP port, and handles incoming
  // connections from Client objects when they're ready to send image data
+ // Any number of Clients can be connected at the same time, their
+ // messages are read asynchronously and passed to a ServerHandler
 class Server
 {
 public:
     // Creates a new server. By default the Server is not connected at creation time
     Server();
-    
+
     // Creates a new server and calls connect() with the specified port number
     Server(int port);
-    
+
     // Shuts down the server, closing any open ports if the server is connected
     ~Server();
 
@@ -30,35 +87,97 @@ public:
     // available. To find out which port the server managed to connect to,
     // call getPort() afterwards
     void connect(int port, bool search=false);
-    
-    // Sets up the server to accept an incoming Client connections.
-    void accept();
-    
-    int listenType();
-
-    // This function blocks (and so may be require running on a separate thread),
-    // returning once a Client has sent a message.
-    // The returned Data object is filled with the relevant information and
-    // passed back ready for handling by the parent application
-    DataHeader listenHeader();
-    DataPixels listenPixels();
-    
-    // This can be used to exit a listening loop running on a separate thread
+
+    // Accepts incoming Client connections and passes their messages to the
+    // handler. This function blocks (and so may be require running on a
+    // separate thread), returning once quit() has been called.
+    // If the ATON_RECORD environment variable is set the messages are
+    // also recorded to the session file it names, see aton_session.h
+    void run(ServerHandler& handler);
+
+    // This can be used to exit the run() loop running on a separate thread
     void quit();
 
+    // Calls the handler's onWake() from the run() loop, in between the
+    // messages. Can be called from any thread
+    void wake();
+
     // Returns whether or not the server is connected to a port
     bool isConnected() { return mAcceptor.is_open(); }
 
     //! Returns the port the server is currently connected to
     int getPort() { return mPort; }
 
+    // Set the mask of the wire encodings the Clients may use, see
+    // PixelEncoding. Applies to the images opened from now on
+    void setEncodings(const int& mask) { mEncodings = mask; }
+
+    // Get the compression statistics of a connected Client
+    const CodecStats& codecStats(const int& client) const;
+
+    // Time the receive stage of the buckets into the given stats, which
+    // must outlive run(). NULL, the default, turns the timing off
+    void setPipelineStats(PipelineStats* stats) { mPipelineStats = stats; }
+
 private:
+    typedef boost::shared_ptr<ServerConnection> ConnectionPtr;
+
+    void startAccept();
+    void handleAccept(ConnectionPtr conn, const boost::system::error_code& ec);
+    void readType(ConnectionPtr conn);
+    void handleType(ConnectionPtr conn, const boost::system::error_code& ec);
+    void handleReply(ConnectionPtr conn, const boost::system::error_code& ec);
+    void handleHeader(ConnectionPtr conn, const boost::system::error_code& ec);
+    void handleClose(ConnectionPtr conn, const boost::system::error_code& ec);
+    void handleSize(ConnectionPtr conn, const boost::system::error_code& ec);
+    void handlePixels(ConnectionPtr conn, const boost::system::error_code& ec);
+    void handleAttachSize(ConnectionPtr conn, const boost::system::error_code& ec);
+    void handleAttach(ConnectionPtr conn, const boost::system::error_code& ec);
+    void handleWake();
+    
+    // Read the messages of the connection's shared memory ring, a few at a
+    // time to keep serving the other connections, then go back to the socket
+    void drainRing(ConnectionPtr conn);
+    
+    // Read every message left in the connection's shared memory ring
+    bool flushRing(ConnectionPtr conn);
+    
+    // Have the handler release the pixels it kept from the connection's
+    // ring, before the ring is closed
+    void releaseRing(ServerConnection* conn);
+    
+    // Unpack a pixels message body and pass it to the handler. The lease
+    // of a message read from the ring goes with its pixels if they're
+    // read in place, the caller releases it otherwise
+    bool dispatchPixels(ConnectionPtr conn, const char* data, const int& size,
+                        ShmLease& lease);
+    
+    void close(ConnectionPtr conn);
+    void closeAll();
+
     // Port we're listening to
     int mPort;
-    
+
+    // Image id given to the next connection
+    int mNextId;
+
+    // Wire encodings accepted from the Clients
+    boost::atomic<int> mEncodings;
+
+    // Handler of the current run() loop
+    ServerHandler* mHandler;
+
+    // Session file the messages are recorded to, if any
+    SessionRecorder* mRecorder;
+
+    // Latencies of the pipeline stages, if any
+    PipelineStats* mPipelineStats;
+
+    // Connected Clients by image id
+    std::map<int, ConnectionPtr> mConnections;
+
     // TCP stuff
     boost::asio::io_service mIoService;
-    boost::asio::ip::tcp::socket mSocket;
     boost::asio::ip::tcp::acceptor mAcceptor;
 };
 
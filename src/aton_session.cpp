@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_session.h"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace boost::interprocess;
+
+namespace
+{
+    const unsigned int kMagic = 0x41544f53;
+    const int kVersion = 1;
+
+    const size_t kHeaderSize = 16;
+
+    // type, client, time, size and padding
+    const size_t kRecordSize = sizeof(int) * 2 + sizeof(long long) + sizeof(int) * 2;
+
+    inline size_t pad_8(const size_t& size)
+    {
+        return (size + 7) & ~static_cast<size_t>(7);
+    }
+}
+
+SessionRecorder::SessionRecorder(const std::string& path): mFile(NULL), mSize(0)
+{
+    mFile = fopen(path.c_str(), "wb");
+    if (mFile == NULL)
+        throw std::runtime_error("Could not create session file " + path);
+
+    char header[kHeaderSize] = {0};
+    memcpy(header, &kMagic, sizeof(kMagic));
+    memcpy(header + sizeof(kMagic), &kVersion, sizeof(kVersion));
+    fwrite(header, 1, kHeaderSize, mFile);
+    mSize = kHeaderSize;
+
+    mStart = boost::posix_time::microsec_clock::universal_time();
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    fclose(mFile);
+}
+
+void SessionRecorder::write(const int& type,
+                            const int& client,
+                            const char* data,
+                            const int& size,
+                            const char* more,
+                            const int& more_size)
+{
+    using namespace boost::posix_time;
+    const long long time = (microsec_clock::universal_time() - mStart).total_microseconds();
+    const int body_size = size + more_size;
+    const int pad = 0;
+
+    char record[kRecordSize];
+    char* ptr = record;
+    memcpy(ptr, &type, sizeof(int));
+    ptr += sizeof(int);
+    memcpy(ptr, &client, sizeof(int));
+    ptr += sizeof(int);
+    memcpy(ptr, &time, sizeof(long long));
+    ptr += sizeof(long long);
+    memcpy(ptr, &body_size, sizeof(int));
+    ptr += sizeof(int);
+    memcpy(ptr, &pad, sizeof(int));
+    fwrite(record, 1, kRecordSize, mFile);
+
+    if (size > 0)
+        fwrite(data, 1, size, mFile);
+    if (more_size > 0)
+        fwrite(more, 1, more_size, mFile);
+
+    // Keep the next record aligned
+    static const char padding[8] = {0};
+    const size_t padded = pad_8(body_size);
+    fwrite(padding, 1, padded - body_size, mFile);
+    mSize += kRecordSize + padded;
+}
+
+SessionReader::SessionReader(const std::string& path): mData(NULL), mSize(0), mPos(0)
+{
+    try
+    {
+        file_mapping file(path.c_str(), read_only);
+        mapped_region region(file, read_only);
+        mFile.swap(file);
+        mRegion.swap(region);
+    }
+    catch (const interprocess_exception& e)
+    {
+        throw std::runtime_error("Could not open session file " + path + ", " + e.what());
+    }
+
+    mData = static_cast<const char*>(mRegion.get_address());
+    mSize = mRegion.get_size();
+
+    unsigned int magic = 0;
+    int version = 0;
+    if (mSize >= kHeaderSize)
+    {
+        memcpy(&magic, mData, sizeof(magic));
+        memcpy(&version, mData + sizeof(magic), sizeof(version));
+    }
+    if (magic != kMagic || version != kVersion)
+        throw std::runtime_error("Not an Aton session file " + path);
+
+    rewind();
+}
+
+bool SessionReader::next(SessionRecord& record)
+{
+    // A truncated record ends the session, the recording may have been
+    // interrupted
+    if (mPos > mSize || mSize - mPos < kRecordSize)
+        return false;
+
+    const char* ptr = mData + mPos;
+    memcpy(&record.type, ptr, sizeof(int));
+    ptr += sizeof(int);
+    memcpy(&record.client, ptr, sizeof(int));
+    ptr += sizeof(int);
+    memcpy(&record.time, ptr, sizeof(long long));
+    ptr += sizeof(long long);
+    memcpy(&record.size, ptr, sizeof(int));
+
+    const size_t body = mPos + kRecordSize;
+    if (record.size < 0 || mSize - body < static_cast<size_t>(record.size))
+        return false;
+
+    record.data = mData + body;
+    mPos = body + pad_8(record.size);
+    return true;
+}
+
+void SessionReader::rewind()
+{
+    mPos = kHeaderSize;
+}
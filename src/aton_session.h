@@ -0,0 +1,101 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_SESSION_H_
+#define ATON_SESSION_H_
+
+#include <cstdio>
+#include <string>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// Session files hold the messages received by a Server, so a render can
+// be replayed without Arnold or Nuke. The file starts with a 16 bytes
+// header [magic][version][pad], followed by records of
+// [type][client][time][size][pad][body], 8 bytes aligned. Bodies are the
+// messages as they are sent on the wire: the open image message, and the
+// pixels message with its samples decompressed and undeltaed but still
+// in their wire encoding, with ENCODING_INTEGER kept on the integer
+// AOVs. Close image records have no body.
+
+// Record types, same as the message keys
+enum SessionRecordType
+{
+    SESSION_OPEN = 0,
+    SESSION_PIXELS = 1,
+    SESSION_CLOSE = 2
+};
+
+// Record of a session file
+struct SessionRecord
+{
+    SessionRecord(): type(0), client(0), time(0), size(0), data(NULL) {}
+
+    // Type, see SessionRecordType
+    int type;
+
+    // Image id the Server gave to the Client
+    int client;
+
+    // Microseconds since the start of the recording
+    long long time;
+
+    // Body, points into the mapped file
+    int size;
+    const char* data;
+};
+
+// Appends the records to a session file
+// Used from the thread running Server::run() only
+class SessionRecorder
+{
+public:
+    // Creates the file, throws std::runtime_error if it can't
+    SessionRecorder(const std::string& path);
+
+    // Flushes and closes the file
+    ~SessionRecorder();
+
+    // Append a record, the body is made of data followed by more
+    void write(const int& type,
+               const int& client,
+               const char* data,
+               const int& size,
+               const char* more = NULL,
+               const int& more_size = 0);
+
+    // Bytes written so far
+    const long long& size() const { return mSize; }
+
+private:
+    FILE* mFile;
+    long long mSize;
+    boost::posix_time::ptime mStart;
+};
+
+// Reads a session file through a memory mapping
+class SessionReader
+{
+public:
+    // Maps the file, throws std::runtime_error if it's not a session file
+    SessionReader(const std::string& path);
+
+    // Get the next record, returns false at the end of the file
+    bool next(SessionRecord& record);
+
+    // Go back to the first record
+    void rewind();
+
+private:
+    boost::interprocess::file_mapping mFile;
+    boost::interprocess::mapped_region mRegion;
+
+    const char* mData;
+    size_t mSize, mPos;
+};
+
+#endif // ATON_SESSION_H_
@@ -0,0 +1,278 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_shm.h"
+
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <boost/atomic.hpp>
+
+using namespace boost::interprocess;
+
+namespace
+{
+    const unsigned int kMagic = 0x41544f4e;
+
+    // The messages start after the header, on their own cache lines
+    const size_t kHeaderSize = 256;
+
+    inline unsigned long long pad_8(const unsigned long long& size)
+    {
+        return (size + 7) & ~7ULL;
+    }
+}
+
+// Lives at the start of the shared memory segment
+// Positions only ever grow, the offset in the ring is position % capacity
+struct ShmRingHeader
+{
+    unsigned int magic;
+    unsigned int pad;
+    unsigned long long capacity;
+    char pad0[48];
+
+    // Written by the producer only
+    boost::atomic<unsigned long long> write_pos;
+    char pad1[56];
+
+    // Written by the consumer only
+    boost::atomic<unsigned long long> read_pos;
+    char pad2[56];
+
+    // Set by the consumer before going idle, cleared by whoever wakes it
+    boost::atomic<int> reader_asleep;
+};
+
+ShmRing::ShmRing(const std::string& name, const bool& owner): mName(name),
+                                                              mOwner(owner),
+                                                              mHeader(NULL),
+                                                              mData(NULL),
+                                                              mCapacity(0),
+                                                              mPos(0),
+                                                              mNext(0),
+                                                              mReleased(0),
+                                                              mHeld(0) {}
+
+ShmRing::~ShmRing()
+{
+    if (mOwner)
+        shared_memory_object::remove(mName.c_str());
+}
+
+ShmRing* ShmRing::create(const std::string& name, const size_t& capacity)
+{
+    shared_memory_object::remove(name.c_str());
+
+    ShmRing* ring = new ShmRing(name, true);
+    try
+    {
+        shared_memory_object shm(create_only, name.c_str(), read_write);
+        shm.truncate(kHeaderSize + pad_8(capacity));
+        mapped_region region(shm, read_write);
+        ring->mShm.swap(shm);
+        ring->mRegion.swap(region);
+    }
+    catch (...)
+    {
+        delete ring;
+        throw;
+    }
+
+    char* addr = static_cast<char*>(ring->mRegion.get_address());
+    ring->mHeader = new (addr) ShmRingHeader;
+    ring->mHeader->magic = kMagic;
+    ring->mHeader->capacity = pad_8(capacity);
+    ring->mHeader->write_pos.store(0);
+    ring->mHeader->read_pos.store(0);
+    ring->mHeader->reader_asleep.store(1);
+    ring->mData = addr + kHeaderSize;
+    ring->mCapacity = ring->mHeader->capacity;
+    return ring;
+}
+
+ShmRing* ShmRing::open(const std::string& name)
+{
+    ShmRing* ring = new ShmRing(name, false);
+    try
+    {
+        shared_memory_object shm(open_only, name.c_str(), read_write);
+        mapped_region region(shm, read_write);
+        ring->mShm.swap(shm);
+        ring->mRegion.swap(region);
+
+        char* addr = static_cast<char*>(ring->mRegion.get_address());
+        ShmRingHeader* header = reinterpret_cast<ShmRingHeader*>(addr);
+        if (ring->mRegion.get_size() < kHeaderSize ||
+            header->magic != kMagic ||
+            ring->mRegion.get_size() < kHeaderSize + header->capacity)
+            throw std::runtime_error("Invalid shared memory segment!");
+
+        ring->mHeader = header;
+        ring->mData = addr + kHeaderSize;
+        ring->mCapacity = header->capacity;
+
+        // Carry on from the last message released by an older consumer
+        ring->mNext = header->read_pos.load(boost::memory_order_acquire);
+        ring->mReleased = ring->mNext;
+    }
+    catch (...)
+    {
+        delete ring;
+        throw;
+    }
+    return ring;
+}
+
+char* ShmRing::reserve(const int& size)
+{
+    const unsigned long long need = 8 + pad_8(size);
+    unsigned long long pos = mHeader->write_pos.load(boost::memory_order_relaxed);
+    const unsigned long long read = mHeader->read_pos.load(boost::memory_order_acquire);
+
+    // Messages are contiguous, skip the end of the ring if it's too short
+    unsigned long long offset = pos % mCapacity;
+    const unsigned long long skip = offset + need > mCapacity ? mCapacity - offset : 0;
+
+    if (need > mCapacity || (pos - read) + skip + need > mCapacity)
+        return NULL;
+
+    if (skip > 0)
+    {
+        const int marker = -1;
+        memcpy(mData + offset, &marker, sizeof(int));
+        pos += skip;
+        offset = 0;
+    }
+
+    mPos = pos;
+    mNext = pos + need;
+    memcpy(mData + offset, &size, sizeof(int));
+    return mData + offset + 8;
+}
+
+bool ShmRing::commit()
+{
+    mHeader->write_pos.store(mNext, boost::memory_order_seq_cst);
+    return mHeader->reader_asleep.exchange(0, boost::memory_order_seq_cst) == 1;
+}
+
+bool ShmRing::empty() const
+{
+    return mHeader->read_pos.load(boost::memory_order_seq_cst) ==
+           mHeader->write_pos.load(boost::memory_order_seq_cst);
+}
+
+const char* ShmRing::peek(int& size, ShmLease& lease)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    unsigned long long pos = mNext;
+    const unsigned long long write = mHeader->write_pos.load(boost::memory_order_acquire);
+
+    while (pos != write)
+    {
+        const unsigned long long offset = pos % mCapacity;
+        int s;
+        memcpy(&s, mData + offset, sizeof(int));
+
+        // The size is written by the other process, the end of the ring
+        // is skipped up to the wrap and a message must fit before it, and
+        // neither can go past what has been written
+        if (s < 0)
+        {
+            if (pos + (mCapacity - offset) > write)
+            {
+                size = -1;
+                return NULL;
+            }
+            pos += mCapacity - offset;
+            continue;
+        }
+
+        if (offset + 8 + pad_8(s) > mCapacity || pos + 8 + pad_8(s) > write)
+        {
+            size = -1;
+            return NULL;
+        }
+
+        // Ours until it's released
+        const int released = 0;
+        memcpy(mData + offset + 4, &released, sizeof(int));
+
+        mNext = pos + 8 + pad_8(s);
+        mHeld++;
+        size = s;
+        lease = ShmLease(this, pos);
+        return mData + offset + 8;
+    }
+
+    // The skipped end of the ring is consumed right away
+    // unless it's behind messages still held
+    mNext = pos;
+    if (mHeld == 0)
+    {
+        mReleased = pos;
+        mHeader->read_pos.store(pos, boost::memory_order_release);
+    }
+    return NULL;
+}
+
+int ShmRing::held() const
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    return mHeld;
+}
+
+void ShmRing::release(const unsigned long long& pos)
+{
+    boost::mutex::scoped_lock lock(mMutex);
+    const int released = 1;
+    memcpy(mData + pos % mCapacity + 4, &released, sizeof(int));
+    mHeld--;
+
+    // Walk over the released messages in front, up to the first one still
+    // held. Every message up to mNext has been checked by peek()
+    unsigned long long next = mReleased;
+    while (next < mNext)
+    {
+        const unsigned long long offset = next % mCapacity;
+        int s, done;
+        memcpy(&s, mData + offset, sizeof(int));
+        memcpy(&done, mData + offset + 4, sizeof(int));
+
+        unsigned long long step = mCapacity - offset;
+        if (s >= 0)
+        {
+            if (done == 0)
+                break;
+            step = 8 + pad_8(s);
+        }
+        if (next + step > mNext)
+            break;
+        next += step;
+    }
+
+    if (next != mReleased)
+    {
+        mReleased = next;
+        mHeader->read_pos.store(next, boost::memory_order_release);
+    }
+}
+
+bool ShmRing::sleep()
+{
+    mHeader->reader_asleep.store(1, boost::memory_order_seq_cst);
+
+    // Messages peeked and still held don't keep the consumer awake, only
+    // the ones it hasn't read yet. seq_cst keeps the load after the store
+    boost::mutex::scoped_lock lock(mMutex);
+    if (mHeader->write_pos.load(boost::memory_order_seq_cst) != mNext)
+    {
+        mHeader->reader_asleep.store(0, boost::memory_order_seq_cst);
+        return false;
+    }
+    return true;
+}
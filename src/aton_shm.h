@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_SHM_H_
+#define ATON_SHM_H_
+
+#include <string>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread/mutex.hpp>
+
+struct ShmRingHeader;
+class ShmLease;
+
+// Single producer, single consumer ring of messages in shared memory
+// Used by a Client and a Server running on the same machine. The Client
+// writes bucket messages straight into the ring and the Server reads them
+// in place, only a doorbell message goes through the socket when the
+// Server is idle. Every message is stored as [size][released][body], 8 bytes
+// aligned, the consumer marks the messages it's done with so they can be
+// released in any order.
+class ShmRing
+{
+public:
+    // Creates a new shared memory segment (producer side)
+    static ShmRing* create(const std::string& name, const size_t& capacity);
+
+    // Opens an existing shared memory segment (consumer side)
+    static ShmRing* open(const std::string& name);
+
+    // Unmaps the segment, the producer also removes it
+    ~ShmRing();
+
+    // Name of the shared memory segment
+    const std::string& name() const { return mName; }
+
+    // Producer: get room for a message of the given size,
+    // returns NULL if the ring is full
+    char* reserve(const int& size);
+
+    // Producer: publish the reserved message. Returns true if the consumer
+    // is asleep and needs to be woken up
+    bool commit();
+
+    // Producer: check if every message has been consumed and released
+    bool empty() const;
+
+    // Consumer: get the message following the ones already peeked, its
+    // size and the lease to release it with, NULL if there is none. The
+    // size is -1 if the message doesn't fit in the ring, which can't be
+    // read any further. Peeked messages stay in place until they're released
+    const char* peek(int& size, ShmLease& lease);
+
+    // Consumer: number of messages peeked and not released
+    int held() const;
+
+    // Consumer: mark the consumer as asleep. Returns false, and stays awake,
+    // if a message arrived in the meantime that hasn't been peeked, the
+    // ones held don't count
+    bool sleep();
+
+private:
+    friend class ShmLease;
+
+    ShmRing(const std::string& name, const bool& owner);
+
+    // Consumer: done with the message peeked at the given position, the
+    // room of the released messages in front of the ring goes back to the
+    // producer. Can be called from any thread
+    void release(const unsigned long long& pos);
+
+    std::string mName;
+    bool mOwner;
+
+    boost::interprocess::shared_memory_object mShm;
+    boost::interprocess::mapped_region mRegion;
+
+    ShmRingHeader* mHeader;
+    char* mData;
+    unsigned long long mCapacity;
+
+    // Position and end of the reserved message, or the end of the
+    // peeked messages
+    unsigned long long mPos, mNext;
+
+    // Consumer: end of the released messages in front of the ring and the
+    // number of messages peeked and not released, both guarded by mMutex
+    // along with mNext
+    unsigned long long mReleased;
+    int mHeld;
+    mutable boost::mutex mMutex;
+};
+
+// A message peeked from a ShmRing, held in place until it's released.
+// Copies refer to the same message, only one of them may release it.
+// The ring must outlive the leases taken from it
+class ShmLease
+{
+public:
+    ShmLease(): mRing(NULL), mPos(0) {}
+
+    // Check if there's a message to release
+    bool valid() const { return mRing != NULL; }
+
+    // Give the message back to the producer, can be called from any thread
+    void release()
+    {
+        if (mRing != NULL)
+            mRing->release(mPos);
+        mRing = NULL;
+    }
+
+private:
+    friend class ShmRing;
+
+    ShmLease(ShmRing* ring, const unsigned long long& pos): mRing(ring), mPos(pos) {}
+
+    ShmRing* mRing;
+    unsigned long long mPos;
+};
+
+#endif // ATON_SHM_H_
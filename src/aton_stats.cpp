@@ -0,0 +1,146 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#include "aton_stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::add(const long long& us)
+{
+    int i = 0;
+    for (long long v = us; v > 0 && i < BUCKETS - 1; v >>= 1)
+        ++i;
+    mCounts[i].fetch_add(1, boost::memory_order_relaxed);
+
+    long long max = mMax.load(boost::memory_order_relaxed);
+    while (us > max && !mMax.compare_exchange_weak(max, us, boost::memory_order_relaxed)) {}
+}
+
+void LatencyHistogram::addSince(const boost::posix_time::ptime& since)
+{
+    using namespace boost::posix_time;
+    add((microsec_clock::universal_time() - since).total_microseconds());
+}
+
+long long LatencyHistogram::count() const
+{
+    long long count = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+        count += mCounts[i].load(boost::memory_order_relaxed);
+    return count;
+}
+
+long long LatencyHistogram::percentile(const double& p) const
+{
+    long long counts[BUCKETS];
+    long long count = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        counts[i] = mCounts[i].load(boost::memory_order_relaxed);
+        count += counts[i];
+    }
+    if (count == 0)
+        return 0;
+
+    // Rank of the percentile, then where it falls in its bucket
+    const double rank = p * count;
+    long long below = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        if (counts[i] > 0 && below + counts[i] >= rank)
+        {
+            // The last bucket ends at the longest duration
+            const double low = i > 0 ? static_cast<double>(1LL << (i - 1)) : 0;
+            const double high = std::min(static_cast<double>(1LL << i),
+                                         static_cast<double>(max()));
+            const long long us = static_cast<long long>(low + (high - low) * (rank - below) / counts[i]);
+            return std::min(us, max());
+        }
+        below += counts[i];
+    }
+    return max();
+}
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < BUCKETS; ++i)
+        mCounts[i] = 0;
+    mMax = 0;
+}
+
+const char* stage_name(const int& stage)
+{
+    static const char* names[STAGE_COUNT] = {"queue", "send", "receive", "blit", "viewer"};
+    return stage >= 0 && stage < STAGE_COUNT ? names[stage] : "";
+}
+
+std::string PipelineStats::summary(const int& stage) const
+{
+    const LatencyHistogram& h = mStages[stage];
+    char text[128];
+    snprintf(text, sizeof(text), "%lld buckets | p50 %lld us | p95 %lld us | p99 %lld us | max %lld us",
+             h.count(), h.percentile(0.5), h.percentile(0.95), h.percentile(0.99), h.max());
+    return text;
+}
+
+std::string PipelineStats::json() const
+{
+    std::ostringstream out;
+    out << "{\n  \"stages\": {";
+
+    bool first = true;
+    for (int s = 0; s < STAGE_COUNT; ++s)
+    {
+        const LatencyHistogram& h = mStages[s];
+        if (h.count() == 0)
+            continue;
+
+        out << (first ? "\n" : ",\n")
+            << "    \"" << stage_name(s) << "\": {"
+            << "\"count\": " << h.count()
+            << ", \"p50\": " << h.percentile(0.5)
+            << ", \"p95\": " << h.percentile(0.95)
+            << ", \"p99\": " << h.percentile(0.99)
+            << ", \"max\": " << h.max()
+            << ", \"histogram\": [";
+
+        // Counts of the buckets up to the last used one
+        int last = LatencyHistogram::BUCKETS - 1;
+        while (last > 0 && h.bucket(last) == 0)
+            --last;
+        for (int i = 0; i <= last; ++i)
+            out << (i > 0 ? ", " : "") << h.bucket(i);
+        out << "]}";
+        first = false;
+    }
+
+    out << "\n  },\n  \"unit\": \"us\",\n  \"histogram_bucket\": \"from 2^(i-1) to 2^i\"\n}\n";
+    return out.str();
+}
+
+bool PipelineStats::save(const std::string& path) const
+{
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == NULL)
+        return false;
+
+    const std::string text = json();
+    const bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+    return fclose(file) == 0 && ok;
+}
+
+void PipelineStats::reset()
+{
+    for (int s = 0; s < STAGE_COUNT; ++s)
+        mStages[s].reset();
+}
@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+#ifndef ATON_STATS_H_
+#define ATON_STATS_H_
+
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+// Histogram of durations in microseconds, bucket i counts the durations
+// from 2^(i-1) to 2^i, the percentiles are interpolated inside their
+// bucket. Updated without locks from any thread.
+class LatencyHistogram
+{
+public:
+    enum { BUCKETS = 32 };
+
+    LatencyHistogram();
+
+    // Add a duration in microseconds
+    void add(const long long& us);
+
+    // Add the time since the given one
+    void addSince(const boost::posix_time::ptime& since);
+
+    // Number of durations added
+    long long count() const;
+
+    // Longest duration added
+    long long max() const { return mMax; }
+
+    // Estimate of a percentile, p being within 0 and 1
+    long long percentile(const double& p) const;
+
+    // Number of durations in a bucket
+    long long bucket(const int& i) const { return mCounts[i]; }
+
+    void reset();
+
+private:
+    boost::atomic<long long> mCounts[BUCKETS];
+    boost::atomic<long long> mMax;
+};
+
+// Stages of a bucket on its way from the renderer to the viewer, each
+// one is timed by the process it happens in
+enum PipelineStage
+{
+    // From the driver queuing the bucket to the sender thread taking it
+    STAGE_QUEUE = 0,
+
+    // Writing the bucket to the socket or the shared memory ring
+    STAGE_SEND,
+
+    // From the Server noticing the message to handing the bucket over,
+    // reading, decompressing and decoding it
+    STAGE_RECEIVE,
+
+    // From the Server handing the bucket over to it being in the frame buffer
+    STAGE_BLIT,
+
+    // From the bucket being in the frame buffer to the viewer being invalidated
+    STAGE_VIEWER,
+
+    STAGE_COUNT
+};
+
+// Name of a PipelineStage
+const char* stage_name(const int& stage);
+
+// Latency histograms of the pipeline stages
+class PipelineStats
+{
+public:
+    LatencyHistogram& stage(const int& stage) { return mStages[stage]; }
+    const LatencyHistogram& stage(const int& stage) const { return mStages[stage]; }
+
+    // One line summary of a stage, count and percentiles
+    std::string summary(const int& stage) const;
+
+    // The stages with durations, their percentiles and histograms
+    std::string json() const;
+
+    // Write json() to a file, returns false if it can't be written
+    bool save(const std::string& path) const;
+
+    void reset();
+
+private:
+    LatencyHistogram mStages[STAGE_COUNT];
+};
+
+#endif // ATON_STATS_H_
@@ -0,0 +1,487 @@
+/*
+Copyright (c) 2016,
+Dan Bethell, Johannes Saam, Vahan Sosoyan, Brian Scherbinski.
+All rights reserved. See COPYING.txt for more details.
+*/
+
+// Synthetic render client for load and scaling tests. Render threads
+// write buckets of generated AOVs into a SendQueue the way the Arnold
+// driver does, either to a running Server such as a Nuke Aton node, or to
+// a Server of its own to measure the latency of every bucket.
+
+#include "aton_client.h"
+#include "aton_codec.h"
+#include "aton_latency.h"
+#include "aton_send_queue.h"
+#include "aton_server.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace boost::posix_time;
+
+namespace
+{
+    struct SynthAov
+    {
+        std::string name;
+        int spp;
+    };
+
+    struct SynthOptions
+    {
+        SynthOptions(): port(get_port()),
+                        xres(1920),
+                        yres(1080),
+                        bucket(64),
+                        order("spiral"),
+                        threads(4),
+                        passes(1),
+                        rate(0),
+                        half(false),
+                        compression(false),
+                        shm(true),
+                        delta_memory(0),
+                        queue_memory(256 * 1048576) {}
+
+        // Server to send to, a Server of our own if empty
+        std::string host;
+        int port;
+
+        int xres, yres, bucket;
+        std::vector<SynthAov> aovs;
+        std::string order;
+        int threads, passes;
+
+        // Buckets per second of all the threads, 0 for as fast as possible
+        double rate;
+
+        bool half, compression, shm;
+        size_t delta_memory, queue_memory;
+    };
+
+    void usage()
+    {
+        std::cerr << "Usage: aton_synth [options]\n"
+                  << "  --host HOST       Send to a running Server instead of our own\n"
+                  << "  --port PORT       Port of the running Server\n"
+                  << "  --res WxH         Resolution, 1920x1080 by default\n"
+                  << "  --aovs LIST       AOV names and samples per pixel, RGBA:4 by default,\n"
+                  << "                    e.g. RGBA:4,diffuse:3,specular:3,Z:1\n"
+                  << "  --bucket N        Bucket size, 64 by default\n"
+                  << "  --order ORDER     Bucket order, scanline, spiral, hilbert or random\n"
+                  << "  --threads N       Render threads, 4 by default\n"
+                  << "  --passes N        Progressive passes\n"
+                  << "  --rate N          Buckets per second of all the threads\n"
+                  << "  --half            Send the AOVs as half floats\n"
+                  << "  --compression     Compress the buckets sent through the socket\n"
+                  << "  --no-shm          Send the buckets through the socket only\n"
+                  << "  --delta MB        Memory for the deltas of the progressive passes\n"
+                  << "  --queue MB        Memory cap of the send queue, 256 by default\n";
+    }
+
+    // Parse a list of name:spp
+    bool parse_aovs(const std::string& list, std::vector<SynthAov>& aovs)
+    {
+        size_t begin = 0;
+        while (begin < list.size())
+        {
+            size_t end = list.find(',', begin);
+            if (end == std::string::npos)
+                end = list.size();
+
+            const std::string item = list.substr(begin, end - begin);
+            const size_t colon = item.find(':');
+            if (colon == std::string::npos || colon == 0)
+                return false;
+
+            SynthAov aov;
+            aov.name = item.substr(0, colon);
+            aov.spp = atoi(item.c_str() + colon + 1);
+            if (aov.spp != 1 && aov.spp != 3 && aov.spp != 4)
+                return false;
+            aovs.push_back(aov);
+            begin = end + 1;
+        }
+        return !aovs.empty();
+    }
+
+    bool parse_options(int argc, char* argv[], SynthOptions& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            const bool has_value = i + 1 < argc;
+            if (arg == "--host" && has_value)
+                options.host = argv[++i];
+            else if (arg == "--port" && has_value)
+                options.port = atoi(argv[++i]);
+            else if (arg == "--res" && has_value)
+            {
+                if (sscanf(argv[++i], "%dx%d", &options.xres, &options.yres) != 2)
+                    return false;
+            }
+            else if (arg == "--aovs" && has_value)
+            {
+                if (!parse_aovs(argv[++i], options.aovs))
+                    return false;
+            }
+            else if (arg == "--bucket" && has_value)
+                options.bucket = atoi(argv[++i]);
+            else if (arg == "--order" && has_value)
+                options.order = argv[++i];
+            else if (arg == "--threads" && has_value)
+                options.threads = atoi(argv[++i]);
+            else if (arg == "--passes" && has_value)
+                options.passes = atoi(argv[++i]);
+            else if (arg == "--rate" && has_value)
+                options.rate = atof(argv[++i]);
+            else if (arg == "--half")
+                options.half = true;
+            else if (arg == "--compression")
+                options.compression = true;
+            else if (arg == "--no-shm")
+                options.shm = false;
+            else if (arg == "--delta" && has_value)
+                options.delta_memory = static_cast<size_t>(atoi(argv[++i])) * 1048576;
+            else if (arg == "--queue" && has_value)
+                options.queue_memory = static_cast<size_t>(atoi(argv[++i])) * 1048576;
+            else
+                return false;
+        }
+
+        if (options.aovs.empty())
+            parse_aovs("RGBA:4", options.aovs);
+
+        return options.xres > 0 && options.yres > 0 && options.bucket > 0 &&
+               options.threads > 0 && options.passes > 0 && options.rate >= 0 &&
+               (options.order == "scanline" || options.order == "spiral" ||
+                options.order == "hilbert" || options.order == "random");
+    }
+
+    typedef std::pair<int, int> Bucket;
+
+    // Walk a square spiral out of the center bucket, like Arnold does
+    void spiral_order(const int& nx, const int& ny, std::vector<Bucket>& buckets)
+    {
+        const size_t count = static_cast<size_t>(nx) * ny;
+        int x = (nx - 1) / 2, y = (ny - 1) / 2;
+        const int dx[4] = {1, 0, -1, 0};
+        const int dy[4] = {0, 1, 0, -1};
+
+        buckets.push_back(Bucket(x, y));
+        for (int leg = 0; buckets.size() < count; ++leg)
+        {
+            const int length = leg / 2 + 1;
+            for (int step = 0; step < length; ++step)
+            {
+                x += dx[leg % 4];
+                y += dy[leg % 4];
+                if (x >= 0 && x < nx && y >= 0 && y < ny)
+                    buckets.push_back(Bucket(x, y));
+            }
+        }
+    }
+
+    // Follow a Hilbert curve over the power of 2 square covering the buckets
+    void hilbert_order(const int& nx, const int& ny, std::vector<Bucket>& buckets)
+    {
+        int n = 1;
+        while (n < nx || n < ny)
+            n *= 2;
+
+        for (long long d = 0; d < static_cast<long long>(n) * n; ++d)
+        {
+            int x = 0, y = 0;
+            long long t = d;
+            for (int s = 1; s < n; s *= 2)
+            {
+                const int rx = 1 & static_cast<int>(t / 2);
+                const int ry = 1 & static_cast<int>(t ^ rx);
+                if (ry == 0)
+                {
+                    if (rx == 1)
+                    {
+                        x = s - 1 - x;
+                        y = s - 1 - y;
+                    }
+                    std::swap(x, y);
+                }
+                x += s * rx;
+                y += s * ry;
+                t /= 4;
+            }
+            if (x < nx && y < ny)
+                buckets.push_back(Bucket(x, y));
+        }
+    }
+
+    // Bucket coordinates in render order
+    void bucket_order(const std::string& order,
+                      const int& nx,
+                      const int& ny,
+                      std::vector<Bucket>& buckets)
+    {
+        buckets.clear();
+        if (order == "spiral")
+            spiral_order(nx, ny, buckets);
+        else if (order == "hilbert")
+            hilbert_order(nx, ny, buckets);
+        else
+        {
+            for (int y = 0; y < ny; ++y)
+                for (int x = 0; x < nx; ++x)
+                    buckets.push_back(Bucket(x, y));
+
+            // Same order on every run
+            if (order == "random")
+            {
+                unsigned int seed = 1;
+                for (size_t i = buckets.size(); i > 1; --i)
+                {
+                    seed = seed * 1103515245 + 12345;
+                    std::swap(buckets[i - 1], buckets[(seed >> 8) % i]);
+                }
+            }
+        }
+    }
+
+    // State shared by the render threads
+    struct SynthRender
+    {
+        const SynthOptions* options;
+        SendQueue* queue;
+        LatencyHandler* handler;
+        int image;
+
+        std::vector<Bucket> buckets;
+        int pass;
+
+        // Next bucket of the pass, and buckets sent since the start
+        boost::atomic<int> next;
+        boost::atomic<long long> sent;
+        ptime start;
+    };
+
+    // Fill a bucket with a gradient and noise that fades with the passes,
+    // so the passes differ like the ones of a progressive render do
+    void shade(const std::vector<float>& noise,
+               const int& xo, const int& yo,
+               const int& sx, const int& sy,
+               const int& spp, const int& pass,
+               const int& xres, const int& yres,
+               float* out)
+    {
+        const float scale = 1.0f / (pass + 1);
+        const float fx = 1.0f / xres, fy = 1.0f / yres;
+        for (int y = 0; y < sy; ++y)
+        {
+            const float v = (yo + y) * fy;
+            for (int x = 0; x < sx; ++x)
+            {
+                const float u = (xo + x) * fx;
+                const int i = (y * sx + x) * spp;
+                for (int c = 0; c < spp; ++c)
+                    out[i + c] = (c == 3) ? 1.0f : u * (c + 1) * 0.5f + v + noise[i + c] * scale;
+            }
+        }
+    }
+
+    void render_thread(SynthRender* render, const int& thread)
+    {
+        const SynthOptions& options = *render->options;
+        const int bucket = options.bucket;
+        const size_t num_aovs = options.aovs.size();
+
+        // Noise of every AOV, different for every thread
+        std::vector<std::vector<float> > noise(num_aovs);
+        std::vector<std::vector<float> > data(num_aovs);
+        unsigned int seed = thread + 1;
+        for (size_t a = 0; a < num_aovs; ++a)
+        {
+            const size_t size = static_cast<size_t>(bucket) * bucket * options.aovs[a].spp;
+            noise[a].resize(size);
+            data[a].resize(size);
+            for (size_t i = 0; i < size; ++i)
+            {
+                seed = seed * 1103515245 + 12345;
+                noise[a][i] = ((seed >> 8) & 0xffff) / 65535.0f - 0.5f;
+            }
+        }
+
+        while (true)
+        {
+            const int index = render->next++;
+            if (index >= static_cast<int>(render->buckets.size()))
+                break;
+
+            // Wait for the time the bucket is due at
+            if (options.rate > 0)
+            {
+                const long long n = render->sent++;
+                const ptime due = render->start +
+                                  microseconds(static_cast<long long>(n * 1e6 / options.rate));
+                const ptime now = microsec_clock::universal_time();
+                if (due > now)
+                    boost::this_thread::sleep(due - now);
+            }
+
+            const int xo = render->buckets[index].first * bucket;
+            const int yo = render->buckets[index].second * bucket;
+            const int sx = std::min(bucket, options.xres - xo);
+            const int sy = std::min(bucket, options.yres - yo);
+
+            for (size_t a = 0; a < num_aovs; ++a)
+            {
+                const SynthAov& aov = options.aovs[a];
+                shade(noise[a], xo, yo, sx, sy, aov.spp, render->pass,
+                      options.xres, options.yres, &data[a][0]);
+
+                DataPixels dp(options.xres, options.yres, xo, yo, sx, sy, aov.spp,
+                              0, 0, aov.name.c_str(), &data[a][0]);
+
+                // Data AOVs keep their full precision, like in the driver
+                if (options.half && !aov_full_precision(aov.name.c_str()))
+                    dp.setEncoding(ENCODING_FLOAT16);
+
+                if (render->handler != NULL)
+                    render->handler->sent(render->image, dp);
+                render->queue->sendPixels(dp);
+            }
+        }
+    }
+
+    void run_server(Server* server, LatencyHandler* handler)
+    {
+        server->run(*handler);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    SynthOptions options;
+    if (!parse_options(argc, argv, options))
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        // Our own Server, unless we're sending to a running one
+        Server* server = NULL;
+        LatencyHandler handler;
+        PipelineStats server_stats;
+        boost::thread server_thread;
+        std::string host = options.host;
+        int port = options.port;
+        if (host.empty())
+        {
+            server = new Server();
+            server->connect(9301, true);
+            server->setPipelineStats(&server_stats);
+            server_thread = boost::thread(boost::bind(run_server, server, &handler));
+            host = "127.0.0.1";
+            port = server->getPort();
+        }
+
+        Client* client = new Client(host, port);
+        client->useSharedMemory(options.shm);
+        client->useCompression(options.compression);
+        client->useDelta(options.delta_memory);
+        SendQueue* queue = new SendQueue(client, options.queue_memory);
+
+        SynthRender render;
+        render.options = &options;
+        render.queue = queue;
+        render.handler = server != NULL ? &handler : NULL;
+        render.sent = 0;
+
+        const int nx = (options.xres + options.bucket - 1) / options.bucket;
+        const int ny = (options.yres + options.bucket - 1) / options.bucket;
+        bucket_order(options.order, nx, ny, render.buckets);
+
+        // The image id is known once the open image message is sent
+        DataHeader dh(gen_unique_id(), options.xres, options.yres,
+                      static_cast<long long>(options.xres) * options.yres);
+        queue->openImage(dh);
+        queue->flush();
+        render.image = client->imageId();
+
+        std::string error;
+        if (queue->takeError(error))
+            throw std::runtime_error(error);
+
+        long long bytes_per_pass = 0;
+        for (size_t a = 0; a < options.aovs.size(); ++a)
+        {
+            const SynthAov& aov = options.aovs[a];
+            const int encoding = options.half && !aov_full_precision(aov.name.c_str()) ?
+                                 ENCODING_FLOAT16 : ENCODING_FLOAT32;
+            bytes_per_pass += encoded_size(encoding, options.xres * options.yres * aov.spp);
+        }
+
+        printf("%dx%d, %d AOVs, %d buckets of %d px in %s order, %d threads, %d passes\n",
+               options.xres, options.yres, static_cast<int>(options.aovs.size()),
+               static_cast<int>(render.buckets.size()), options.bucket,
+               options.order.c_str(), options.threads, options.passes);
+
+        render.start = microsec_clock::universal_time();
+        for (render.pass = 0; render.pass < options.passes; ++render.pass)
+        {
+            render.next = 0;
+            boost::thread_group threads;
+            for (int t = 0; t < options.threads; ++t)
+                threads.create_thread(boost::bind(render_thread, &render, t));
+            threads.join_all();
+        }
+
+        queue->closeImage();
+        queue->flush();
+
+        const long long buckets = static_cast<long long>(render.buckets.size()) *
+                                  options.aovs.size() * options.passes;
+        const double bytes = static_cast<double>(bytes_per_pass) * options.passes;
+
+        // Let our Server catch up before stopping it
+        if (server != NULL)
+            handler.wait(buckets);
+        const double elapsed = (microsec_clock::universal_time() - render.start).total_microseconds() / 1e6;
+
+        if (queue->takeError(error))
+            std::cerr << "aton_synth: " << error << std::endl;
+        const std::string queue_summary = queue->stats().summary(STAGE_QUEUE);
+        const std::string send_summary = queue->stats().summary(STAGE_SEND);
+        delete queue;
+
+        printf("%lld buckets, %.1f MB in %.3f s: %.0f buckets/s, %.1f MB/s\n",
+               buckets, bytes / 1048576.0, elapsed,
+               elapsed > 0 ? buckets / elapsed : 0,
+               elapsed > 0 ? bytes / 1048576.0 / elapsed : 0);
+
+        printf("queue: %s\nsend: %s\n", queue_summary.c_str(), send_summary.c_str());
+        if (server != NULL)
+        {
+            printf("receive: %s\n", server_stats.summary(STAGE_RECEIVE).c_str());
+            handler.print();
+            if (handler.received < buckets)
+                printf("%lld buckets not received\n", buckets - handler.received);
+
+            server->quit();
+            server_thread.join();
+            delete server;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "aton_synth: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}